@@ -0,0 +1,642 @@
+// Compares the version 1 program encoding with version 2: the size of the programs at each
+// parameter precision, how long it takes to emit them, and how long it takes to open them (which
+// validates them and decodes the quantized params), to read their ops for a run, and to patch a
+// param. The graph is a random mix of the node types in node_templates.xml, with the parameters
+// stored the way Node::Param stores them. The version 1 emitter is the compiler's code from before
+// version 2, with a resize per value and a map lookup per parameter, and the version 2 one is the
+// compiler's code now, with a layout per op type. Both fill in what the compiler keeps of a
+// program.
+//
+// Build (from the repo root):
+//   g++ -std=c++14 -O2 -pthread -Isrc bench/bench_bytecode.cpp src/texture_vm.cpp src/thread_pool.cpp src/vm_bytecode.cpp src/vm_reader.cpp -o bench_bytecode
+//
+// Usage: bench_bytecode [ops] [iterations]
+
+#include "texture_vm.hpp"
+#include "vm_bytecode.hpp"
+#include "vm_reader.hpp"
+
+#include <algorithm>
+#include <assert.h>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+enum class ParamType
+{
+  Int,
+  Float,
+  Vec2,
+  Color,
+};
+
+enum
+{
+  PARAM_FLAG_HAS_MIN_MAX = 0x1,
+};
+
+struct ParamDesc
+{
+  ParamType type;
+  bool bounded;
+  float minValue, maxValue;
+};
+
+struct Template
+{
+  u8 op;
+  int numInputs;
+  vector<ParamDesc> params;
+};
+
+// the same fields as ofApp's ParamValue
+struct ParamValue
+{
+  u32 flags = 0;
+  struct
+  {
+    int value = 0;
+    int minValue, maxValue;
+  } iValue;
+  struct
+  {
+    float value = 0;
+    float minValue, maxValue;
+  } fValue;
+  struct
+  {
+    struct
+    {
+      float x = 0, y = 0;
+    } value;
+    float minValue, maxValue;
+  } vValue;
+  struct
+  {
+    float r = 0, g = 0, b = 0, a = 0;
+  } cValue;
+  bool bValue = false;
+  string sValue;
+};
+
+struct Node
+{
+  struct Param
+  {
+    string name;
+    ParamType type;
+    ParamValue value;
+  };
+
+  const Template* t;
+  u8 output;
+  vector<u8> inputs;
+  vector<Param> params;
+};
+
+// what the compiler keeps of a program, as in CompiledProgram
+struct Program
+{
+  vector<char> buf;
+  vector<int> opCBufferPos;
+  vector<int> opCBufferSize;
+  vector<vector<int>> opFieldOffsets;
+};
+
+enum class Precision
+{
+  Full,
+  Bits16,
+  Bits8,
+};
+
+//--------------------------------------------------------------
+struct BinaryWriter
+{
+  template <typename T>
+  void write(const T& v)
+  {
+    buf.insert(buf.end(), (const char*)&v, (const char*)&v + sizeof(T));
+  }
+
+  vector<char> buf;
+};
+
+//--------------------------------------------------------------
+struct BinaryWriterV1
+{
+  template <typename T>
+  void write(const T& v)
+  {
+    size_t oldPos = buf.size();
+    buf.resize(buf.size() + sizeof(T));
+    memcpy(buf.data() + oldPos, (const void*)&v, sizeof(T));
+  }
+
+  template <typename T>
+  void writeAt(const T& v, int pos)
+  {
+    assert(pos + sizeof(T) <= buf.size());
+    memcpy(buf.data() + pos, (const void*)&v, sizeof(T));
+  }
+
+  int getPos() const { return (int)buf.size(); }
+
+  vector<char> buf;
+};
+
+//--------------------------------------------------------------
+static vector<Template> createTemplates()
+{
+  ParamDesc color = { ParamType::Color, true, 0, 1 };
+  ParamDesc unitVec2 = { ParamType::Vec2, true, -1, 1 };
+  ParamDesc power = { ParamType::Float, true, 0.1f, 10 };
+  ParamDesc unbounded = { ParamType::Float, false, 0, 0 };
+  return {
+    { VM_OP_FILL, 0, { color } },
+    { VM_OP_RADIAL_GRADIENT, 0, { unitVec2, power } },
+    { VM_OP_LINEAR_GRADIENT, 0, { unitVec2, unitVec2, power } },
+    { VM_OP_SINUS, 0, { unbounded, unbounded, unbounded } },
+    { VM_OP_NOISE,
+        0,
+        { { ParamType::Int, true, 1, 10 },
+            { ParamType::Float, true, 0.1f, 20 },
+            { ParamType::Float, true, 0.05f, 1 },
+            { ParamType::Float, true, 0.05f, 1 } } },
+    { VM_OP_MODULATE, 2, { { ParamType::Float, true, 0, 2 }, { ParamType::Float, true, 0, 2 } } },
+    { VM_OP_ROTATE_SCALE, 1, { unbounded, { ParamType::Vec2, false, 0, 0 } } },
+    { VM_OP_DISTORT, 3, { unbounded } },
+    { VM_OP_COLOR_GRADIENT, 1, { color, color } },
+  };
+}
+
+//--------------------------------------------------------------
+static float randomValue(const ParamDesc& desc)
+{
+  float range = desc.bounded ? desc.maxValue - desc.minValue : 100;
+  return desc.minValue + range * rand() / RAND_MAX;
+}
+
+//--------------------------------------------------------------
+static vector<Node> createGraph(const vector<Template>& templates, int numOps)
+{
+  srand(1);
+  vector<Node> nodes;
+  for (int i = 0; i < numOps; ++i)
+  {
+    // the first ops need generators, as there's nothing to read yet
+    const Template* t = &templates[rand() % templates.size()];
+    while (t->numInputs > i)
+      t = &templates[rand() % templates.size()];
+
+    Node node;
+    node.t = t;
+    node.output = (u8)(VM_NUM_AUX_TEXTURES + i % 32);
+    for (int j = 0; j < t->numInputs; ++j)
+      node.inputs.push_back((u8)(VM_NUM_AUX_TEXTURES + (i - 1 - j) % 32));
+
+    for (const ParamDesc& desc : t->params)
+    {
+      Node::Param param;
+      param.name = "param";
+      param.type = desc.type;
+      ParamValue& v = param.value;
+      v.flags = desc.bounded ? PARAM_FLAG_HAS_MIN_MAX : 0;
+      v.iValue.minValue = (int)desc.minValue;
+      v.iValue.maxValue = (int)desc.maxValue;
+      v.fValue.minValue = v.vValue.minValue = desc.minValue;
+      v.fValue.maxValue = v.vValue.maxValue = desc.maxValue;
+      if (desc.type == ParamType::Int)
+      {
+        v.iValue.value = (int)roundf(randomValue(desc));
+      }
+      else if (desc.type == ParamType::Float)
+      {
+        v.fValue.value = randomValue(desc);
+      }
+      else if (desc.type == ParamType::Vec2)
+      {
+        v.vValue.value.x = randomValue(desc);
+        v.vValue.value.y = randomValue(desc);
+      }
+      else
+      {
+        v.cValue.r = randomValue(desc);
+        v.cValue.g = randomValue(desc);
+        v.cValue.b = randomValue(desc);
+        v.cValue.a = randomValue(desc);
+      }
+      node.params.push_back(param);
+    }
+    nodes.push_back(node);
+  }
+  return nodes;
+}
+
+//--------------------------------------------------------------
+// The compiler's writeCBuffer from before version 2
+static u16 writeCBufferV1(BinaryWriterV1* w, const Node& node, vector<int>* fieldOffsets)
+{
+  static unordered_map<ParamType, int> paramSize = {
+    { ParamType::Int, sizeof(int) },
+    { ParamType::Float, sizeof(float) },
+    { ParamType::Vec2, 2 * sizeof(float) },
+    { ParamType::Color, 4 * sizeof(float) },
+  };
+
+  u16 cbufferSize = 0;
+  int startPos = w->getPos();
+  int curOffset = 0;
+  for (const Node::Param& param : node.params)
+  {
+    int s = paramSize[param.type];
+    if (curOffset + s > 4)
+    {
+      for (int i = 0; i < (curOffset + s) % 4; ++i)
+        w->write(0.0f);
+      curOffset = 0;
+    }
+
+    if (fieldOffsets)
+      fieldOffsets->push_back(w->getPos() - startPos);
+
+    if (param.type == ParamType::Int)
+    {
+      w->write(param.value.iValue.value);
+    }
+    else if (param.type == ParamType::Float)
+    {
+      w->write(param.value.fValue.value);
+    }
+    else if (param.type == ParamType::Vec2)
+    {
+      w->write(param.value.vValue.value.x);
+      w->write(param.value.vValue.value.y);
+    }
+    else if (param.type == ParamType::Color)
+    {
+      w->write(param.value.cValue.r);
+      w->write(param.value.cValue.g);
+      w->write(param.value.cValue.b);
+      w->write(param.value.cValue.a);
+    }
+    cbufferSize += s;
+    curOffset = (curOffset + s) % 4;
+  }
+
+  return cbufferSize;
+}
+
+//--------------------------------------------------------------
+// The compiler's emitter from before version 2
+static void emitV1(const vector<Node>& nodes, Program* prg)
+{
+  BinaryWriterV1 w;
+  w.write((u8)VM_PRG_VERSION);
+  w.write((u8)(VM_NUM_AUX_TEXTURES + 32));
+  for (const Node& node : nodes)
+  {
+    w.write(node.t->op);
+    w.write(node.output);
+    w.write((u8)node.inputs.size());
+    for (u8 input : node.inputs)
+      w.write(input);
+
+    u16 cbufferSize = 0;
+    int cbufferSizePos = w.getPos();
+    w.write(cbufferSize);
+
+    vector<int> fieldOffsets;
+    prg->opCBufferPos.push_back(w.getPos());
+    cbufferSize = writeCBufferV1(&w, node, &fieldOffsets);
+    w.writeAt(cbufferSize, cbufferSizePos);
+    prg->opFieldOffsets.push_back(fieldOffsets);
+  }
+
+  prg->buf = w.buf;
+}
+
+//--------------------------------------------------------------
+// The compiler's writeCBuffer
+static void writeCBuffer(BinaryWriter* w, const Node& node)
+{
+  for (const Node::Param& param : node.params)
+  {
+    if (param.type == ParamType::Int)
+    {
+      w->write(param.value.iValue.value);
+    }
+    else if (param.type == ParamType::Float)
+    {
+      w->write(param.value.fValue.value);
+    }
+    else if (param.type == ParamType::Vec2)
+    {
+      w->write(param.value.vValue.value.x);
+      w->write(param.value.vValue.value.y);
+    }
+    else if (param.type == ParamType::Color)
+    {
+      w->write(param.value.cValue.r);
+      w->write(param.value.cValue.g);
+      w->write(param.value.cValue.b);
+      w->write(param.value.cValue.a);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+// The compiler's paramLayout
+static int paramLayout(
+    const Node& node, Precision precision, VmParamLayout* layout, vector<int>* fieldOffsets)
+{
+  VmParamEncoding quantized = precision == Precision::Bits8 ? VM_PARAM_Q8 : VM_PARAM_Q16;
+  int size = 0;
+  auto add = [&](u8 encoding, float minValue, float maxValue) {
+    VmParamField field;
+    field.encoding = encoding;
+    field.minValue = minValue;
+    field.maxValue = maxValue;
+    layout->push_back(field);
+    size += vmParamSize(encoding);
+  };
+
+  for (const Node::Param& param : node.params)
+  {
+    if (fieldOffsets)
+      fieldOffsets->push_back(size);
+
+    const ParamValue& v = param.value;
+    bool bounded = precision != Precision::Full && (v.flags & PARAM_FLAG_HAS_MIN_MAX);
+    if (param.type == ParamType::Int)
+    {
+      bool small = bounded && v.iValue.maxValue >= v.iValue.minValue
+                   && v.iValue.maxValue - v.iValue.minValue <= 0xff;
+      add(small ? VM_PARAM_I8 : VM_PARAM_I32, (float)v.iValue.minValue, (float)v.iValue.maxValue);
+    }
+    else if (param.type == ParamType::Float)
+    {
+      bool q = bounded && v.fValue.maxValue > v.fValue.minValue;
+      add(q ? quantized : VM_PARAM_F32, v.fValue.minValue, v.fValue.maxValue);
+    }
+    else if (param.type == ParamType::Vec2)
+    {
+      bool q = bounded && v.vValue.maxValue > v.vValue.minValue;
+      add(q ? quantized : VM_PARAM_F32, v.vValue.minValue, v.vValue.maxValue);
+      add(q ? quantized : VM_PARAM_F32, v.vValue.minValue, v.vValue.maxValue);
+    }
+    else if (param.type == ParamType::Color)
+    {
+      bool q = precision != Precision::Full;
+      for (int i = 0; i < 4; ++i)
+        add(q ? quantized : VM_PARAM_F32, 0, 1);
+    }
+  }
+
+  return size;
+}
+
+//--------------------------------------------------------------
+// The compiler's emitter
+static void emitV2(const vector<Node>& nodes, Precision precision, Program* prg)
+{
+  struct OpLayout
+  {
+    u32 id;
+    int size = 0;
+    vector<int> fieldOffsets;
+  };
+  unordered_map<int, OpLayout> opLayouts;
+
+  VmProgramWriter writer(VM_PRG_VERSION_2);
+  BinaryWriter cbuffer;
+  VmParamLayout layout;
+  vector<u8> inputs;
+  for (const Node& node : nodes)
+  {
+    inputs.clear();
+    for (u8 input : node.inputs)
+      inputs.push_back(input);
+
+    auto layoutIt = opLayouts.find(node.t->op);
+    if (layoutIt == opLayouts.end())
+    {
+      OpLayout opLayout;
+      layout.clear();
+      opLayout.size = paramLayout(node, precision, &layout, &opLayout.fieldOffsets);
+      opLayout.id = writer.addLayout(layout);
+      layoutIt = opLayouts.insert(make_pair(node.t->op, opLayout)).first;
+    }
+
+    cbuffer.buf.clear();
+    writeCBuffer(&cbuffer, node);
+
+    const OpLayout& opLayout = layoutIt->second;
+    writer.addOp(node.t->op,
+        node.output,
+        inputs.data(),
+        (int)inputs.size(),
+        opLayout.id,
+        cbuffer.buf.data());
+    prg->opCBufferSize.push_back(opLayout.size);
+    prg->opFieldOffsets.push_back(opLayout.fieldOffsets);
+  }
+
+  writer.finish((u8)(VM_NUM_AUX_TEXTURES + 32), &prg->buf, &prg->opCBufferPos);
+}
+
+//--------------------------------------------------------------
+// Checks the decoded program against the nodes, with the quantization error the precision allows
+static bool verify(const Program& prg, const vector<Node>& nodes, Precision precision)
+{
+  VmPrgReader reader;
+  if (!reader.open(prg.buf.data(), prg.buf.size()) || reader.numOps() != nodes.size())
+    return false;
+
+  VmParamLayout layout;
+  BinaryWriter values;
+  VmOpView op;
+  for (size_t i = 0; reader.next(&op); ++i)
+  {
+    const Node& node = nodes[i];
+    values.buf.clear();
+    writeCBuffer(&values, node);
+    if (op.op != node.t->op || op.output != node.output || op.numInputs != node.inputs.size()
+        || op.cbufferSize != values.buf.size()
+        || op.params - prg.buf.data() != prg.opCBufferPos[i])
+    {
+      return false;
+    }
+
+    for (size_t j = 0; j < node.inputs.size(); ++j)
+    {
+      if (op.inputs[j] != node.inputs[j])
+        return false;
+    }
+
+    const char* cbuffer = op.cbuffer;
+    layout.clear();
+    paramLayout(node, precision, &layout, nullptr);
+    for (size_t j = 0; j < layout.size(); ++j)
+    {
+      const VmParamField& field = layout[j];
+      const char* decoded = cbuffer + j * sizeof(u32);
+      const char* value = values.buf.data() + j * sizeof(u32);
+      if (field.encoding == VM_PARAM_F32 || field.encoding == VM_PARAM_I32
+          || field.encoding == VM_PARAM_I8)
+      {
+        if (memcmp(decoded, value, sizeof(u32)) != 0)
+          return false;
+        continue;
+      }
+
+      float a, b;
+      memcpy(&a, decoded, sizeof(float));
+      memcpy(&b, value, sizeof(float));
+      float steps = field.encoding == VM_PARAM_Q16 ? 0xffff : 0xff;
+      if (fabsf(a - b) > (field.maxValue - field.minValue) / steps)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+template <typename Fn>
+static double timeMedian(int iterations, Fn fn)
+{
+  vector<double> times;
+  for (int i = 0; i < iterations; ++i)
+  {
+    auto start = chrono::high_resolution_clock::now();
+    fn();
+    auto end = chrono::high_resolution_clock::now();
+    times.push_back(chrono::duration<double, micro>(end - start).count());
+  }
+  sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+//--------------------------------------------------------------
+struct DecodeTimes
+{
+  double open;
+  double run;
+  double patch;
+};
+
+// Open is paid once per program, run for every run of it, and patch for every parameter edit
+static DecodeTimes timeDecode(vector<char> prg, int iterations)
+{
+  DecodeTimes times;
+
+  // NB: like the vm, the reader is reused, so its tables are only allocated the first time
+  VmPrgReader reader;
+  times.open = timeMedian(iterations, [&] { reader.open(prg.data(), prg.size()); });
+
+  // what binding the ops reads of them. The sum keeps the loop from being optimized out
+  volatile u32 sum = 0;
+  times.run = timeMedian(iterations, [&] {
+    u32 s = 0;
+    for (u32 i = 0; i < reader.numOps(); ++i)
+    {
+      const VmOpView& op = reader.op(i);
+      s += op.output + op.numInputs + (u32)(size_t)op.cbuffer + op.cbufferSize;
+    }
+    sum = sum + s;
+  });
+
+  // the first param of an op in the middle, the way the compiler patches a slider edit
+  u32 opIndex = reader.numOps() / 2;
+  vector<char> patch(sizeof(VmPatch) + sizeof(u32));
+  VmPatch header;
+  header.opIndex = (u16)opIndex;
+  header.offset = 0;
+  header.size = (u16)min<u32>(sizeof(u32), reader.op(opIndex).paramsSize);
+  patch.resize(sizeof(VmPatch) + header.size);
+  memcpy(patch.data(), &header, sizeof(VmPatch));
+  memcpy(patch.data() + sizeof(VmPatch), reader.op(opIndex).params, header.size);
+  times.patch = timeMedian(iterations, [&] {
+    vmApplyPatch(&prg, &reader, patch.data(), patch.size());
+  });
+
+  return times;
+}
+
+//--------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  int numOps = argc > 1 ? atoi(argv[1]) : 200;
+  int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+
+  vector<Template> templates = createTemplates();
+  vector<Node> nodes = createGraph(templates, numOps);
+
+  // NB: like the compiler, every emit starts from an empty program
+  Program prg;
+  emitV1(nodes, &prg);
+  if (!verify(prg, nodes, Precision::Full))
+  {
+    printf("version 1 round trip failed\n");
+    return 1;
+  }
+
+  printf("%d ops\n", numOps);
+  double emit = timeMedian(iterations, [&] {
+    Program p;
+    emitV1(nodes, &p);
+  });
+  DecodeTimes decode = timeDecode(prg.buf, iterations);
+  printf("  %-14s %7zu bytes, emit: %7.1f us, open: %7.1f us, run: %6.2f us, patch: %5.2f us\n",
+      "v1",
+      prg.buf.size(),
+      emit,
+      decode.open,
+      decode.run,
+      decode.patch);
+
+  struct Mode
+  {
+    const char* name;
+    Precision precision;
+  };
+  Mode modes[] = {
+    { "v2", Precision::Full },
+    { "v2 16 bits", Precision::Bits16 },
+    { "v2 8 bits", Precision::Bits8 },
+  };
+
+  for (const Mode& mode : modes)
+  {
+    prg = Program();
+    emitV2(nodes, mode.precision, &prg);
+    if (!verify(prg, nodes, mode.precision))
+    {
+      printf("%s round trip failed\n", mode.name);
+      return 1;
+    }
+
+    emit = timeMedian(iterations, [&] {
+      Program p;
+      emitV2(nodes, mode.precision, &p);
+    });
+    decode = timeDecode(prg.buf, iterations);
+    printf("  %-14s %7zu bytes, emit: %7.1f us, open: %7.1f us, run: %6.2f us, patch: %5.2f us\n",
+        mode.name,
+        prg.buf.size(),
+        emit,
+        decode.open,
+        decode.run,
+        decode.patch);
+  }
+
+  return 0;
+}
@@ -0,0 +1,210 @@
+// Times the topological sort used by ofApp::createGraph, and memorySchedule, on synthetic graphs,
+// and compares the sort to the quadratic one it replaced. Then compares the pool textures the Kahn
+// order and memorySchedule need on the same kind of graphs, built in creation order like the
+// editor does.
+//
+// Build (from the repo root):
+//   g++ -std=c++14 -O2 -Isrc bench/bench_topo_sort.cpp src/graph_sort.cpp src/texture_alloc.cpp -o bench_topo_sort
+//
+// Usage: bench_topo_sort [max nodes]
+
+#include "graph_sort.hpp"
+#include "texture_alloc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace std;
+
+//--------------------------------------------------------------
+// Texture graph lookalike: every node has up to 3 inputs from earlier nodes, mostly close by. For
+// the sort timings the node list is shuffled so it's not already sorted
+static void createGraph(int numNodes, bool shuffled, int seed, vector<pair<int, int>>* edges)
+{
+  mt19937 rng(seed);
+  vector<int> perm(numNodes);
+  for (int i = 0; i < numNodes; ++i)
+    perm[i] = i;
+  if (shuffled)
+    shuffle(perm.begin(), perm.end(), rng);
+
+  for (int i = 1; i < numNodes; ++i)
+  {
+    int numInputs = rng() % 4;
+    for (int j = 0; j < numInputs; ++j)
+    {
+      int window = min(i, 64);
+      int from = i - 1 - (int)(rng() % window);
+      edges->push_back(make_pair(perm[from], perm[i]));
+    }
+  }
+}
+
+//--------------------------------------------------------------
+// The sort createGraph used to do: repeatedly grab the first node without in-edges
+static bool legacySort(int numNodes, const vector<pair<int, int>>& edges, vector<int>* order)
+{
+  struct GraphNode
+  {
+    int node;
+    vector<int> inEdges;
+  };
+
+  vector<GraphNode> graph;
+  for (int i = 0; i < numNodes; ++i)
+    graph.push_back(GraphNode{ i, {} });
+
+  for (const pair<int, int>& e : edges)
+    graph[e.second].inEdges.push_back(e.first);
+
+  while (!graph.empty())
+  {
+    int node = -1;
+    for (auto it = graph.begin(); it != graph.end(); ++it)
+    {
+      if (it->inEdges.empty())
+      {
+        node = it->node;
+        graph.erase(it);
+        break;
+      }
+    }
+
+    if (node == -1)
+      return false;
+
+    for (GraphNode& g : graph)
+      g.inEdges.erase(remove(g.inEdges.begin(), g.inEdges.end(), node), g.inEdges.end());
+
+    order->push_back(node);
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+template <typename Fn>
+static double timeMs(Fn fn, int iterations)
+{
+  auto start = chrono::high_resolution_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    fn();
+  chrono::duration<double, milli> ms = chrono::high_resolution_clock::now() - start;
+  return ms.count() / iterations;
+}
+
+//--------------------------------------------------------------
+// The pool textures the program needs when the nodes run in the given order. Like in the compiler,
+// only outputs that something reads go to the pool
+static int numTextures(int numNodes, const vector<pair<int, int>>& edges, const vector<int>& order)
+{
+  vector<int> position(numNodes);
+  for (int i = 0; i < numNodes; ++i)
+    position[order[i]] = i;
+
+  vector<bool> writesPool(numNodes);
+  vector<vector<int>> inputs(numNodes);
+  for (const pair<int, int>& e : edges)
+  {
+    writesPool[position[e.first]] = true;
+    inputs[position[e.second]].push_back(position[e.first]);
+  }
+
+  TextureAllocation alloc;
+  allocateTextures(writesPool, inputs, &alloc);
+  return alloc.numTextures;
+}
+
+//--------------------------------------------------------------
+static void benchSchedule(int maxNodes)
+{
+  const int NUM_GRAPHS = 20;
+  printf("\npool textures, mean over %d graphs in creation order\n", NUM_GRAPHS);
+
+  for (int numNodes : { 100, 300, 1000, 3000, 10000 })
+  {
+    if (numNodes > maxNodes)
+      break;
+
+    double kahnSum = 0, memorySum = 0;
+    int numWorse = 0;
+    for (int g = 0; g < NUM_GRAPHS; ++g)
+    {
+      vector<pair<int, int>> edges;
+      createGraph(numNodes, false, numNodes + g, &edges);
+
+      vector<int> kahnOrder, memoryOrder;
+      topologicalSort(numNodes, edges, &kahnOrder);
+      memorySchedule(numNodes, edges, &memoryOrder);
+
+      int kahn = numTextures(numNodes, edges, kahnOrder);
+      int memory = numTextures(numNodes, edges, memoryOrder);
+      kahnSum += kahn;
+      memorySum += memory;
+      numWorse += memory > kahn;
+    }
+
+    printf("nodes: %6d, kahn: %6.1f, memory schedule: %6.1f, saved: %5.1f%%, worse on %d/%d\n",
+        numNodes,
+        kahnSum / NUM_GRAPHS,
+        memorySum / NUM_GRAPHS,
+        100 * (1 - memorySum / kahnSum),
+        numWorse,
+        NUM_GRAPHS);
+  }
+}
+
+//--------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  int maxNodes = argc > 1 ? atoi(argv[1]) : 100000;
+
+  // the legacy sort gets very slow, so only run it on the smaller graphs
+  const int MAX_LEGACY_NODES = 10000;
+
+  for (int numNodes : { 1000, 3000, 10000, 30000, 100000 })
+  {
+    if (numNodes > maxNodes)
+      break;
+
+    vector<pair<int, int>> edges;
+    createGraph(numNodes, true, numNodes, &edges);
+
+    vector<int> order;
+    double kahnMs = timeMs(
+        [&] {
+          order.clear();
+          topologicalSort(numNodes, edges, &order);
+        },
+        10);
+
+    vector<int> memoryOrder;
+    double memoryMs = timeMs(
+        [&] {
+          memoryOrder.clear();
+          memorySchedule(numNodes, edges, &memoryOrder);
+        },
+        10);
+
+    printf("nodes: %6d, edges: %6d, kahn: %8.3f ms, memory schedule: %8.3f ms",
+        numNodes,
+        (int)edges.size(),
+        kahnMs,
+        memoryMs);
+
+    if (numNodes <= MAX_LEGACY_NODES)
+    {
+      vector<int> legacyOrder;
+      double legacyMs = timeMs([&] { legacySort(numNodes, edges, &legacyOrder); }, 1);
+      printf(", legacy: %10.3f ms (%s)", legacyMs, order == legacyOrder ? "same order" : "DIFFERS");
+    }
+
+    printf("\n");
+  }
+
+  benchSchedule(maxNodes);
+  return 0;
+}
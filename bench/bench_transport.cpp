@@ -0,0 +1,256 @@
+// Measures the latency and throughput of the transports, with a stand-in receiver in a child
+// process that does what the renderer does with each message: a program is validated and kept, and
+// a patch is applied to the program it has. Every message is acked back over a pipe.
+//
+// Build (from the repo root, linux only):
+//   g++ -std=c++14 -O2 -pthread -Isrc bench/bench_transport.cpp src/transport.cpp src/texture_vm.cpp src/thread_pool.cpp src/vm_bytecode.cpp src/vm_reader.cpp -o bench_transport -lrt
+//
+// Usage: bench_transport [unix|shm|all] [iterations]
+
+#include "texture_vm.hpp"
+#include "transport.hpp"
+#include "vm_reader.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+//--------------------------------------------------------------
+struct PrgWriter
+{
+  template <typename T>
+  void write(const T& v)
+  {
+    size_t oldPos = buf.size();
+    buf.resize(buf.size() + sizeof(T));
+    memcpy(buf.data() + oldPos, &v, sizeof(T));
+  }
+
+  vector<char> buf;
+};
+
+//--------------------------------------------------------------
+// A fill followed by a chain of color gradients, padded out to roughly the given size
+static vector<char> createProgram(size_t size)
+{
+  PrgWriter w;
+  w.write((u8)VM_PRG_VERSION);
+  w.write((u8)(VM_NUM_AUX_TEXTURES + 2));
+
+  u8 t0 = VM_NUM_AUX_TEXTURES;
+  w.write((u8)VM_OP_FILL);
+  w.write(t0);
+  w.write((u8)0);
+  w.write((u16)(4 * sizeof(float)));
+  for (int i = 0; i < 4; ++i)
+    w.write(0.5f);
+
+  for (int i = 0; w.buf.size() < size; ++i)
+  {
+    w.write((u8)VM_OP_COLOR_GRADIENT);
+    w.write((u8)(t0 + (i + 1) % 2));
+    w.write((u8)1);
+    w.write((u8)(t0 + i % 2));
+    w.write((u16)(8 * sizeof(float)));
+    for (int j = 0; j < 8; ++j)
+      w.write((float)j / 8);
+  }
+
+  return w.buf;
+}
+
+//--------------------------------------------------------------
+static vector<char> createPatch()
+{
+  PrgWriter w;
+  VmPatch header;
+  header.opIndex = 0;
+  header.offset = 0;
+  header.size = sizeof(float);
+  w.write(header);
+  w.write(0.25f);
+  return w.buf;
+}
+
+static TransportListener* g_listener;
+
+//--------------------------------------------------------------
+static void onTerminate(int)
+{
+  // NB: cancel is safe to call from a signal handler, and lets the listener clean up after itself
+  g_listener->cancel();
+}
+
+//--------------------------------------------------------------
+static int runReceiver(const char* address, int ackFd, int readyFd)
+{
+  unique_ptr<TransportListener> listener(createListener(address));
+  g_listener = listener.get();
+  signal(SIGTERM, onTerminate);
+  char ready = listener ? 1 : 0;
+  if (write(readyFd, &ready, 1) != 1 || !listener)
+    return 1;
+
+  // NB: the program stays open in the reader, so a patch doesn't validate it again
+  vector<char> prg;
+  VmPrgReader reader;
+  bool valid = false;
+  const char* data;
+  size_t size;
+  while (listener->receive(&data, &size))
+  {
+    char ok;
+    if (size > 0 && (u8)data[0] == VM_PATCH_TAG)
+    {
+      ok = valid && vmApplyPatch(&prg, &reader, data, size);
+    }
+    else
+    {
+      prg.assign(data, data + size);
+      ok = valid = reader.open(prg.data(), prg.size());
+    }
+
+    if (write(ackFd, &ok, 1) != 1)
+      break;
+  }
+
+  return 0;
+}
+
+//--------------------------------------------------------------
+static bool waitAcks(int ackFd, int count)
+{
+  char acks[256];
+  while (count > 0)
+  {
+    ssize_t res = read(ackFd, acks, min(count, (int)sizeof(acks)));
+    if (res <= 0)
+      return false;
+
+    for (ssize_t i = 0; i < res; ++i)
+    {
+      if (!acks[i])
+        return false;
+    }
+    count -= (int)res;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------
+static bool bench(const char* address, int iterations)
+{
+  int ackPipe[2], readyPipe[2];
+  if (pipe(ackPipe) != 0 || pipe(readyPipe) != 0)
+    return false;
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    close(ackPipe[0]);
+    close(readyPipe[0]);
+    _exit(runReceiver(address, ackPipe[1], readyPipe[1]));
+  }
+
+  close(ackPipe[1]);
+  close(readyPipe[1]);
+
+  char ready = 0;
+  if (read(readyPipe[0], &ready, 1) != 1 || !ready)
+  {
+    printf("%s: receiver failed to listen\n", address);
+    waitpid(pid, nullptr, 0);
+    return false;
+  }
+
+  unique_ptr<Transport> transport(createTransport(address));
+  struct Message
+  {
+    const char* name;
+    vector<char> data;
+  };
+  vector<Message> messages = {
+    { "patch", createPatch() },
+    { "program 4k", createProgram(4 * 1024) },
+    { "program 256k", createProgram(256 * 1024) },
+    { "program 4m", createProgram(4 * 1024 * 1024) },
+  };
+
+  // the receiver needs a program before any patch
+  bool ok = transport && transport->send(messages[1].data.data(), messages[1].data.size())
+            && waitAcks(ackPipe[0], 1);
+
+  printf("%s\n", address);
+  for (size_t m = 0; ok && m < messages.size(); ++m)
+  {
+    const vector<char>& data = messages[m].data;
+    int count = data.size() > 1024 * 1024 ? max(1, iterations / 10) : iterations;
+
+    // latency: a single message there, and its ack back
+    vector<double> times;
+    for (int i = 0; ok && i < count; ++i)
+    {
+      auto start = chrono::high_resolution_clock::now();
+      ok = transport->send(data.data(), data.size()) && waitAcks(ackPipe[0], 1);
+      auto end = chrono::high_resolution_clock::now();
+      times.push_back(chrono::duration<double, micro>(end - start).count());
+    }
+
+    // throughput: back to back messages
+    auto start = chrono::high_resolution_clock::now();
+    for (int i = 0; ok && i < count; ++i)
+      ok = transport->send(data.data(), data.size());
+    ok = ok && waitAcks(ackPipe[0], count);
+    auto end = chrono::high_resolution_clock::now();
+
+    if (!ok)
+      break;
+
+    double seconds = chrono::duration<double>(end - start).count();
+    sort(times.begin(), times.end());
+    printf("  %-14s %8zu bytes, round trip: %9.1f us median, %9.1f us p99, "
+           "%10.0f msg/s, %8.1f MB/s\n",
+        messages[m].name,
+        data.size(),
+        times[times.size() / 2],
+        times[times.size() * 99 / 100],
+        count / seconds,
+        count * data.size() / seconds / (1024 * 1024));
+  }
+
+  if (!ok)
+    printf("  send failed\n");
+
+  // closing the connection doesn't end the receiver, so it's told to stop
+  transport.reset();
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  close(ackPipe[0]);
+  close(readyPipe[0]);
+  return ok;
+}
+
+//--------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  const char* mode = argc > 1 ? argv[1] : "all";
+  int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+
+  bool ok = true;
+  if (strcmp(mode, "shm") != 0)
+    ok &= bench("unix:/tmp/bench_transport.sock", iterations);
+  if (strcmp(mode, "unix") != 0)
+    ok &= bench("shm:/bench_transport", iterations);
+
+  return ok ? 0 : 1;
+}
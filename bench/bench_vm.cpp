@@ -0,0 +1,121 @@
+// Measures the texture vm throughput as the number of threads increases.
+//
+// Build (from the repo root):
+//   g++ -std=c++14 -O2 -pthread -Isrc bench/bench_vm.cpp src/texture_vm.cpp src/thread_pool.cpp src/vm_bytecode.cpp src/vm_reader.cpp -o bench_vm
+//
+// Usage: bench_vm [resolution] [max threads] [seq|dag|unfused]
+
+#include "texture_vm.hpp"
+#include "thread_pool.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+//--------------------------------------------------------------
+struct PrgWriter
+{
+  template <typename T>
+  void write(const T& v)
+  {
+    size_t oldPos = buf.size();
+    buf.resize(buf.size() + sizeof(T));
+    memcpy(buf.data() + oldPos, &v, sizeof(T));
+  }
+
+  void op(u8 op, u8 output, const vector<u8>& inputs, const vector<float>& params)
+  {
+    write(op);
+    write(output);
+    write((u8)inputs.size());
+    for (u8 i : inputs)
+      write(i);
+    write((u16)(params.size() * sizeof(float)));
+    for (float p : params)
+      write(p);
+  }
+
+  vector<char> buf;
+};
+
+//--------------------------------------------------------------
+// Noise and Sinus -> Modulate -> RotateScale -> Distort -> ColorGradient -> Final
+static vector<char> createProgram()
+{
+  PrgWriter w;
+  w.write((u8)VM_PRG_VERSION);
+  w.write((u8)(VM_NUM_AUX_TEXTURES + 4));
+
+  u8 t0 = VM_NUM_AUX_TEXTURES;
+  u8 t1 = t0 + 1;
+  u8 t2 = t0 + 2;
+  u8 t3 = t0 + 3;
+
+  int numOctaves = 6;
+  float octaves;
+  memcpy(&octaves, &numOctaves, sizeof(float));
+
+  w.op(VM_OP_NOISE, t0, {}, { octaves, 4, 0.5f, 0.5f });
+  w.op(VM_OP_SINUS, t1, {}, { 3, 1, 1 });
+  w.op(VM_OP_MODULATE, t2, { t0, t1 }, { 1, 1 });
+  w.op(VM_OP_ROTATE_SCALE, t3, { t2 }, { 0.3f, 1, 1 });
+  w.op(VM_OP_DISTORT, t0, { t3, t2, t1 }, { 0.05f });
+  w.op(VM_OP_COLOR_GRADIENT, t1, { t0 }, { 1, 0.1f, 0.1f, 1, 0.2f, 0.2f, 1, 1 });
+  w.op(VM_OP_LOAD, VM_FINAL_TEXTURE, { t1 }, {});
+  return w.buf;
+}
+
+//--------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  int resolution = argc > 1 ? atoi(argv[1]) : 2048;
+  int maxThreads = argc > 2 ? atoi(argv[2]) : (int)thread::hardware_concurrency();
+  const char* mode = argc > 3 ? argv[3] : "seq";
+  bool dag = strcmp(mode, "dag") == 0;
+  bool fusion = strcmp(mode, "unfused") != 0;
+
+  vector<char> prg = createProgram();
+  double baseline = 0;
+
+  printf("resolution: %d^2, mode: %s\n",
+      resolution,
+      dag ? "dag" : fusion ? "sequential" : "unfused");
+  for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+  {
+    ThreadPool pool(numThreads);
+    TextureVm vm;
+    vm.setThreadPool(&pool);
+    vm.setExecMode(dag ? VmExecMode::Dag : VmExecMode::Sequential);
+    vm.setFusion(fusion);
+
+    // warm up, so the textures are allocated
+    vm.run(prg.data(), prg.size(), resolution, resolution);
+    if (!vm.run(prg.data(), prg.size(), resolution, resolution))
+    {
+      printf("program failed\n");
+      return 1;
+    }
+
+    const VmStats& stats = vm.stats();
+    if (numThreads == 1)
+      baseline = stats.mpixPerSec;
+
+    printf("threads: %2d, total: %8.2f ms, %8.1f MPix/s (%.2fx), %d ops fused\n",
+        numThreads,
+        stats.totalMs,
+        stats.mpixPerSec,
+        stats.mpixPerSec / baseline,
+        stats.numFusedOps);
+
+    for (const VmStats::Op& op : stats.ops)
+    {
+      printf("  %-16s %8.2f ms, %8.1f MPix/s\n", vmFindKernel(op.op)->name, op.ms, op.mpixPerSec);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <assert.h>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+//--------------------------------------------------------------
+// Pool allocator for objects of a single type. Objects live in fixed size chunks, so they're
+// packed together in memory and never move, and are addressed by an integer handle (their slot
+// index). Freed slots are reused, and clear() keeps the chunks around for the next batch.
+template <typename T>
+class Arena
+{
+public:
+  typedef u32 Handle;
+  static const Handle INVALID_HANDLE = ~0u;
+
+  Arena() = default;
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena() { clear(); }
+
+  template <typename... Args>
+  Handle alloc(Args&&... args)
+  {
+    Handle h;
+    if (!_freeList.empty())
+    {
+      h = _freeList.back();
+      _freeList.pop_back();
+    }
+    else
+    {
+      h = (Handle)_live.size();
+      if (h % CHUNK_SIZE == 0 && h / CHUNK_SIZE == _chunks.size())
+        _chunks.push_back(std::unique_ptr<Slot[]>(new Slot[CHUNK_SIZE]));
+      _live.push_back(false);
+    }
+
+    new (slot(h)) T(std::forward<Args>(args)...);
+    _live[h] = true;
+    _numLive++;
+    return h;
+  }
+
+  void free(Handle h)
+  {
+    assert(h < _live.size() && _live[h]);
+    get(h)->~T();
+    _live[h] = false;
+    _freeList.push_back(h);
+    _numLive--;
+  }
+
+  // Destroys all the objects, but keeps the memory
+  void clear()
+  {
+    for (Handle h = 0; h < (Handle)_live.size(); ++h)
+    {
+      if (_live[h])
+        get(h)->~T();
+    }
+    _live.clear();
+    _freeList.clear();
+    _numLive = 0;
+  }
+
+  T* get(Handle h) { return (T*)slot(h); }
+  const T* get(Handle h) const { return (const T*)slot(h); }
+  size_t size() const { return _numLive; }
+
+  // Calls fn on the live objects, in memory order
+  template <typename Fn>
+  void forEach(Fn fn)
+  {
+    for (Handle h = 0; h < (Handle)_live.size(); ++h)
+    {
+      if (_live[h])
+        fn(get(h));
+    }
+  }
+
+private:
+  static const u32 CHUNK_SIZE = 256;
+
+  struct Slot
+  {
+    alignas(T) char storage[sizeof(T)];
+  };
+
+  void* slot(Handle h) const { return _chunks[h / CHUNK_SIZE][h % CHUNK_SIZE].storage; }
+
+  std::vector<std::unique_ptr<Slot[]>> _chunks;
+  std::vector<bool> _live;
+  std::vector<Handle> _freeList;
+  size_t _numLive = 0;
+};
@@ -0,0 +1,469 @@
+#include "canvas_renderer.hpp"
+#include "ofApp.h"
+
+#include <stddef.h>
+
+//--------------------------------------------------------------
+static const int CORNER_SEGMENTS = 3;
+static const int CIRCLE_SEGMENTS = 12;
+static const int RECT_POINTS = 4 * (CORNER_SEGMENTS + 1);
+// NB: the inputs, and the output
+static const int MAX_NODE_CIRCLES = VM_MAX_INPUTS + 1;
+static const int NODE_VERTS = 2 * RECT_POINTS + MAX_NODE_CIRCLES * CIRCLE_SEGMENTS;
+static const int WIRE_VERTS = 2;
+
+static const ofFloatColor BODY_COLOR = ofColor(95);
+static const ofFloatColor HEADING_COLOR = ofColor(78);
+static const ofFloatColor OUTLINE_COLOR = ofColor(30);
+static const ofFloatColor CONNECTOR_COLOR = ofColor(140);
+static const ofFloatColor CONNECTED_COLOR = ofColor(80, 200, 80);
+static const ofFloatColor WIRE_COLOR = ofColor(100, 100, 200);
+
+//--------------------------------------------------------------
+// Writes the outline of a rounded rectangle, clockwise from the top left corner
+static void addRoundedRect(ofVec2f* pts, const ofRectangle& rect, float upper, float lower)
+{
+  struct Corner
+  {
+    float cx, cy, r;
+  } corners[4] = {
+    { rect.getLeft() + upper, rect.getTop() + upper, upper },
+    { rect.getRight() - upper, rect.getTop() + upper, upper },
+    { rect.getRight() - lower, rect.getBottom() - lower, lower },
+    { rect.getLeft() + lower, rect.getBottom() - lower, lower },
+  };
+
+  for (int i = 0; i < 4; ++i)
+  {
+    const Corner& c = corners[i];
+    float startAngle = PI + i * HALF_PI;
+    for (int j = 0; j <= CORNER_SEGMENTS; ++j)
+    {
+      float a = startAngle + j * HALF_PI / CORNER_SEGMENTS;
+      *pts++ = ofVec2f(c.cx + cosf(a) * c.r, c.cy + sinf(a) * c.r);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+static void addCircle(ofVec2f* pts, const ofPoint& center, float radius)
+{
+  for (int i = 0; i < CIRCLE_SEGMENTS; ++i)
+  {
+    float a = i * TWO_PI / CIRCLE_SEGMENTS;
+    pts[i] = ofVec2f(center.x + cosf(a) * radius, center.y + sinf(a) * radius);
+  }
+}
+
+//--------------------------------------------------------------
+static void addFan(vector<ofIndexType>* indices, size_t first, int count)
+{
+  for (int i = 1; i < count - 1; ++i)
+  {
+    indices->push_back((ofIndexType)first);
+    indices->push_back((ofIndexType)(first + i));
+    indices->push_back((ofIndexType)(first + i + 1));
+  }
+}
+
+//--------------------------------------------------------------
+static void addLoop(vector<ofIndexType>* indices, size_t first, int count)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    indices->push_back((ofIndexType)(first + i));
+    indices->push_back((ofIndexType)(first + (i + 1) % count));
+  }
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::Buffer::reserve(size_t numVerts)
+{
+  if (verts.size() < numVerts)
+    verts.resize(max(numVerts, 2 * verts.size()));
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::Buffer::markDirty(size_t first, size_t count)
+{
+  dirtyBegin = min(dirtyBegin, first);
+  dirtyEnd = max(dirtyEnd, first + count);
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::Buffer::upload()
+{
+  if (allocated < verts.size())
+  {
+    // grown, so reallocate and upload everything
+    vertexBuffer.allocate(verts.size() * sizeof(Vertex), verts.data(), GL_DYNAMIC_DRAW);
+    vbo.setVertexBuffer(vertexBuffer, 2, sizeof(Vertex), offsetof(Vertex, pos));
+    vbo.setColorBuffer(vertexBuffer, sizeof(Vertex), offsetof(Vertex, color));
+    allocated = verts.size();
+  }
+  else if (dirtyBegin < dirtyEnd)
+  {
+    // NB: a single range covering all the changes, which is usually small, as the nodes being
+    // edited or dragged tend to be allocated together
+    vertexBuffer.updateData(dirtyBegin * sizeof(Vertex),
+        (dirtyEnd - dirtyBegin) * sizeof(Vertex),
+        verts.data() + dirtyBegin);
+  }
+
+  dirtyBegin = (size_t)-1;
+  dirtyEnd = 0;
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::uploadIndices(Buffer* buffer)
+{
+  if (buffer->indices.empty())
+    return;
+
+  size_t bytes = buffer->indices.size() * sizeof(ofIndexType);
+  if (buffer->allocatedIndices < buffer->indices.size())
+  {
+    buffer->indexBuffer.allocate(bytes, buffer->indices.data(), GL_DYNAMIC_DRAW);
+    buffer->vbo.setIndexBuffer(buffer->indexBuffer);
+    buffer->allocatedIndices = buffer->indices.size();
+  }
+  else
+  {
+    buffer->indexBuffer.updateData(0, bytes, buffer->indices.data());
+  }
+}
+
+//--------------------------------------------------------------
+CanvasRenderer::CanvasRenderer()
+{
+  _text.setMode(OF_PRIMITIVE_TRIANGLES);
+  _text.setUsage(GL_DYNAMIC_DRAW);
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::clear()
+{
+  // NB: the buffers are kept, as the arena handles start from 0 again
+  _dirtyNodes.clear();
+  _dirtyLabels.clear();
+  _nodeSlots.clear();
+  _wireSlots.clear();
+  _indicesDirty = true;
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::nodeChanged(const Node* node)
+{
+  _dirtyNodes.insert(node);
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::labelsChanged(const Node* node)
+{
+  _dirtyLabels.insert(node);
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::nodeRemoved(const Node* node)
+{
+  _dirtyNodes.erase(node);
+  _dirtyLabels.erase(node);
+
+  // the vertices are left as is, they just stop being referenced
+  if (node->handle < _nodeSlots.size())
+    _nodeSlots[node->handle] = NodeSlot();
+
+  for (const NodeConnector* input : node->inputs)
+    clearWire(input->handle);
+
+  _indicesDirty = true;
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::rebuildNode(const Node* node)
+{
+  u32 slotIdx = node->handle;
+  if (slotIdx >= _nodeSlots.size())
+    _nodeSlots.resize(slotIdx + 1);
+
+  size_t first = (size_t)slotIdx * NODE_VERTS;
+  _fills.reserve(first + NODE_VERTS);
+  _outlines.reserve(first + NODE_VERTS);
+
+  ofVec2f pts[NODE_VERTS];
+  ofFloatColor colors[NODE_VERTS];
+
+  addRoundedRect(pts, node->bodyRect, 0, RECT_LOWER_ROUNDING);
+  std::fill(colors, colors + RECT_POINTS, BODY_COLOR);
+
+  addRoundedRect(pts + RECT_POINTS, node->headingRect, RECT_UPPER_ROUNDING, 0);
+  std::fill(colors + RECT_POINTS, colors + 2 * RECT_POINTS, HEADING_COLOR);
+
+  int numCircles = 0;
+  auto addConnector = [&](const NodeConnector* con) {
+    if (numCircles == MAX_NODE_CIRCLES)
+      return;
+
+    int ofs = 2 * RECT_POINTS + numCircles * CIRCLE_SEGMENTS;
+    addCircle(pts + ofs, con->pt, CONNECTOR_RADIUS);
+    const ofFloatColor& c = con->cons.empty() ? CONNECTOR_COLOR : CONNECTED_COLOR;
+    std::fill(colors + ofs, colors + ofs + CIRCLE_SEGMENTS, c);
+    numCircles++;
+  };
+
+  for (const NodeConnector* input : node->inputs)
+    addConnector(input);
+
+  if (node->output->type != ParamType::Void)
+    addConnector(node->output);
+
+  int numVerts = 2 * RECT_POINTS + numCircles * CIRCLE_SEGMENTS;
+  for (int i = 0; i < numVerts; ++i)
+  {
+    _fills.verts[first + i] = Vertex{ pts[i], colors[i] };
+    _outlines.verts[first + i] = Vertex{ pts[i], OUTLINE_COLOR };
+  }
+  _fills.markDirty(first, numVerts);
+  _outlines.markDirty(first, numVerts);
+
+  // the connectors stick out of the body a bit
+  ofRectangle bounds = node->bounds();
+  bounds.standardize();
+  bounds.x -= CONNECTOR_RADIUS;
+  bounds.y -= CONNECTOR_RADIUS;
+  bounds.width += 2 * CONNECTOR_RADIUS;
+  bounds.height += 2 * CONNECTOR_RADIUS;
+
+  NodeSlot& slot = _nodeSlots[slotIdx];
+  bool visible = _viewport.intersects(bounds);
+  if (!slot.live || slot.visible != visible || slot.numCircles != numCircles)
+    _indicesDirty = true;
+
+  // a new node in the slot needs its labels laid out
+  if (!slot.live)
+    _dirtyLabels.insert(node);
+
+  // NB: the labels move with the node
+  if (visible || slot.visible)
+    _textDirty = true;
+
+  slot.live = true;
+  slot.visible = visible;
+  slot.numCircles = (u8)numCircles;
+  slot.bounds = bounds;
+  slot.origin = ofVec3f(node->bodyRect.x, node->bodyRect.y, 0);
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::layoutLabels(const Node* node, const ofTrueTypeFont& font)
+{
+  if (node->handle >= _labels.size())
+    _labels.resize(node->handle + 1);
+
+  // laid out at the node's position, and then made relative to it
+  ofMesh& mesh = _labels[node->handle];
+  mesh.clear();
+  if (font.isLoaded())
+    node->layoutLabels(font, &mesh);
+
+  ofVec3f origin(node->bodyRect.x, node->bodyRect.y, 0);
+  for (ofVec3f& v : mesh.getVertices())
+    v -= origin;
+
+  _textDirty = true;
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::rebuildText()
+{
+  // NB: this is only a copy of the cached glyphs, but it's redone every frame while dragging, so
+  // the vectors are reused
+  vector<ofVec3f>& verts = _text.getVertices();
+  vector<ofVec2f>& texCoords = _text.getTexCoords();
+  vector<ofIndexType>& indices = _text.getIndices();
+  verts.clear();
+  texCoords.clear();
+  indices.clear();
+
+  for (size_t i = 0; i < _nodeSlots.size() && i < _labels.size(); ++i)
+  {
+    const NodeSlot& slot = _nodeSlots[i];
+    if (!slot.live || !slot.visible)
+      continue;
+
+    const ofMesh& mesh = _labels[i];
+    ofIndexType base = (ofIndexType)verts.size();
+    for (const ofVec3f& v : mesh.getVertices())
+      verts.push_back(v + slot.origin);
+    texCoords.insert(texCoords.end(), mesh.getTexCoords().begin(), mesh.getTexCoords().end());
+    for (ofIndexType idx : mesh.getIndices())
+      indices.push_back(base + idx);
+  }
+
+  _textDirty = false;
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::clearWire(u32 handle)
+{
+  if (handle < _wireSlots.size() && _wireSlots[handle].live)
+  {
+    _wireSlots[handle] = WireSlot();
+    _indicesDirty = true;
+  }
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::rebuildWire(const NodeConnector* input)
+{
+  if (input->cons.empty())
+  {
+    clearWire(input->handle);
+    return;
+  }
+
+  u32 slotIdx = input->handle;
+  if (slotIdx >= _wireSlots.size())
+    _wireSlots.resize(slotIdx + 1);
+
+  size_t first = (size_t)slotIdx * WIRE_VERTS;
+  _wires.reserve(first + WIRE_VERTS);
+
+  const ofPoint& a = input->cons[0]->pt;
+  const ofPoint& b = input->pt;
+  _wires.verts[first + 0] = Vertex{ ofVec2f(a.x, a.y), WIRE_COLOR };
+  _wires.verts[first + 1] = Vertex{ ofVec2f(b.x, b.y), WIRE_COLOR };
+  _wires.markDirty(first, WIRE_VERTS);
+
+  ofRectangle bounds(a, b);
+  bounds.standardize();
+
+  WireSlot& slot = _wireSlots[slotIdx];
+  bool visible = _viewport.intersects(bounds);
+  if (!slot.live || slot.visible != visible)
+    _indicesDirty = true;
+
+  slot.live = true;
+  slot.visible = visible;
+  slot.bounds = bounds;
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::rebuildIndices()
+{
+  _fills.indices.clear();
+  _outlines.indices.clear();
+  _wires.indices.clear();
+
+  for (size_t i = 0; i < _nodeSlots.size(); ++i)
+  {
+    const NodeSlot& slot = _nodeSlots[i];
+    if (!slot.live || !slot.visible)
+      continue;
+
+    size_t first = i * NODE_VERTS;
+    addFan(&_fills.indices, first, RECT_POINTS);
+    addFan(&_fills.indices, first + RECT_POINTS, RECT_POINTS);
+    addLoop(&_outlines.indices, first, RECT_POINTS);
+    addLoop(&_outlines.indices, first + RECT_POINTS, RECT_POINTS);
+
+    for (int j = 0; j < slot.numCircles; ++j)
+    {
+      size_t circle = first + 2 * RECT_POINTS + j * CIRCLE_SEGMENTS;
+      addFan(&_fills.indices, circle, CIRCLE_SEGMENTS);
+      addLoop(&_outlines.indices, circle, CIRCLE_SEGMENTS);
+    }
+  }
+
+  for (size_t i = 0; i < _wireSlots.size(); ++i)
+  {
+    const WireSlot& slot = _wireSlots[i];
+    if (!slot.live || !slot.visible)
+      continue;
+
+    _wires.indices.push_back((ofIndexType)(i * WIRE_VERTS));
+    _wires.indices.push_back((ofIndexType)(i * WIRE_VERTS + 1));
+  }
+
+  uploadIndices(&_fills);
+  uploadIndices(&_outlines);
+  uploadIndices(&_wires);
+  _indicesDirty = false;
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::update(const ofRectangle& viewport, const ofTrueTypeFont& font)
+{
+  if (viewport != _viewport)
+  {
+    // moved slots get their visibility updated below, so this is only for the ones that didn't
+    _viewport = viewport;
+    for (NodeSlot& slot : _nodeSlots)
+      slot.visible = slot.live && _viewport.intersects(slot.bounds);
+    for (WireSlot& slot : _wireSlots)
+      slot.visible = slot.live && _viewport.intersects(slot.bounds);
+    _indicesDirty = true;
+  }
+
+  for (const Node* node : _dirtyNodes)
+  {
+    rebuildNode(node);
+
+    // the wires are owned by the input end, so this covers both ends of the node's wires
+    for (const NodeConnector* input : node->inputs)
+      rebuildWire(input);
+    for (const NodeConnector* con : node->output->cons)
+      rebuildWire(con);
+  }
+  _dirtyNodes.clear();
+
+  for (const Node* node : _dirtyLabels)
+    layoutLabels(node, font);
+  _dirtyLabels.clear();
+
+  _fills.upload();
+  _outlines.upload();
+  _wires.upload();
+
+  if (_indicesDirty)
+  {
+    rebuildIndices();
+    _textDirty = true;
+  }
+
+  if (_textDirty)
+    rebuildText();
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::drawNodes()
+{
+  if (!_fills.indices.empty())
+    _fills.vbo.drawElements(GL_TRIANGLES, (int)_fills.indices.size());
+
+  if (!_outlines.indices.empty())
+    _outlines.vbo.drawElements(GL_LINES, (int)_outlines.indices.size());
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::drawLabels(const ofTrueTypeFont& font)
+{
+  if (_text.getNumIndices() == 0 || !font.isLoaded())
+    return;
+
+  ofSetColor(0);
+  font.getFontTexture().bind();
+  _text.draw();
+  font.getFontTexture().unbind();
+}
+
+//--------------------------------------------------------------
+void CanvasRenderer::drawWires()
+{
+  if (_wires.indices.empty())
+    return;
+
+  ofSetLineWidth(3);
+  _wires.vbo.drawElements(GL_LINES, (int)_wires.indices.size());
+  ofSetLineWidth(1);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <unordered_set>
+#include <vector>
+
+struct Node;
+struct NodeConnector;
+
+static const int RECT_UPPER_ROUNDING = 4;
+static const int RECT_LOWER_ROUNDING = 2;
+static const int CONNECTOR_RADIUS = 5;
+
+//--------------------------------------------------------------
+// Draws the node bodies, connectors and wires from a few persistent vertex buffers, instead of
+// issuing immediate mode calls per node per frame.
+// Each node owns a fixed size range of vertices, indexed by its arena handle, and each input
+// connector owns the two vertices of its wire. Only the ranges of nodes that changed since the
+// last frame are rebuilt and uploaded. The index buffers list the nodes and wires inside the
+// viewport, and are only rebuilt when that set changes.
+// The label glyphs are laid out once per node, relative to the node, and only laid out again when
+// the text changes. The visible labels are gathered into a single mesh, drawn in one call.
+// NB: selection outlines are still drawn by the app
+class CanvasRenderer
+{
+public:
+  CanvasRenderer();
+  void clear();
+
+  // The node moved, was created, or its connections changed
+  void nodeChanged(const Node* node);
+  // The heading or label text changed
+  void labelsChanged(const Node* node);
+  // Has to be called before the node and its connectors are freed
+  void nodeRemoved(const Node* node);
+
+  // Rebuilds whatever changed since the last frame, and culls to the viewport
+  void update(const ofRectangle& viewport, const ofTrueTypeFont& font);
+  void drawNodes();
+  void drawLabels(const ofTrueTypeFont& font);
+  void drawWires();
+
+private:
+  struct Vertex
+  {
+    ofVec2f pos;
+    ofFloatColor color;
+  };
+
+  // NB: the vbo is set up to read from the buffer object, so the data is only uploaded once,
+  // and then patched in place
+  struct Buffer
+  {
+    void reserve(size_t numVerts);
+    void markDirty(size_t first, size_t count);
+    void upload();
+
+    vector<Vertex> verts;
+    ofBufferObject vertexBuffer;
+    ofBufferObject indexBuffer;
+    ofVbo vbo;
+    size_t allocated = 0;
+    size_t dirtyBegin = (size_t)-1;
+    size_t dirtyEnd = 0;
+
+    vector<ofIndexType> indices;
+    size_t allocatedIndices = 0;
+  };
+
+  struct NodeSlot
+  {
+    bool live = false;
+    bool visible = false;
+    u8 numCircles = 0;
+    ofRectangle bounds;
+    // the body's top left corner, which the labels are relative to
+    ofVec3f origin;
+  };
+
+  struct WireSlot
+  {
+    bool live = false;
+    bool visible = false;
+    ofRectangle bounds;
+  };
+
+  void rebuildNode(const Node* node);
+  void rebuildWire(const NodeConnector* input);
+  void clearWire(u32 handle);
+  void rebuildIndices();
+  void layoutLabels(const Node* node, const ofTrueTypeFont& font);
+  void rebuildText();
+  static void uploadIndices(Buffer* buffer);
+
+  // fills are triangles, the outlines and wires are lines
+  Buffer _fills;
+  Buffer _outlines;
+  Buffer _wires;
+
+  vector<NodeSlot> _nodeSlots;
+  vector<WireSlot> _wireSlots;
+
+  // per node slot
+  vector<ofMesh> _labels;
+  ofVboMesh _text;
+
+  unordered_set<const Node*> _dirtyNodes;
+  unordered_set<const Node*> _dirtyLabels;
+  ofRectangle _viewport;
+  bool _indicesDirty = true;
+  bool _textDirty = true;
+};
@@ -0,0 +1,432 @@
+#include "ofApp.h"
+#include "texture_alloc.hpp"
+
+// Headless batch compiler: turns graph xml files into the .dat programs the gui generates,
+// without opening a window.
+//
+// Usage: nodr_cli [options] <input.xml | input.ngraph | directory>...
+//   -o <dir>          write the .dat files to dir (default: next to each input)
+//   -j <n>            number of files to compile in parallel (default: one per core)
+//   -t <file>         node templates (default: data/node_templates.xml next to the exe)
+//   -f                compile everything, even if it's up to date
+//   -m                schedule the programs to use as few textures as possible
+//   -q <8|16>         store the bounded parameters quantized to 8 or 16 bits
+//   -s <size>         print the op count, textures, peak texture memory and what the optimizations
+//                     saved for each compiled program, for a size x size texture
+//
+// Exit codes: 0 if everything compiled (or was up to date), 1 if any input failed, 2 on bad
+// arguments or missing templates. Errors go to stderr as "<file>: error: <message>".
+
+static const char* MANIFEST_FILENAME = ".nodr_manifest";
+
+// bump to invalidate all the manifests when the compiler output changes
+static const int COMPILER_VERSION = 6;
+
+enum ExitCode
+{
+  EXIT_OK = 0,
+  EXIT_COMPILE_ERROR = 1,
+  EXIT_USAGE = 2,
+};
+
+struct CliOptions
+{
+  vector<string> inputs;
+  string outputDir;
+  string templates;
+  int numJobs = 0;
+  bool force = false;
+  bool minMemory = false;
+  ParamPrecision paramPrecision = ParamPrecision::Full;
+  int statsSize = 0;
+};
+
+struct CompileJob
+{
+  string input;
+  string output;
+  u64 hash = 0;
+
+  enum class Result
+  {
+    Compiled,
+    UpToDate,
+    Failed,
+  };
+  Result result = Result::Failed;
+  string error;
+
+  int numOps = 0;
+  int numBytes = 0;
+  int numPoolTextures = 0;
+  int editOrderPoolTextures = 0;
+  int numMergedOps = 0;
+  int mergedPoolTextures = 0;
+  int numDeadOps = 0;
+  int numFoldedOps = 0;
+  int numFusedOps = 0;
+  int numFusedTextures = 0;
+};
+
+//--------------------------------------------------------------
+static void usage()
+{
+  fprintf(stderr,
+      "usage: nodr_cli [-o <dir>] [-j <jobs>] [-t <templates>] [-f] [-m] [-q <8|16>] "
+      "[-s <size>] <input.xml | dir>...\n");
+}
+
+//--------------------------------------------------------------
+static u64 fnv1a(const void* data, size_t size, u64 hash = 0xcbf29ce484222325ull)
+{
+  const u8* p = (const u8*)data;
+  for (size_t i = 0; i < size; ++i)
+  {
+    hash ^= p[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+//--------------------------------------------------------------
+static bool readFile(const string& filename, vector<char>* buf)
+{
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (!f)
+    return false;
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  buf->resize(size);
+  bool ok = size == 0 || fread(buf->data(), 1, size, f) == (size_t)size;
+  fclose(f);
+  return ok;
+}
+
+//--------------------------------------------------------------
+static bool parseArgs(int argc, char** argv, CliOptions* options)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "-o" && hasValue)
+      options->outputDir = argv[++i];
+    else if (arg == "-j" && hasValue)
+      options->numJobs = atoi(argv[++i]);
+    else if (arg == "-t" && hasValue)
+      options->templates = argv[++i];
+    else if (arg == "-f")
+      options->force = true;
+    else if (arg == "-m")
+      options->minMemory = true;
+    else if (arg == "-q" && hasValue)
+    {
+      string bits = argv[++i];
+      if (bits == "8")
+        options->paramPrecision = ParamPrecision::Bits8;
+      else if (bits == "16")
+        options->paramPrecision = ParamPrecision::Bits16;
+      else
+        return false;
+    }
+    else if (arg == "-s" && hasValue)
+      options->statsSize = atoi(argv[++i]);
+    else if (!arg.empty() && arg[0] == '-')
+      return false;
+    else
+      options->inputs.push_back(arg);
+  }
+
+  return !options->inputs.empty();
+}
+
+//--------------------------------------------------------------
+// Expands directories to the graph files they contain. NB: all paths are made absolute, as
+// openFrameworks resolves relative paths against the data folder
+static void collectJobs(const CliOptions& options, vector<CompileJob>* jobs)
+{
+  vector<string> files;
+  for (const string& input : options.inputs)
+  {
+    string path = ofFilePath::getAbsolutePath(input, false);
+    ofDirectory dir(path);
+    if (dir.isDirectory())
+    {
+      dir.allowExt("xml");
+      dir.allowExt("ngraph");
+      dir.listDir();
+      dir.sort();
+      for (size_t i = 0; i < dir.size(); ++i)
+        files.push_back(dir.getPath(i));
+    }
+    else
+    {
+      files.push_back(path);
+    }
+  }
+
+  // Inputs that would write the same output, like a/foo.xml and b/foo.xml with -o, or foo.xml and
+  // foo.ngraph, are all failed, as they'd be compiled at the same time and race for the file and
+  // its manifest entry. An input that's listed twice is only compiled once.
+  unordered_map<string, size_t> outputJobs;
+  for (const string& file : files)
+  {
+    string outputDir = options.outputDir.empty()
+                           ? ofFilePath::getEnclosingDirectory(file, false)
+                           : ofFilePath::getAbsolutePath(options.outputDir, false);
+
+    CompileJob job;
+    job.input = file;
+    job.output = ofFilePath::join(outputDir, ofFilePath::getBaseName(file) + ".dat");
+
+    // NB: the file system is case insensitive on windows
+    string key = job.output;
+#ifdef _WIN32
+    key = ofToLower(key);
+#endif
+    auto it = outputJobs.find(key);
+    if (it == outputJobs.end())
+    {
+      outputJobs[key] = jobs->size();
+      jobs->push_back(job);
+      continue;
+    }
+
+    CompileJob& first = (*jobs)[it->second];
+    if (first.input == job.input)
+      continue;
+
+    first.error = "another input is also compiled to " + job.output;
+    job.error = "same output as " + first.input + ", " + job.output;
+    jobs->push_back(job);
+  }
+}
+
+//--------------------------------------------------------------
+// The manifest maps each output file to the hash of everything that went into it
+static void loadManifest(const string& filename, unordered_map<string, u64>* manifest)
+{
+  FILE* f = fopen(filename.c_str(), "rt");
+  if (!f)
+    return;
+
+  char line[4096];
+  while (fgets(line, sizeof(line), f))
+  {
+    unsigned long long hash;
+    int pos = 0;
+    if (sscanf(line, "%16llx %n", &hash, &pos) != 1)
+      continue;
+
+    string output = line + pos;
+    while (!output.empty() && (output.back() == '\n' || output.back() == '\r'))
+      output.pop_back();
+    (*manifest)[output] = hash;
+  }
+
+  fclose(f);
+}
+
+//--------------------------------------------------------------
+static void saveManifest(const string& filename, const unordered_map<string, u64>& manifest)
+{
+  FILE* f = fopen(filename.c_str(), "wt");
+  if (!f)
+    return;
+
+  for (auto& kv : manifest)
+    fprintf(f, "%016llx %s\n", (unsigned long long)kv.second, kv.first.c_str());
+
+  fclose(f);
+}
+
+//--------------------------------------------------------------
+static void compile(const CliOptions& options, CompileJob* job)
+{
+  // each job gets its own app, as the graph lives in it
+  ofApp app;
+  app._scheduleMode = options.minMemory ? ScheduleMode::MinMemory : ScheduleMode::EditOrder;
+  app._paramPrecision = options.paramPrecision;
+  if (!app.loadTemplates(options.templates))
+  {
+    job->error = "unable to load templates";
+    return;
+  }
+
+  CompiledProgram prg;
+  if (!app.loadFromFile(job->input) || !app.generateGraph(&prg))
+  {
+    job->error = app._lastError.empty() ? "compile failed" : app._lastError;
+    return;
+  }
+
+  FILE* f = fopen(job->output.c_str(), "wb");
+  if (!f)
+  {
+    job->error = "unable to write " + job->output;
+    return;
+  }
+
+  bool ok = fwrite(prg.buf.data(), 1, prg.buf.size(), f) == prg.buf.size();
+  ok &= fclose(f) == 0;
+  if (!ok)
+  {
+    job->error = "unable to write " + job->output;
+    remove(job->output.c_str());
+    return;
+  }
+
+  job->numOps = (int)prg.opNodeIds.size();
+  job->numBytes = (int)prg.buf.size();
+  job->numPoolTextures = prg.numPoolTextures;
+  job->editOrderPoolTextures = prg.editOrderPoolTextures;
+  job->numMergedOps = prg.numMergedOps;
+  job->mergedPoolTextures = prg.mergedPoolTextures;
+  job->numDeadOps = prg.numDeadOps;
+  job->numFoldedOps = prg.numFoldedOps;
+  job->numFusedOps = prg.numFusedOps;
+  job->numFusedTextures = prg.numFusedTextures;
+  job->result = CompileJob::Result::Compiled;
+}
+
+//--------------------------------------------------------------
+int main(int argc, char** argv)
+{
+  CliOptions options;
+  if (!parseArgs(argc, argv, &options))
+  {
+    usage();
+    return EXIT_USAGE;
+  }
+
+  ofSetLogLevel(OF_LOG_ERROR);
+
+  if (options.templates.empty())
+  {
+    string exeDir = ofFilePath::getCurrentExeDir();
+    options.templates = ofFilePath::join(exeDir, "data/node_templates.xml");
+  }
+  else
+  {
+    options.templates = ofFilePath::getAbsolutePath(options.templates, false);
+  }
+
+  // the templates are part of the hash, so editing them recompiles everything
+  vector<char> templateBuf;
+  if (!readFile(options.templates, &templateBuf))
+  {
+    fprintf(stderr, "%s: error: unable to load templates\n", options.templates.c_str());
+    return EXIT_USAGE;
+  }
+
+  u64 baseHash = fnv1a(&COMPILER_VERSION, sizeof(COMPILER_VERSION));
+  baseHash = fnv1a(templateBuf.data(), templateBuf.size(), baseHash);
+  baseHash = fnv1a(&options.minMemory, sizeof(options.minMemory), baseHash);
+  baseHash = fnv1a(&options.paramPrecision, sizeof(options.paramPrecision), baseHash);
+
+  vector<CompileJob> jobs;
+  collectJobs(options, &jobs);
+
+  // one manifest per output directory
+  unordered_map<string, unordered_map<string, u64>> manifests;
+  for (CompileJob& job : jobs)
+  {
+    string dir = ofFilePath::getEnclosingDirectory(job.output, false);
+    string manifestFile = ofFilePath::join(dir, MANIFEST_FILENAME);
+    if (!manifests.count(manifestFile))
+      loadManifest(manifestFile, &manifests[manifestFile]);
+
+    if (!job.error.empty())
+      continue;
+
+    vector<char> buf;
+    if (!readFile(job.input, &buf))
+    {
+      job.error = "unable to load file";
+      continue;
+    }
+
+    job.hash = fnv1a(buf.data(), buf.size(), baseHash);
+
+    const unordered_map<string, u64>& manifest = manifests[manifestFile];
+    auto it = manifest.find(ofFilePath::getFileName(job.output));
+    if (!options.force && it != manifest.end() && it->second == job.hash
+        && ofFile::doesFileExist(job.output, false))
+    {
+      job.result = CompileJob::Result::UpToDate;
+    }
+  }
+
+  ThreadPool pool(options.numJobs);
+  pool.parallelFor((int)jobs.size(), [&](int idx) {
+    CompileJob& job = jobs[idx];
+    if (job.result == CompileJob::Result::UpToDate || !job.error.empty())
+      return;
+    compile(options, &job);
+  });
+
+  // report in input order, so the output is stable
+  int numCompiled = 0, numUpToDate = 0, numFailed = 0;
+  for (const CompileJob& job : jobs)
+  {
+    string dir = ofFilePath::getEnclosingDirectory(job.output, false);
+    unordered_map<string, u64>& manifest = manifests[ofFilePath::join(dir, MANIFEST_FILENAME)];
+    string key = ofFilePath::getFileName(job.output);
+
+    switch (job.result)
+    {
+      case CompileJob::Result::Compiled:
+        numCompiled++;
+        manifest[key] = job.hash;
+        if (options.statsSize > 0)
+        {
+          size_t bytes = textureMemory(job.numPoolTextures, options.statsSize, options.statsSize);
+          size_t saved = textureMemory(
+              job.editOrderPoolTextures - job.numPoolTextures, options.statsSize, options.statsSize);
+          printf("%s: %d ops (%d fused) in %d bytes, %d pool textures (%d declared), %.1f MB "
+                 "peak at %dx%d (%.1f MB saved)\n",
+              job.input.c_str(),
+              job.numOps,
+              job.numFusedOps,
+              job.numBytes,
+              job.numPoolTextures,
+              job.numPoolTextures + job.numFusedTextures,
+              bytes / (1024.0 * 1024.0),
+              options.statsSize,
+              options.statsSize,
+              saved / (1024.0 * 1024.0));
+          if (job.numMergedOps > 0)
+          {
+            printf("%s: merged %d duplicate ops, saving %d pool textures\n",
+                job.input.c_str(),
+                job.numMergedOps,
+                job.mergedPoolTextures);
+          }
+          if (job.numDeadOps > 0 || job.numFoldedOps > 0)
+          {
+            printf("%s: removed %d dead ops, folded %d to constants\n",
+                job.input.c_str(),
+                job.numDeadOps,
+                job.numFoldedOps);
+          }
+        }
+        break;
+
+      case CompileJob::Result::UpToDate: numUpToDate++; break;
+
+      case CompileJob::Result::Failed:
+        numFailed++;
+        manifest.erase(key);
+        fprintf(stderr, "%s: error: %s\n", job.input.c_str(), job.error.c_str());
+        break;
+    }
+  }
+
+  for (auto& kv : manifests)
+    saveManifest(kv.first, kv.second);
+
+  printf("%d compiled, %d up to date, %d failed\n", numCompiled, numUpToDate, numFailed);
+  return numFailed > 0 ? EXIT_COMPILE_ERROR : EXIT_OK;
+}
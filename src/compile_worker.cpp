@@ -0,0 +1,183 @@
+#include "compile_worker.hpp"
+#include "ofApp.h"
+
+using namespace std;
+
+//--------------------------------------------------------------
+CompileWorker::CompileWorker(const CompileFn& compile, const SendFn& send)
+    : _compile(compile), _send(send)
+{
+  _thread = thread([this] { workerLoop(); });
+}
+
+//--------------------------------------------------------------
+CompileWorker::~CompileWorker()
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    _quit = true;
+  }
+  _wakeup.notify_one();
+  _thread.join();
+}
+
+//--------------------------------------------------------------
+u32 CompileWorker::compile(shared_ptr<const GraphSnapshot> snapshot)
+{
+  u32 generation;
+  {
+    lock_guard<mutex> lock(_mutex);
+    _snapshot = move(snapshot);
+    _patches.clear();
+    generation = ++_generation;
+  }
+  _wakeup.notify_one();
+  return generation;
+}
+
+//--------------------------------------------------------------
+static VmPatch patchHeader(const vector<char>& patch)
+{
+  VmPatch header;
+  memcpy(&header, patch.data(), sizeof(VmPatch));
+  return header;
+}
+
+//--------------------------------------------------------------
+// Merges the queued patches that overlap the new one into it, and queues it last. Patches that
+// only overlap the merged ones are merged too, so what's left in the queue doesn't overlap it, and
+// the bytes of an op end up written in the order they were changed
+static void queuePatch(vector<vector<char>>* patches, vector<char> patch)
+{
+  VmPatch header = patchHeader(patch);
+  int begin = header.offset;
+  int end = header.offset + header.size;
+  vector<bool> merged(patches->size());
+  bool anyMerged = false;
+  for (bool grown = true; grown;)
+  {
+    grown = false;
+    for (size_t i = 0; i < patches->size(); ++i)
+    {
+      VmPatch queued = patchHeader((*patches)[i]);
+      if (merged[i] || queued.opIndex != header.opIndex || queued.offset >= end
+          || queued.offset + queued.size <= begin)
+      {
+        continue;
+      }
+
+      merged[i] = true;
+      anyMerged = grown = true;
+      begin = min(begin, (int)queued.offset);
+      end = max(end, queued.offset + queued.size);
+    }
+  }
+
+  if (anyMerged)
+  {
+    // the older patches first, in queue order, and the new one on top
+    vector<char> res(sizeof(VmPatch) + end - begin);
+    size_t numKept = 0;
+    for (size_t i = 0; i < patches->size(); ++i)
+    {
+      vector<char>& queued = (*patches)[i];
+      if (!merged[i])
+      {
+        (*patches)[numKept++].swap(queued);
+        continue;
+      }
+
+      VmPatch h = patchHeader(queued);
+      memcpy(res.data() + sizeof(VmPatch) + h.offset - begin,
+          queued.data() + sizeof(VmPatch),
+          h.size);
+    }
+    patches->resize(numKept);
+
+    memcpy(res.data() + sizeof(VmPatch) + header.offset - begin,
+        patch.data() + sizeof(VmPatch),
+        header.size);
+    header.offset = (u16)begin;
+    header.size = (u16)(end - begin);
+    memcpy(res.data(), &header, sizeof(VmPatch));
+    patch.swap(res);
+  }
+
+  patches->push_back(move(patch));
+}
+
+//--------------------------------------------------------------
+void CompileWorker::sendPatch(vector<char> patch)
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    queuePatch(&_patches, move(patch));
+  }
+  _wakeup.notify_one();
+}
+
+//--------------------------------------------------------------
+bool CompileWorker::fetch(u32* generation, CompiledProgram* prg, bool* valid, string* error)
+{
+  lock_guard<mutex> lock(_mutex);
+  if (!_result)
+    return false;
+
+  *generation = _resultGeneration;
+  swap(*prg, *_result);
+  *valid = _resultValid;
+  error->swap(_resultError);
+  _result.reset();
+  return true;
+}
+
+//--------------------------------------------------------------
+void CompileWorker::workerLoop()
+{
+  vector<vector<char>> patches;
+  while (true)
+  {
+    shared_ptr<const GraphSnapshot> snapshot;
+    u32 generation;
+    {
+      unique_lock<mutex> lock(_mutex);
+      _wakeup.wait(lock, [this] { return _quit || _snapshot || !_patches.empty(); });
+      if (_quit)
+        return;
+
+      snapshot = move(_snapshot);
+      generation = _generation;
+      patches.clear();
+      patches.swap(_patches);
+    }
+
+    if (snapshot)
+    {
+      unique_ptr<CompiledProgram> prg(new CompiledProgram());
+      string error;
+      bool valid = _compile(*snapshot, prg.get(), &error);
+      snapshot.reset();
+
+      // NB: the program is copied for sending, as the ui can take the result right away
+      vector<char> buf;
+      {
+        lock_guard<mutex> lock(_mutex);
+        if (_snapshot)
+          continue;
+
+        if (valid)
+          buf = prg->buf;
+        _result = move(prg);
+        _resultGeneration = generation;
+        _resultValid = valid;
+        _resultError = error;
+      }
+
+      if (valid)
+        _send(buf.data(), buf.size());
+    }
+
+    for (const vector<char>& patch : patches)
+      _send(patch.data(), patch.size());
+  }
+}
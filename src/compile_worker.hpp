@@ -0,0 +1,64 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct CompiledProgram;
+struct GraphSnapshot;
+
+//--------------------------------------------------------------
+// Compiles snapshots of the graph and sends the programs from a worker thread, so neither a big
+// graph nor a slow receiver stalls the editor. Requests are coalesced, and the latest one wins:
+// - a compile replaces whatever is still queued, patches included, as the snapshot already has
+//   their values
+// - a patch replaces a queued patch of the same bytes
+// A compile that's been superseded by the time it's done is dropped, without being sent.
+class CompileWorker
+{
+public:
+  typedef std::function<bool(const GraphSnapshot&, CompiledProgram*, std::string*)> CompileFn;
+  typedef std::function<void(const char*, size_t)> SendFn;
+
+  // both are called on the worker thread
+  CompileWorker(const CompileFn& compile, const SendFn& send);
+  ~CompileWorker();
+
+  // Returns the generation of the request, to match it up with its result
+  // NB: the snapshot is shared with the thumbnails, so it's const
+  u32 compile(std::shared_ptr<const GraphSnapshot> snapshot);
+
+  // NB: the patch has to be against the latest compiled program, so the caller has to wait for
+  // the result of its last compile first
+  void sendPatch(std::vector<char> patch);
+
+  // Returns true if a compile finished since the last call, and swaps the program into prg
+  bool fetch(u32* generation, CompiledProgram* prg, bool* valid, std::string* error);
+
+private:
+  void workerLoop();
+
+  CompileFn _compile;
+  SendFn _send;
+  std::thread _thread;
+
+  // everything below is protected by the mutex
+  std::mutex _mutex;
+  std::condition_variable _wakeup;
+  bool _quit = false;
+
+  std::shared_ptr<const GraphSnapshot> _snapshot;
+  u32 _generation = 0;
+  std::vector<std::vector<char>> _patches;
+
+  std::unique_ptr<CompiledProgram> _result;
+  u32 _resultGeneration = 0;
+  bool _resultValid = false;
+  std::string _resultError;
+};
@@ -0,0 +1,314 @@
+#include "graph_binary.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static_assert(sizeof(GraphFileHeader) == 48, "GraphFileHeader layout changed");
+static_assert(sizeof(GraphFileNode) == 24, "GraphFileNode layout changed");
+static_assert(sizeof(GraphFileParam) == 16, "GraphFileParam layout changed");
+static_assert(sizeof(GraphFileConnection) == 12, "GraphFileConnection layout changed");
+
+//--------------------------------------------------------------
+static u32 align4(size_t v)
+{
+  return (u32)((v + 3) & ~3);
+}
+
+//--------------------------------------------------------------
+bool graphFileIsBinary(const string& filename)
+{
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (!f)
+    return false;
+
+  u32 magic = 0;
+  bool res = fread(&magic, sizeof(magic), 1, f) == 1 && magic == GRAPH_FILE_MAGIC;
+  fclose(f);
+  return res;
+}
+
+//--------------------------------------------------------------
+GraphFileReader::~GraphFileReader()
+{
+  close();
+}
+
+//--------------------------------------------------------------
+bool GraphFileReader::open(const string& filename)
+{
+  close();
+
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename.c_str(),
+      GENERIC_READ,
+      FILE_SHARE_READ,
+      NULL,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL,
+      NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER size;
+  HANDLE mapping = NULL;
+  if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+  if (!mapping)
+  {
+    CloseHandle(file);
+    return false;
+  }
+
+  _file = file;
+  _mapping = mapping;
+  _data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  _size = (size_t)size.QuadPart;
+#else
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+
+  if (data == MAP_FAILED)
+    return false;
+
+  _mapping = data;
+  _data = (const char*)data;
+  _size = (size_t)st.st_size;
+#endif
+
+  if (!_data || !validate())
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+bool GraphFileReader::openMemory(const void* data, size_t size)
+{
+  close();
+  _data = (const char*)data;
+  _size = size;
+
+  if (!validate())
+  {
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+void GraphFileReader::close()
+{
+#ifdef _WIN32
+  if (_data && _mapping)
+    UnmapViewOfFile(_data);
+  if (_mapping)
+    CloseHandle((HANDLE)_mapping);
+  if (_file)
+    CloseHandle((HANDLE)_file);
+#else
+  if (_mapping)
+    munmap(_mapping, _size);
+#endif
+
+  _data = nullptr;
+  _size = 0;
+  _file = nullptr;
+  _mapping = nullptr;
+}
+
+//--------------------------------------------------------------
+const GraphFileNode* GraphFileReader::nodes() const
+{
+  return (const GraphFileNode*)(_data + header().nodesOffset);
+}
+
+//--------------------------------------------------------------
+const GraphFileParam* GraphFileReader::params() const
+{
+  return (const GraphFileParam*)(_data + header().paramsOffset);
+}
+
+//--------------------------------------------------------------
+const GraphFileConnection* GraphFileReader::connections() const
+{
+  return (const GraphFileConnection*)(_data + header().connectionsOffset);
+}
+
+//--------------------------------------------------------------
+const char* GraphFileReader::str(u32 offset) const
+{
+  return _data + header().stringsOffset + offset;
+}
+
+//--------------------------------------------------------------
+const char* GraphFileReader::blob(u32 offset) const
+{
+  return _data + header().blobOffset + offset;
+}
+
+//--------------------------------------------------------------
+bool GraphFileReader::validate() const
+{
+  if (_size < sizeof(GraphFileHeader))
+    return false;
+
+  const GraphFileHeader& h = header();
+  if (h.magic != GRAPH_FILE_MAGIC || h.version != GRAPH_FILE_VERSION
+      || h.headerSize != sizeof(GraphFileHeader))
+    return false;
+
+  // every table has to fit in the file, and be aligned so it can be used in place
+  auto validTable = [this](u32 offset, u32 count, size_t elemSize) {
+    return offset % 4 == 0 && offset <= _size && count <= (_size - offset) / elemSize;
+  };
+
+  if (!validTable(h.nodesOffset, h.numNodes, sizeof(GraphFileNode))
+      || !validTable(h.paramsOffset, h.numParams, sizeof(GraphFileParam))
+      || !validTable(h.connectionsOffset, h.numConnections, sizeof(GraphFileConnection))
+      || !validTable(h.blobOffset, h.blobSize, 1) || !validTable(h.stringsOffset, h.stringsSize, 1))
+    return false;
+
+  // the string table has to be terminated, so any offset into it is a valid c string
+  if (h.stringsSize == 0 || _data[h.stringsOffset + h.stringsSize - 1] != 0)
+    return false;
+
+  for (u32 i = 0; i < h.numNodes; ++i)
+  {
+    const GraphFileNode& node = nodes()[i];
+    if (node.name >= h.stringsSize || node.firstParam > h.numParams
+        || node.numParams > h.numParams - node.firstParam)
+      return false;
+  }
+
+  for (u32 i = 0; i < h.numParams; ++i)
+  {
+    const GraphFileParam& param = params()[i];
+    if (param.name >= h.stringsSize || param.offset > h.blobSize
+        || param.size > h.blobSize - param.offset)
+      return false;
+  }
+
+  for (u32 i = 0; i < h.numConnections; ++i)
+  {
+    const GraphFileConnection& con = connections()[i];
+    if (con.fromNode >= h.numNodes || con.toNode >= h.numNodes || con.toInput >= h.stringsSize)
+      return false;
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+u32 GraphFileWriter::addString(const string& str)
+{
+  // node, param and input names repeat a lot, so they're only stored once
+  auto it = _stringOffsets.find(str);
+  if (it != _stringOffsets.end())
+    return it->second;
+
+  u32 offset = (u32)_strings.size();
+  _strings.insert(_strings.end(), str.begin(), str.end());
+  _strings.push_back(0);
+  _stringOffsets[str] = offset;
+  return offset;
+}
+
+//--------------------------------------------------------------
+void GraphFileWriter::addNode(int id, const string& name, float x, float y)
+{
+  _nodes.push_back(GraphFileNode{ (u32)id, addString(name), x, y, (u32)_params.size(), 0 });
+}
+
+//--------------------------------------------------------------
+void GraphFileWriter::addParam(const string& name, u32 type, const void* value, size_t size)
+{
+  // keep the values aligned, so they can be read in place
+  _blob.resize(align4(_blob.size()));
+  u32 offset = (u32)_blob.size();
+  _blob.insert(_blob.end(), (const char*)value, (const char*)value + size);
+
+  _params.push_back(GraphFileParam{ addString(name), type, offset, (u32)size });
+  _nodes.back().numParams++;
+}
+
+//--------------------------------------------------------------
+void GraphFileWriter::addConnection(int fromNode, int toNode, const string& toInput)
+{
+  _connections.push_back(GraphFileConnection{ (u32)fromNode, (u32)toNode, addString(toInput) });
+}
+
+//--------------------------------------------------------------
+bool GraphFileWriter::save(const string& filename) const
+{
+  GraphFileHeader h;
+  memset(&h, 0, sizeof(h));
+  h.magic = GRAPH_FILE_MAGIC;
+  h.version = GRAPH_FILE_VERSION;
+  h.headerSize = sizeof(GraphFileHeader);
+
+  u32 pos = sizeof(GraphFileHeader);
+  auto addTable = [&pos](u32 count, size_t elemSize, u32* numOut, u32* offsetOut) {
+    *numOut = count;
+    *offsetOut = pos;
+    pos = align4(pos + count * elemSize);
+  };
+
+  // an empty string table still gets its terminator, so it passes validation
+  vector<char> strings = _strings.empty() ? vector<char>(1, 0) : _strings;
+
+  addTable((u32)_nodes.size(), sizeof(GraphFileNode), &h.numNodes, &h.nodesOffset);
+  addTable((u32)_params.size(), sizeof(GraphFileParam), &h.numParams, &h.paramsOffset);
+  addTable((u32)_connections.size(),
+      sizeof(GraphFileConnection),
+      &h.numConnections,
+      &h.connectionsOffset);
+  addTable((u32)_blob.size(), 1, &h.blobSize, &h.blobOffset);
+  addTable((u32)strings.size(), 1, &h.stringsSize, &h.stringsOffset);
+
+  vector<char> buf(pos, 0);
+  auto copyTable = [&buf](u32 offset, const void* data, size_t size) {
+    if (size)
+      memcpy(buf.data() + offset, data, size);
+  };
+
+  copyTable(0, &h, sizeof(h));
+  copyTable(h.nodesOffset, _nodes.data(), _nodes.size() * sizeof(GraphFileNode));
+  copyTable(h.paramsOffset, _params.data(), _params.size() * sizeof(GraphFileParam));
+  copyTable(h.connectionsOffset,
+      _connections.data(),
+      _connections.size() * sizeof(GraphFileConnection));
+  copyTable(h.blobOffset, _blob.data(), _blob.size());
+  copyTable(h.stringsOffset, strings.data(), strings.size());
+
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (!f)
+    return false;
+
+  bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+  ok &= fclose(f) == 0;
+  return ok;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Binary graph files. The file is a header followed by flat tables, so it can be mapped and read
+// in place, with no parsing beyond validating the offsets once.
+// NB: like the texture vm, this is free of openFrameworks, so tools can read graphs headless.
+//
+// Layout (all little endian, all tables 4 byte aligned):
+//   GraphFileHeader
+//   GraphFileNode[numNodes]
+//   GraphFileParam[numParams]        each node owns a contiguous range
+//   GraphFileConnection[numConnections]
+//   param blob                       raw param values, as they are stored in memory
+//   string table                     zero terminated strings, referenced by offset
+
+static const u32 GRAPH_FILE_MAGIC = 0x48505247; // "GRPH"
+static const u16 GRAPH_FILE_VERSION = 1;
+
+struct GraphFileHeader
+{
+  u32 magic;
+  u16 version;
+  u16 headerSize;
+
+  u32 numNodes, nodesOffset;
+  u32 numParams, paramsOffset;
+  u32 numConnections, connectionsOffset;
+  u32 blobSize, blobOffset;
+  u32 stringsSize, stringsOffset;
+};
+
+struct GraphFileNode
+{
+  u32 id;
+  // string table offset
+  u32 name;
+  // top-left of the heading
+  float x, y;
+  u32 firstParam;
+  u32 numParams;
+};
+
+struct GraphFileParam
+{
+  u32 name;
+  // ParamType
+  u32 type;
+  // offset and size in the param blob. String values are stored without a terminator
+  u32 offset;
+  u32 size;
+};
+
+struct GraphFileConnection
+{
+  // indices into the node table
+  u32 fromNode;
+  u32 toNode;
+  // string table offset of the input name
+  u32 toInput;
+};
+
+// Returns true if the file starts with the binary graph magic
+bool graphFileIsBinary(const std::string& filename);
+
+//--------------------------------------------------------------
+// Maps a binary graph file, and validates all the offsets up front, so the tables can be used
+// directly afterwards
+class GraphFileReader
+{
+public:
+  ~GraphFileReader();
+
+  bool open(const std::string& filename);
+  // NB: the memory has to outlive the reader
+  bool openMemory(const void* data, size_t size);
+  void close();
+
+  const GraphFileHeader& header() const { return *(const GraphFileHeader*)_data; }
+  const GraphFileNode* nodes() const;
+  const GraphFileParam* params() const;
+  const GraphFileConnection* connections() const;
+  const char* str(u32 offset) const;
+  const char* blob(u32 offset) const;
+
+private:
+  bool validate() const;
+
+  const char* _data = nullptr;
+  size_t _size = 0;
+
+  // the platform's mapping handles, if the data was mapped
+  void* _file = nullptr;
+  void* _mapping = nullptr;
+};
+
+//--------------------------------------------------------------
+// Builds a binary graph file. Params belong to the last node added
+class GraphFileWriter
+{
+public:
+  void addNode(int id, const std::string& name, float x, float y);
+  void addParam(const std::string& name, u32 type, const void* value, size_t size);
+  void addConnection(int fromNode, int toNode, const std::string& toInput);
+
+  bool save(const std::string& filename) const;
+
+private:
+  u32 addString(const std::string& str);
+
+  std::vector<GraphFileNode> _nodes;
+  std::vector<GraphFileParam> _params;
+  std::vector<GraphFileConnection> _connections;
+  std::vector<char> _blob;
+  std::vector<char> _strings;
+  std::unordered_map<std::string, u32> _stringOffsets;
+};
@@ -0,0 +1,474 @@
+#include "graph_sort.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <unordered_set>
+
+using namespace std;
+
+//--------------------------------------------------------------
+bool topologicalSort(int numNodes, const vector<pair<int, int>>& edges, vector<int>* order)
+{
+  // build the out-edges in compressed form, so the whole sort is a handful of flat arrays
+  vector<int> outStart(numNodes + 1, 0);
+  vector<int> inDegree(numNodes, 0);
+  for (const pair<int, int>& e : edges)
+  {
+    outStart[e.first + 1]++;
+    inDegree[e.second]++;
+  }
+
+  for (int i = 0; i < numNodes; ++i)
+    outStart[i + 1] += outStart[i];
+
+  vector<int> outEdges(edges.size());
+  vector<int> fill(outStart.begin(), outStart.end() - 1);
+  for (const pair<int, int>& e : edges)
+    outEdges[fill[e.first]++] = e.second;
+
+  priority_queue<int, vector<int>, greater<int>> ready;
+  for (int i = 0; i < numNodes; ++i)
+  {
+    if (inDegree[i] == 0)
+      ready.push(i);
+  }
+
+  order->reserve(order->size() + numNodes);
+  int numSorted = 0;
+  while (!ready.empty())
+  {
+    int node = ready.top();
+    ready.pop();
+    order->push_back(node);
+    numSorted++;
+
+    for (int i = outStart[node]; i < outStart[node + 1]; ++i)
+    {
+      if (--inDegree[outEdges[i]] == 0)
+        ready.push(outEdges[i]);
+    }
+  }
+
+  // any nodes left over are part of a cycle
+  return numSorted == numNodes;
+}
+
+//--------------------------------------------------------------
+// The distinct inputs and outputs of each node
+static void buildAdjacency(int numNodes,
+    const vector<pair<int, int>>& edges,
+    vector<vector<int>>* preds,
+    vector<vector<int>>* succs)
+{
+  preds->assign(numNodes, vector<int>());
+  succs->assign(numNodes, vector<int>());
+  for (const pair<int, int>& e : edges)
+    (*preds)[e.second].push_back(e.first);
+
+  for (int node = 0; node < numNodes; ++node)
+  {
+    vector<int>& p = (*preds)[node];
+    sort(p.begin(), p.end());
+    p.erase(unique(p.begin(), p.end()), p.end());
+    for (int pred : p)
+      (*succs)[pred].push_back(node);
+  }
+}
+
+//--------------------------------------------------------------
+// The most outputs alive at once when running in the given order. Like allocateTextures, an output
+// is allocated before the inputs on their last use are freed, and sinks don't need one
+static int peakLive(const vector<vector<int>>& preds,
+    const vector<vector<int>>& succs,
+    const vector<int>& order)
+{
+  vector<int> remaining(succs.size());
+  for (size_t i = 0; i < succs.size(); ++i)
+    remaining[i] = (int)succs[i].size();
+
+  int live = 0, peak = 0;
+  for (int node : order)
+  {
+    if (!succs[node].empty())
+      peak = max(peak, ++live);
+
+    for (int pred : preds[node])
+    {
+      if (--remaining[pred] == 0)
+        live--;
+    }
+  }
+  return peak;
+}
+
+//--------------------------------------------------------------
+static void sethiUllmanOrder(const vector<int>& topo,
+    vector<vector<int>> preds,
+    const vector<vector<int>>& succs,
+    vector<int>* order)
+{
+  int numNodes = (int)topo.size();
+
+  // Sethi-Ullman numbers: the textures needed to evaluate a node, as if its inputs were trees.
+  // The inputs needing the most go first, as their temporaries are gone by the time the smaller
+  // ones are evaluated. Ties keep the lowest index first.
+  vector<int> need(numNodes, 1);
+  for (int node : topo)
+  {
+    vector<int>& p = preds[node];
+    stable_sort(p.begin(), p.end(), [&](int a, int b) { return need[a] > need[b]; });
+
+    for (size_t i = 0; i < p.size(); ++i)
+      need[node] = max(need[node], need[p[i]] + (int)i);
+  }
+
+  // Emit depth first from the sinks, so each branch is finished before the next one starts.
+  // NB: a node is emitted once all its inputs are, which also covers the store -> load edges
+  enum : u8
+  {
+    NEW,
+    EXPANDED,
+    EMITTED,
+  };
+  vector<u8> state(numNodes, NEW);
+  vector<int> stack;
+  for (int root = 0; root < numNodes; ++root)
+  {
+    if (!succs[root].empty())
+      continue;
+
+    stack.push_back(root);
+    while (!stack.empty())
+    {
+      int node = stack.back();
+      if (state[node] == EMITTED)
+      {
+        stack.pop_back();
+        continue;
+      }
+
+      if (state[node] == NEW)
+      {
+        state[node] = EXPANDED;
+        for (auto it = preds[node].rbegin(); it != preds[node].rend(); ++it)
+        {
+          if (state[*it] == NEW)
+            stack.push_back(*it);
+        }
+        continue;
+      }
+
+      // all the inputs are emitted
+      stack.pop_back();
+      state[node] = EMITTED;
+      order->push_back(node);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+// List scheduling by liveness: of the ready nodes, the one that adds the fewest live outputs goes
+// next, that is its own output, less the inputs it's the last reader of. Ties keep the lowest index
+// first, like topologicalSort, so nodes that were created together stay together.
+static void greedyOrder(
+    const vector<vector<int>>& preds, const vector<vector<int>>& succs, vector<int>* order)
+{
+  int numNodes = (int)preds.size();
+  vector<int> unscheduledPreds(numNodes), remainingReaders(numNodes), delta(numNodes);
+  for (int node = 0; node < numNodes; ++node)
+  {
+    unscheduledPreds[node] = (int)preds[node].size();
+    remainingReaders[node] = (int)succs[node].size();
+    delta[node] = succs[node].empty() ? 0 : 1;
+  }
+
+  // an input with a single reader is freed by it
+  for (int node = 0; node < numNodes; ++node)
+  {
+    if (succs[node].size() == 1)
+      delta[succs[node][0]]--;
+  }
+
+  // NB: scores only ever go down, so stale queue entries are the ones that don't match delta
+  struct Entry
+  {
+    int delta;
+    int node;
+    bool operator<(const Entry& rhs) const
+    {
+      return delta != rhs.delta ? delta > rhs.delta : node > rhs.node;
+    }
+  };
+
+  priority_queue<Entry> ready;
+  for (int node = 0; node < numNodes; ++node)
+  {
+    if (unscheduledPreds[node] == 0)
+      ready.push(Entry{ delta[node], node });
+  }
+
+  vector<bool> scheduled(numNodes);
+  while (!ready.empty())
+  {
+    Entry e = ready.top();
+    ready.pop();
+    if (scheduled[e.node] || e.delta != delta[e.node])
+      continue;
+
+    scheduled[e.node] = true;
+    order->push_back(e.node);
+
+    // the last unscheduled reader of an input now frees it
+    for (int pred : preds[e.node])
+    {
+      if (--remainingReaders[pred] != 1)
+        continue;
+
+      for (int succ : succs[pred])
+      {
+        if (!scheduled[succ])
+        {
+          delta[succ]--;
+          if (unscheduledPreds[succ] == 0)
+            ready.push(Entry{ delta[succ], succ });
+          break;
+        }
+      }
+    }
+
+    for (int succ : succs[e.node])
+    {
+      if (--unscheduledPreds[succ] == 0)
+        ready.push(Entry{ delta[succ], succ });
+    }
+  }
+}
+
+//--------------------------------------------------------------
+bool memorySchedule(int numNodes, const vector<pair<int, int>>& edges, vector<int>* order)
+{
+  vector<int> topo;
+  if (!topologicalSort(numNodes, edges, &topo))
+    return false;
+
+  vector<vector<int>> preds, succs;
+  buildAdjacency(numNodes, edges, &preds, &succs);
+
+  // The depth first order does well on tree like graphs, and the greedy one on wide ones.
+  // NB: both are cheap, so the one with the lower peak is kept
+  vector<int> depthFirst, greedy;
+  depthFirst.reserve(numNodes);
+  greedy.reserve(numNodes);
+  sethiUllmanOrder(topo, preds, succs, &depthFirst);
+  greedyOrder(preds, succs, &greedy);
+
+  bool useGreedy = peakLive(preds, succs, greedy) < peakLive(preds, succs, depthFirst);
+  const vector<int>& best = useGreedy ? greedy : depthFirst;
+  order->insert(order->end(), best.begin(), best.end());
+  return true;
+}
+
+//--------------------------------------------------------------
+void OnlineTopoOrder::clear()
+{
+  _nodes.clear();
+  _ordToNode.clear();
+  _numHoles = 0;
+}
+
+//--------------------------------------------------------------
+void OnlineTopoOrder::addNode(int id)
+{
+  if (_nodes.count(id))
+    return;
+
+  _nodes[id].ord = (int)_ordToNode.size();
+  _ordToNode.push_back(id);
+}
+
+//--------------------------------------------------------------
+void OnlineTopoOrder::removeNode(int id)
+{
+  auto it = _nodes.find(id);
+  if (it == _nodes.end())
+    return;
+
+  // copy the edges, as removing them modifies the lists
+  vector<int> out = it->second.out;
+  vector<int> in = it->second.in;
+  for (int to : out)
+    removeEdge(id, to);
+  for (int from : in)
+    removeEdge(from, id);
+
+  _ordToNode[_nodes[id].ord] = -1;
+  _nodes.erase(id);
+
+  // renumber once the order is mostly holes
+  if (++_numHoles > (int)_nodes.size())
+    compact();
+}
+
+//--------------------------------------------------------------
+void OnlineTopoOrder::compact()
+{
+  int ord = 0;
+  for (int id : _ordToNode)
+  {
+    if (id != -1)
+    {
+      _nodes[id].ord = ord;
+      _ordToNode[ord++] = id;
+    }
+  }
+
+  _ordToNode.resize(ord);
+  _numHoles = 0;
+}
+
+//--------------------------------------------------------------
+bool OnlineTopoOrder::searchForward(int id, int upperBound, int target, vector<int>* visited) const
+{
+  // collects the nodes reachable from id that are ordered before the upper bound. Reaching the
+  // target means the new edge closes a cycle
+  unordered_set<int> seen;
+  vector<int> stack = { id };
+  while (!stack.empty())
+  {
+    int cur = stack.back();
+    stack.pop_back();
+
+    if (!seen.insert(cur).second)
+      continue;
+    visited->push_back(cur);
+
+    for (int next : _nodes.at(cur).out)
+    {
+      if (next == target)
+        return false;
+
+      if (_nodes.at(next).ord < upperBound)
+        stack.push_back(next);
+    }
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+void OnlineTopoOrder::searchBackward(int id, int lowerBound, vector<int>* visited) const
+{
+  unordered_set<int> seen;
+  vector<int> stack = { id };
+  while (!stack.empty())
+  {
+    int cur = stack.back();
+    stack.pop_back();
+
+    if (!seen.insert(cur).second)
+      continue;
+    visited->push_back(cur);
+
+    for (int prev : _nodes.at(cur).in)
+    {
+      if (_nodes.at(prev).ord > lowerBound)
+        stack.push_back(prev);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+bool OnlineTopoOrder::wouldCreateCycle(int from, int to) const
+{
+  if (from == to)
+    return true;
+
+  auto itFrom = _nodes.find(from);
+  auto itTo = _nodes.find(to);
+  if (itFrom == _nodes.end() || itTo == _nodes.end())
+    return false;
+
+  if (itFrom->second.ord < itTo->second.ord)
+    return false;
+
+  vector<int> visited;
+  return !searchForward(to, itFrom->second.ord, from, &visited);
+}
+
+//--------------------------------------------------------------
+bool OnlineTopoOrder::addEdge(int from, int to)
+{
+  if (from == to || !_nodes.count(from) || !_nodes.count(to))
+    return false;
+
+  int lb = _nodes[to].ord;
+  int ub = _nodes[from].ord;
+
+  if (lb < ub)
+  {
+    // The edge goes backwards in the current order, so the affected region is the nodes between
+    // the two endpoints: the ones reachable from `to`, and the ones that reach `from`
+    vector<int> deltaF, deltaB;
+    if (!searchForward(to, ub, from, &deltaF))
+      return false;
+    searchBackward(from, lb, &deltaB);
+
+    auto fnByOrd = [this](int a, int b) { return _nodes[a].ord < _nodes[b].ord; };
+    sort(deltaF.begin(), deltaF.end(), fnByOrd);
+    sort(deltaB.begin(), deltaB.end(), fnByOrd);
+
+    // reuse the positions the affected nodes had, but put everything that reaches `from` first
+    vector<int> slots;
+    for (int id : deltaB)
+      slots.push_back(_nodes[id].ord);
+    for (int id : deltaF)
+      slots.push_back(_nodes[id].ord);
+    sort(slots.begin(), slots.end());
+
+    size_t slot = 0;
+    for (int id : deltaB)
+    {
+      _nodes[id].ord = slots[slot++];
+      _ordToNode[_nodes[id].ord] = id;
+    }
+    for (int id : deltaF)
+    {
+      _nodes[id].ord = slots[slot++];
+      _ordToNode[_nodes[id].ord] = id;
+    }
+  }
+
+  _nodes[from].out.push_back(to);
+  _nodes[to].in.push_back(from);
+  return true;
+}
+
+//--------------------------------------------------------------
+void OnlineTopoOrder::removeEdge(int from, int to)
+{
+  // NB: removing an edge never invalidates the order
+  auto fnRemoveOne = [](vector<int>* v, int value) {
+    auto it = find(v->begin(), v->end(), value);
+    if (it != v->end())
+      v->erase(it);
+  };
+
+  auto itFrom = _nodes.find(from);
+  auto itTo = _nodes.find(to);
+  if (itFrom != _nodes.end())
+    fnRemoveOne(&itFrom->second.out, to);
+  if (itTo != _nodes.end())
+    fnRemoveOne(&itTo->second.in, from);
+}
+
+//--------------------------------------------------------------
+void OnlineTopoOrder::order(vector<int>* ids) const
+{
+  for (int id : _ordToNode)
+  {
+    if (id != -1)
+      ids->push_back(id);
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Kahn's algorithm over the nodes [0, numNodes), with edges as (from, to) pairs. When several
+// nodes are ready, the one with the lowest index goes first, so the order is deterministic.
+// Returns false if the graph has cycles
+bool topologicalSort(
+    int numNodes, const std::vector<std::pair<int, int>>& edges, std::vector<int>* order);
+
+// A topological order that tries to keep few outputs alive at once, instead of starting every
+// generator early. Two orders are tried, and the one with fewer outputs alive at its peak is kept:
+// the graph emitted depth first from its sinks, evaluating the inputs that need the most textures
+// first (Sethi-Ullman order), and a greedy list schedule that always runs the ready node adding the
+// fewest live outputs. Returns false if the graph has cycles
+bool memorySchedule(
+    int numNodes, const std::vector<std::pair<int, int>>& edges, std::vector<int>* order);
+
+//--------------------------------------------------------------
+// Keeps a topological order up to date as nodes and edges are added and removed, using the
+// Pearce-Kelly algorithm: adding an edge only reorders the nodes between its endpoints in the
+// current order, and a cycle is detected during that search. Edges may be added more than once.
+class OnlineTopoOrder
+{
+public:
+  void clear();
+
+  // new nodes go last in the order
+  void addNode(int id);
+  // also removes the node's edges
+  void removeNode(int id);
+
+  // Returns false, and leaves the graph untouched, if the edge would create a cycle
+  bool addEdge(int from, int to);
+  void removeEdge(int from, int to);
+  bool wouldCreateCycle(int from, int to) const;
+
+  // the node ids in topological order
+  void order(std::vector<int>* ids) const;
+
+private:
+  struct NodeInfo
+  {
+    int ord;
+    std::vector<int> out;
+    std::vector<int> in;
+  };
+
+  bool searchForward(int id, int upperBound, int target, std::vector<int>* visited) const;
+  void searchBackward(int id, int lowerBound, std::vector<int>* visited) const;
+  void compact();
+
+  std::unordered_map<int, NodeInfo> _nodes;
+
+  // node id for each position in the order, -1 for removed nodes
+  std::vector<int> _ordToNode;
+  int _numHoles = 0;
+};
@@ -1,27 +1,40 @@
 #include "ofApp.h"
 #include "xml_utils.hpp"
 #include "nodr_utils.hpp"
+#include "graph_sort.hpp"
+#include "graph_binary.hpp"
+#include "texture_alloc.hpp"
+#include "vm_bytecode.hpp"
+#include "xml_stream.hpp"
 
 //--------------------------------------------------------------
 static const int FONT_HEIGHT = 12;
 static const int FONT_PADDING = 4;
 static const int HEADING_SIZE = FONT_HEIGHT + 2 * FONT_PADDING;
-static const int RECT_UPPER_ROUNDING = 4;
-static const int RECT_LOWER_ROUNDING = 2;
 static const int INPUT_HEIGHT = 14;
 static const int INPUT_PADDING = 4;
-static const int CONNECTOR_RADIUS = 5;
 static const int MIN_NODE_WIDTH = 100;
 static const int NUM_AUX_TEXTURES = 16;
+static const int PREVIEW_SIZE = 256;
+static const int THUMBNAIL_SIZE = 64;
+static const int THUMBNAIL_PADDING = 4;
+#ifdef _WIN32
+static const char* TRANSPORT_ADDRESS = "pipe:texturepipe";
+#else
+static const char* TRANSPORT_ADDRESS = "unix:/tmp/texturepipe";
+#endif
 static const ImVec2 BUTTON_SIZE(225, 20);
 
-static const char* FILE_DLG_XML_FILTER = "Textures (*.xml)\0*.xml\0All Files (*.*)\0*.*\0";
+static const char* FILE_DLG_XML_FILTER =
+    "Textures (*.xml;*.ngraph)\0*.xml;*.ngraph\0All Files (*.*)\0*.*\0";
 static const char* FILE_DLG_XML_EXT = "xml";
+static const char* BINARY_GRAPH_EXT = "ngraph";
 
 static const char* FILE_DLG_GEN_FILTER = "Textures (*.dat)\0*.dat\0All Files (*.*)\0*.*\0";
 static const char* FILE_DLG_GEN_EXT = "dat";
 
-static ofApp* g_App;
+// NB: thread local, so the batch compiler can run one app per worker thread
+static thread_local ofApp* g_App;
 
 //--------------------------------------------------------------
 // NB: The GLUT modifiers always returned 0, so I had to roll my own *shrug*
@@ -54,7 +67,14 @@ bool ofKeyControl()
 
 
 //--------------------------------------------------------------
-static void drawStringCentered(const string& str,
+static void addString(ofMesh* mesh, const string& str, const ofTrueTypeFont& font, float x, float y)
+{
+  mesh->append(font.getStringMesh(str, x, y, ofIsVFlipped()));
+}
+
+//--------------------------------------------------------------
+static void addStringCentered(ofMesh* mesh,
+    const string& str,
     const ofTrueTypeFont& font,
     const ofRectangle& rect,
     bool centerHoriz,
@@ -64,30 +84,7 @@ static void drawStringCentered(const string& str,
   ofRectangle r = font.getStringBoundingBox(str, rect.x, rect.y);
   int dx = centerHoriz ? (rect.width - r.width) / 2 : 0;
   int dy = centerVert ? (rect.height - r.height) / 2 : 0;
-  font.drawString(str, rect.getLeft() + dx, rect.getBottom() - dy);
-}
-
-//--------------------------------------------------------------
-static void drawOutlineRect(
-    const ofRectangle& rect, const ofColor& fill, int upperRounding, int lowerRounding)
-{
-  ofSetColor(fill);
-  ofDrawRectRounded(rect, upperRounding, upperRounding, lowerRounding, lowerRounding);
-  ofNoFill();
-  ofSetColor(30);
-  ofDrawRectRounded(rect, upperRounding, upperRounding, lowerRounding, lowerRounding);
-  ofFill();
-}
-
-//--------------------------------------------------------------
-static void drawOutlineCircle(const ofPoint& pt, float radius, const ofColor& fill)
-{
-  ofSetColor(fill);
-  ofDrawCircle(pt, radius);
-  ofNoFill();
-  ofSetColor(30);
-  ofDrawCircle(pt, radius);
-  ofFill();
+  addString(mesh, str, font, rect.getLeft() + dx, rect.getBottom() - dy);
 }
 
 //--------------------------------------------------------------
@@ -96,6 +93,13 @@ void NodeTemplate::calcTemplateRectangle(ofTrueTypeFont& font)
   int numRows = max(1, (int)inputs.size());
   int h = 2 * INPUT_PADDING + numRows * INPUT_HEIGHT + (numRows - 1) * INPUT_PADDING;
 
+  // headless, there's no font to measure with
+  if (!font.isLoaded())
+  {
+    rect = ofRectangle(ofPoint(0, 0), MIN_NODE_WIDTH, h);
+    return;
+  }
+
   int strWidth = (int)ceil(font.stringWidth(name));
   for (const NodeTemplate::NodeParam& p : inputs)
   {
@@ -115,7 +119,8 @@ Node::Node(const NodeTemplate* t, const ofPoint& pt, int id) : name(t->name), id
   bodyRect.translate(pt);
 
   headingRect = bodyRect;
-  float h = 2 * FONT_PADDING + g_App->_font.stringHeight(name);
+  float h = 2 * FONT_PADDING
+            + (g_App->_font.isLoaded() ? g_App->_font.stringHeight(name) : FONT_HEIGHT);
   headingRect.setHeight(h);
   headingRect.translateY(-h);
 
@@ -123,7 +128,7 @@ Node::Node(const NodeTemplate* t, const ofPoint& pt, int id) : name(t->name), id
   for (size_t i = 0; i < t->inputs.size(); ++i)
   {
     const NodeTemplate::NodeParam& input = t->inputs[i];
-    inputs.push_back(new NodeConnector(input.name,
+    inputs.push_back(g_App->allocConnector(input.name,
         input.type,
         NodeConnector::Dir::Input,
         ofPoint(bodyRect.x + INPUT_PADDING + CONNECTOR_RADIUS, y + INPUT_HEIGHT / 2),
@@ -136,11 +141,11 @@ Node::Node(const NodeTemplate* t, const ofPoint& pt, int id) : name(t->name), id
     params.push_back(Node::Param{ param.name, param.type, param.bounds });
   }
 
-  output = new NodeConnector("out",
+  output = g_App->allocConnector("out",
       t->output,
       NodeConnector::Dir::Output,
       ofPoint(bodyRect.getRight() - INPUT_PADDING - CONNECTOR_RADIUS,
-                             bodyRect.y + INPUT_PADDING + INPUT_HEIGHT / 2),
+          bodyRect.y + INPUT_PADDING + INPUT_HEIGHT / 2),
       this);
 }
 
@@ -176,89 +181,75 @@ void Node::translate(const ofPoint& delta)
     input->pt += delta;
 
   output->pt += delta;
+
+  g_App->updateNodeGrid(this);
+  g_App->_canvas.nodeChanged(this);
 }
 
 //--------------------------------------------------------------
-void Node::draw()
+ofRectangle Node::bounds() const
 {
-  // Draw body
-  drawOutlineRect(bodyRect, 95, 0, RECT_LOWER_ROUNDING);
+  ofRectangle res = bodyRect;
+  res.growToInclude(headingRect);
+  return res;
+}
 
-  // Draw heading
-  drawOutlineRect(headingRect, 78, RECT_UPPER_ROUNDING, 0);
-  ofSetColor(0);
+//--------------------------------------------------------------
+string Node::headingText() const
+{
   // for load and store nodes, include what texture they output too
-  string heading = name;
   if (name == "Load" || name == "Store")
   {
     char buf[256];
     sprintf(buf, "%s [%d]", name.c_str(), params[0].value.iValue.value);
-    heading = buf;
+    return buf;
   }
-  drawStringCentered(heading, g_App->_font, headingRect, true, true);
+  return name;
+}
+
+//--------------------------------------------------------------
+void Node::layoutLabels(const ofTrueTypeFont& font, ofMesh* mesh) const
+{
+  addStringCentered(mesh, headingText(), font, headingRect, true, true);
 
   int circleInset = CONNECTOR_RADIUS * 2 + 2 * INPUT_PADDING;
 
-  // Draw inputs
+  // each input gets its own rect, and we draw the text centered inside that
   int y = bodyRect.y + INPUT_PADDING;
   for (const NodeConnector* input : inputs)
   {
-    // each input gets its own rect, and we draw the text centered inside that
     ofRectangle rect(ofPoint(bodyRect.x + circleInset, y), bodyRect.getWidth(), INPUT_HEIGHT);
-    ofSetColor(0);
-    drawStringCentered(input->name, g_App->_font, rect, false, true);
-
-    ofPoint pt(bodyRect.x + INPUT_PADDING + CONNECTOR_RADIUS, y + INPUT_HEIGHT / 2);
-    drawOutlineCircle(
-        pt, CONNECTOR_RADIUS, input->cons.empty() ? ofColor(140) : ofColor(80, 200, 80));
-
+    addStringCentered(mesh, input->name, font, rect, false, true);
     y += INPUT_HEIGHT + INPUT_PADDING;
   }
 
-  // Draw output
   if (output->type != ParamType::Void)
   {
     int y = bodyRect.y + INPUT_PADDING;
-    ofRectangle strRect = g_App->_font.getStringBoundingBox(output->name, 0, 0);
+    ofRectangle strRect = font.getStringBoundingBox(output->name, 0, 0);
 
     // right aligned..
     int dy = (INPUT_HEIGHT - strRect.height) / 2;
     int strX = bodyRect.getRight() - circleInset - strRect.getWidth();
-    g_App->_font.drawString(output->name, strX, y + INPUT_HEIGHT - dy);
-
-    ofPoint pt(bodyRect.getRight() - INPUT_PADDING - CONNECTOR_RADIUS, y + INPUT_HEIGHT / 2);
-    drawOutlineCircle(
-        pt, CONNECTOR_RADIUS, output->cons.empty() ? ofColor(140) : ofColor(80, 200, 80));
-  }
-
-  if (selected)
-  {
-    ofNoFill();
-    ofSetLineWidth(3);
-    ofSetColor(219, 136, 39);
-    ofDrawRectRounded(headingRect.getTopLeft(),
-        bodyRect.getWidth(),
-        headingRect.getHeight() + bodyRect.getHeight(),
-        RECT_UPPER_ROUNDING,
-        RECT_UPPER_ROUNDING,
-        RECT_LOWER_ROUNDING,
-        RECT_LOWER_ROUNDING);
-    ofSetLineWidth(1);
-    ofFill();
+    addString(mesh, output->name, font, strX, y + INPUT_HEIGHT - dy);
   }
 }
 
 //--------------------------------------------------------------
-void Node::drawConnections()
+void Node::drawSelection()
 {
+  ofNoFill();
   ofSetLineWidth(3);
-  ofSetColor(100, 100, 200);
-  for (const NodeConnector* con : output->cons)
-  {
-    ofDrawLine(output->pt, con->pt);
-  }
-
+  ofSetColor(219, 136, 39);
+  ofDrawRectRounded(headingRect.getTopLeft(),
+      bodyRect.getWidth(),
+      headingRect.getHeight() + bodyRect.getHeight(),
+      RECT_UPPER_ROUNDING,
+      RECT_UPPER_ROUNDING,
+      RECT_LOWER_ROUNDING,
+      RECT_LOWER_ROUNDING);
   ofSetLineWidth(1);
+  ofFill();
 }
 
 //--------------------------------------------------------------
@@ -283,6 +274,12 @@ bool validConnection(const NodeConnector* a, const NodeConnector* b)
   if (!input->cons.empty())
     return false;
 
+  // reject connections that would create a cycle
+  const NodeConnector* output = a->dir == NodeConnector::Dir::Input ? b : a;
+  if (g_App->_topoOrderValid
+      && g_App->_topoOrder.wouldCreateCycle(output->parent->id, input->parent->id))
+    return false;
+
   return true;
 }
 
@@ -332,185 +329,443 @@ static string paramTypeToString(const Node::Param& p)
 //--------------------------------------------------------------
 static string paramValueToString(const Node::Param& p)
 {
-  ostringstream ss;
+  // NB: vec2 and color use the same "x, y" format as openFrameworks' stream operators
   switch (p.type)
   {
-    case ParamType::Bool: ss << p.value.bValue; break;
-    case ParamType::Int: ss << p.value.iValue.value; break;
-    case ParamType::Float: ss << p.value.fValue.value; break;
-    case ParamType::Vec2: ss << p.value.vValue.value; break;
-    case ParamType::Color: ss << p.value.cValue; break;
-    case ParamType::String: ss << p.value.sValue; break;
+    case ParamType::Bool: return p.value.bValue ? "1" : "0";
+    case ParamType::Int: return to_string(p.value.iValue.value);
+    case ParamType::Float: return xmlFloatToString(p.value.fValue.value);
+    case ParamType::Vec2:
+      return xmlFloatToString(p.value.vValue.value.x) + ", "
+             + xmlFloatToString(p.value.vValue.value.y);
+    case ParamType::Color:
+      return xmlFloatToString(p.value.cValue.r) + ", " + xmlFloatToString(p.value.cValue.g) + ", "
+             + xmlFloatToString(p.value.cValue.b) + ", " + xmlFloatToString(p.value.cValue.a);
+    case ParamType::String: return p.value.sValue;
     default: return "";
   }
+}
 
-  return ss.str();
+//--------------------------------------------------------------
+// Parses up to count comma separated floats
+static void parseFloats(const char* str, float* res, int count)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    char* end;
+    res[i] = strtof(str, &end);
+    if (end == str)
+      return;
+
+    str = end;
+    while (*str == ',' || *str == ' ')
+      str++;
+  }
 }
 
 //--------------------------------------------------------------
 static void stringToParamValue(const string& str, Node::Param* p)
 {
-  istringstream ss(str);
   switch (p->type)
   {
-    case ParamType::Bool: ss >> p->value.bValue; break;
-    case ParamType::Int: ss >> p->value.iValue.value; break;
-    case ParamType::Float: ss >> p->value.fValue.value; break;
-    case ParamType::Vec2: ss >> p->value.vValue.value; break;
-    case ParamType::Color: ss >> p->value.cValue; break;
-    case ParamType::String: ss >> p->value.sValue; break;
+    case ParamType::Bool: p->value.bValue = atoi(str.c_str()) != 0; break;
+    case ParamType::Int: p->value.iValue.value = atoi(str.c_str()); break;
+    case ParamType::Float: parseFloats(str.c_str(), &p->value.fValue.value, 1); break;
+    case ParamType::Vec2: parseFloats(str.c_str(), p->value.vValue.value.getPtr(), 2); break;
+    case ParamType::Color: parseFloats(str.c_str(), &p->value.cValue.r, 4); break;
+    case ParamType::String: p->value.sValue = str; break;
     default: break;
   }
 }
 
 //--------------------------------------------------------------
-Node* ofApp::nodeById(int id)
+// The raw bytes of a param value, as stored in binary graph files
+static size_t paramValueData(const Node::Param& p, const void** data)
 {
-  for (Node* node : _nodes)
+  switch (p.type)
   {
-    if (node->id == id)
-      return node;
+    case ParamType::Bool: *data = &p.value.bValue; return sizeof(bool);
+    case ParamType::Int: *data = &p.value.iValue.value; return sizeof(int);
+    case ParamType::Float: *data = &p.value.fValue.value; return sizeof(float);
+    case ParamType::Vec2: *data = p.value.vValue.value.getPtr(); return 2 * sizeof(float);
+    case ParamType::Color: *data = &p.value.cValue.r; return 4 * sizeof(float);
+    case ParamType::String: *data = p.value.sValue.data(); return p.value.sValue.size();
+    default: *data = nullptr; return 0;
   }
-  return nullptr;
 }
 
 //--------------------------------------------------------------
-void ofApp::saveToFile(const string& filename)
+static bool binaryToParamValue(const char* data, size_t size, Node::Param* p)
 {
-  ofxXmlSettings s(filename);
-  s.clear();
+  if (p->type == ParamType::String)
   {
-    CREATE_TAG("Nodes", 0);
-    {
-      int nodeIdx = 0;
-      for (Node* node : _nodes)
-      {
-        CREATE_TAG("Node", nodeIdx, "name", node->name, "id", node->id);
+    p->value.sValue.assign(data, size);
+    return true;
+  }
 
-        // Only need to save top-left pos
-        CREATE_LOCAL_TAG("Pos", -1, "x", node->headingRect.x, "y", node->headingRect.y);
+  void* dst;
+  size_t expected = paramValueData(*p, (const void**)&dst);
+  if (size != expected)
+    return false;
 
-        {
-          CREATE_TAG("Params", 0);
-          for (size_t i = 0; i < node->params.size(); ++i)
-          {
-            const Node::Param& p = node->params[i];
-            string type = paramTypeToString(p);
-            string value = paramValueToString(p);
-            CREATE_LOCAL_TAG("Param", i, "name", p.name, "type", type, "value", value);
-          }
-        }
-        nodeIdx++;
-      }
+  memcpy(dst, data, size);
+  return true;
+}
+
+//--------------------------------------------------------------
+NodeConnector* ofApp::allocConnector(
+    const string& name, ParamType type, NodeConnector::Dir dir, const ofPoint& pt, Node* parent)
+{
+  Arena<NodeConnector>::Handle h = _connectorArena.alloc(name, type, dir, pt, parent);
+  NodeConnector* con = _connectorArena.get(h);
+  con->handle = h;
+  return con;
+}
+
+//--------------------------------------------------------------
+Node* ofApp::createNode(const NodeTemplate* t, const ofPoint& pt, int id)
+{
+  Arena<Node>::Handle h = _nodeArena.alloc(t, pt, id);
+  Node* node = _nodeArena.get(h);
+  node->handle = h;
+
+  _nodes.push_back(node);
+  _nodesById[id] = node;
+  _canvas.nodeChanged(node);
+  return node;
+}
+
+//--------------------------------------------------------------
+void ofApp::destroyNode(Node* node)
+{
+  // NB: the caller removes the node from _nodes, as it might be iterating over it
+  _nodesById.erase(node->id);
+  _nodeGrid.remove(node->id);
+  _canvas.nodeRemoved(node);
+  _thumbnails.erase(node->id);
+
+  for (NodeConnector* con : node->inputs)
+    _connectorArena.free(con->handle);
+  _connectorArena.free(node->output->handle);
+  _nodeArena.free(node->handle);
+}
+
+//--------------------------------------------------------------
+Node* ofApp::nodeById(int id)
+{
+  auto it = _nodesById.find(id);
+  return it == _nodesById.end() ? nullptr : it->second;
+}
+
+//--------------------------------------------------------------
+bool ofApp::saveToFile(const string& filename)
+{
+  string path = ofToDataPath(filename);
+  if (ofFilePath::getFileExt(path) == BINARY_GRAPH_EXT)
+    return saveToBinary(path);
+
+  // NB: streamed straight to the file, in the same layout ofxXmlSettings used to write
+  XmlWriter w;
+  if (!w.open(path))
+    return false;
+
+  w.beginElement("Nodes");
+  for (const Node* node : _nodes)
+  {
+    w.beginElement("Node");
+    w.attribute("name", node->name);
+    w.attribute("id", node->id);
+
+    // Only need to save top-left pos
+    w.beginElement("Pos");
+    w.attribute("x", node->headingRect.x);
+    w.attribute("y", node->headingRect.y);
+    w.endElement();
+
+    w.beginElement("Params");
+    for (const Node::Param& p : node->params)
+    {
+      w.beginElement("Param");
+      w.attribute("name", p.name);
+      w.attribute("type", paramTypeToString(p));
+      w.attribute("value", paramValueToString(p));
+      w.endElement();
     }
+    w.endElement();
+
+    w.endElement();
   }
+  w.endElement();
 
+  w.beginElement("Connections");
+  for (const Node* node : _nodes)
   {
-    CREATE_TAG("Connections", 0);
-    int conIdx = 0;
-    for (Node* node : _nodes)
+    // NB: just the outputs are saved
+    for (const NodeConnector* con : node->output->cons)
     {
-      // NB: just the outputs are saved
-      for (NodeConnector* con : node->output->cons)
+      if (const Node* p = con->parent)
       {
-        if (Node* p = con->parent)
-        {
-          CREATE_LOCAL_TAG(
-              "Connection", conIdx, "from", node->id, "to_node", p->id, "to_input", con->name);
-          conIdx++;
-        }
+        w.beginElement("Connection");
+        w.attribute("from", node->id);
+        w.attribute("to_node", p->id);
+        w.attribute("to_input", con->name);
+        w.endElement();
       }
     }
   }
+  w.endElement();
 
-  s.saveFile();
+  return w.close();
 }
 
 //--------------------------------------------------------------
 void ofApp::resetTexture()
 {
-  for (Node* node : _nodes)
-    delete node;
+  // NB: the arenas keep their memory, so reloading doesn't go back to the heap
   _nodes.clear();
+  _nodesById.clear();
+  _nodeArena.clear();
+  _connectorArena.clear();
+  _nodeGrid.clear();
+  _canvas.clear();
+
+  if (_preview)
+    _preview->clear();
+  _dirtyNodes.clear();
+
+  if (_thumbnailRenderer)
+    _thumbnailRenderer->clear();
+  _dirtyThumbnails.clear();
+  _thumbnailsStale = false;
+  _thumbnails.clear();
+  _programValid = false;
+  // ignore the result of a compile still in flight
+  _programPending = false;
+  _compileGeneration = 0;
+
+  _topoOrder.clear();
+  _topoOrderValid = true;
 
   clearSelection();
   _mode = Mode::Default;
 }
 
 //--------------------------------------------------------------
-void ofApp::loadFromFile(const string& filename)
+bool ofApp::loadFromFile(const string& filename)
 {
+  string path = ofToDataPath(filename);
+  if (graphFileIsBinary(path))
+    return loadFromBinary(path);
+
   resetTexture();
+  _lastError.clear();
+
+  XmlReader r;
+  if (!r.open(path))
+  {
+    _lastError = "unable to load file";
+    return false;
+  }
 
+  // Single pass over the file. The node is created at its Pos tag, as the position is needed up
+  // front, and elements are matched on their parent so unknown tags are ignored
   int maxNodeId = 0;
+  Node* node = nullptr;
+  string nodeName;
+  int nodeId = 0;
+  // the open elements, with an empty root so there's always a parent
+  vector<string> tags = { "" };
+
+  auto attrString = [&r](const char* name) {
+    const string* value = r.attribute(name);
+    return value ? *value : string();
+  };
+  auto attrFloat = [&r](const char* name) {
+    const string* value = r.attribute(name);
+    return value ? strtof(value->c_str(), nullptr) : 0.0f;
+  };
+  auto attrInt = [&r](const char* name) {
+    const string* value = r.attribute(name);
+    return value ? atoi(value->c_str()) : 0;
+  };
 
-  ofxXmlSettings s(filename);
-  if (s.tagExists("Nodes") && s.pushTag("Nodes"))
-  {
-    int numNodes = s.getNumTags("Node");
-    for (int i = 0; i < numNodes; ++i)
-    {
-      string name;
-      int id;
-      getAttributes(s, "Node", i, "name", &name, "id", &id);
-      maxNodeId = max(maxNodeId, id);
+  auto createNode = [&](float x, float y) {
+    node = addLoadedNode(nodeName, x, y, nodeId);
+    return node != nullptr;
+  };
 
-      s.pushTag("Node", i);
+  while (true)
+  {
+    XmlEvent e = r.next();
+    if (e == XmlEvent::EndOfFile)
+      break;
 
-      float x, y;
-      getAttributes(s, "Pos", 0, "x", &x, "y", &y);
+    if (e == XmlEvent::Error)
+    {
+      _lastError = "line " + to_string(r.line()) + ": " + r.error();
+      resetTexture();
+      return false;
+    }
 
-      const NodeTemplate* t = _nodeTemplates[name];
-      Node* node = new Node(t, ofPoint(x, y), id);
+    const string& parent = tags.back();
+    if (e == XmlEvent::StartElement)
+    {
+      const string& name = r.name();
+      if (name == "Node" && parent == "Nodes")
+      {
+        nodeName = attrString("name");
+        nodeId = attrInt("id");
+        maxNodeId = max(maxNodeId, nodeId);
+        node = nullptr;
+      }
+      else if (name == "Pos" && parent == "Node" && !node)
+      {
+        if (!createNode(attrFloat("x"), attrFloat("y")))
+          return false;
+      }
+      else if (name == "Param" && parent == "Params" && tags[tags.size() - 2] == "Node")
+      {
+        if (!node && !createNode(0, 0))
+          return false;
 
-      if (s.tagExists("Params") && s.pushTag("Params"))
+        if (Node::Param* param = node->findParam(attrString("name")))
+        {
+          stringToParamValue(attrString("value"), param);
+        }
+        else
+        {
+          // error: parameter not found..
+        }
+      }
+      else if (name == "Connection" && parent == "Connections")
       {
-        int numParams = s.getNumTags("Param");
-        for (int j = 0; j < numParams; ++j)
+        Node* fromNode = nodeById(attrInt("from"));
+        Node* toNode = nodeById(attrInt("to_node"));
+        NodeConnector* con = toNode ? toNode->findConnector(attrString("to_input")) : nullptr;
+
+        if (fromNode && toNode && con)
         {
-          string name, value;
-          getAttributes(s, "Param", j, "name", &name, "value", &value);
-          if (Node::Param* param = node->findParam(name))
-          {
-            stringToParamValue(value, param);
-          }
-          else
-          {
-            // error: parameter not found..
-          }
+          fromNode->output->cons.push_back(con);
+          con->cons.push_back(fromNode->output);
         }
-        s.popTag();
       }
 
-      _nodes.push_back(node);
+      tags.push_back(name);
+    }
+    else
+    {
+      // a node without a position
+      if (tags.back() == "Node" && tags[tags.size() - 2] == "Nodes" && !node && !createNode(0, 0))
+        return false;
 
-      s.popTag();
+      tags.pop_back();
+    }
+  }
+
+  _nextNodeId = maxNodeId + 1;
+  rebuildTopoOrder();
+  return true;
+}
+
+//--------------------------------------------------------------
+Node* ofApp::addLoadedNode(const string& name, float x, float y, int id)
+{
+  auto it = _nodeTemplates.find(name);
+  if (it == _nodeTemplates.end())
+  {
+    _lastError = "unknown node type '" + name + "'";
+    resetTexture();
+    return nullptr;
+  }
+
+  // the saved position is the top-left of the heading, which sits above the node's body
+  Node* node = createNode(it->second, ofPoint(x, y), id);
+  node->translate(ofPoint(x, y) - node->headingRect.getPosition());
+  return node;
+}
+
+//--------------------------------------------------------------
+bool ofApp::saveToBinary(const string& filename)
+{
+  unordered_map<const Node*, int> nodeIdx;
+  GraphFileWriter w;
+  for (const Node* node : _nodes)
+  {
+    int idx = (int)nodeIdx.size();
+    nodeIdx[node] = idx;
+    w.addNode(node->id, node->name, node->headingRect.x, node->headingRect.y);
+    for (const Node::Param& p : node->params)
+    {
+      const void* data;
+      size_t size = paramValueData(p, &data);
+      w.addParam(p.name, (u32)p.type, data, size);
     }
-    s.popTag();
   }
 
-  if (s.tagExists("Connections") && s.pushTag("Connections"))
+  for (const Node* node : _nodes)
   {
-    int numConnections = s.getNumTags("Connection");
-    for (int i = 0; i < numConnections; ++i)
+    for (const NodeConnector* con : node->output->cons)
     {
-      int fromId, toId;
-      string inputName;
-      getAttributes(s, "Connection", i, "from", &fromId, "to_node", &toId, "to_input", &inputName);
-      Node* fromNode = nodeById(fromId);
-      Node* toNode = nodeById(toId);
-      NodeConnector* con = toNode->findConnector(inputName);
+      if (con->parent)
+        w.addConnection(nodeIdx[node], nodeIdx[con->parent], con->name);
+    }
+  }
 
-      if (fromNode && toNode && con)
-      {
-        fromNode->output->cons.push_back(con);
-        con->cons.push_back(fromNode->output);
-      }
+  return w.save(filename);
+}
+
+//--------------------------------------------------------------
+bool ofApp::loadFromBinary(const string& filename)
+{
+  resetTexture();
+  _lastError.clear();
+
+  GraphFileReader r;
+  if (!r.open(filename))
+  {
+    _lastError = "invalid binary graph";
+    return false;
+  }
+
+  // everything is used straight from the mapped file, no parsing needed
+  const GraphFileHeader& h = r.header();
+  _nodes.reserve(h.numNodes);
+
+  int maxNodeId = 0;
+  for (u32 i = 0; i < h.numNodes; ++i)
+  {
+    const GraphFileNode& n = r.nodes()[i];
+    maxNodeId = max(maxNodeId, (int)n.id);
+
+    Node* node = addLoadedNode(r.str(n.name), n.x, n.y, (int)n.id);
+    if (!node)
+      return false;
+
+    for (u32 j = 0; j < n.numParams; ++j)
+    {
+      const GraphFileParam& p = r.params()[n.firstParam + j];
+      Node::Param* param = node->findParam(r.str(p.name));
+      if (param && param->type == (ParamType)p.type)
+        binaryToParamValue(r.blob(p.offset), p.size, param);
+    }
+  }
+
+  // connections refer to nodes by index, so there's no lookup by id
+  for (u32 i = 0; i < h.numConnections; ++i)
+  {
+    const GraphFileConnection& c = r.connections()[i];
+    Node* fromNode = _nodes[c.fromNode];
+    NodeConnector* con = _nodes[c.toNode]->findConnector(r.str(c.toInput));
+    if (con)
+    {
+      fromNode->output->cons.push_back(con);
+      con->cons.push_back(fromNode->output);
     }
-    s.popTag();
   }
 
   _nextNodeId = maxNodeId + 1;
+  rebuildTopoOrder();
+  return true;
 }
 
 //--------------------------------------------------------------
@@ -522,11 +777,9 @@ ofApp::ofApp()
 //--------------------------------------------------------------
 ofApp::~ofApp()
 {
-  for (Node* node : _nodes)
-  {
-    delete node;
-  }
   _nodes.clear();
+  _nodeArena.clear();
+  _connectorArena.clear();
 
   for (auto& kv : _nodeTemplates)
   {
@@ -536,10 +789,10 @@ ofApp::~ofApp()
 }
 
 //--------------------------------------------------------------
-void ofApp::loadTemplates()
+bool ofApp::loadTemplates(const string& filename)
 {
   ofxXmlSettings s;
-  if (s.loadFile("node_templates.xml"))
+  if (s.loadFile(filename))
   {
     s.pushTag("NodeTemplates");
     int numCategories = s.getNumTags("Category");
@@ -620,195 +873,733 @@ void ofApp::loadTemplates()
     }
     s.popTag();
   }
+
+  // the compiler relies on the memory nodes being there
+  return _nodeTemplates.count("Load") && _nodeTemplates.count("Store")
+         && _nodeTemplates.count("Final");
 }
 
 //--------------------------------------------------------------
-bool ofApp::createGraph(const vector<Node*> nodes, vector<Node*>* sortedNodes)
+bool ofApp::createGraph(const vector<Node*>& nodes, vector<Node*>* sortedNodes, string* error)
 {
-  // Create a graph from the nodes
-  struct GraphNode
+  // Create a graph from the nodes, using their index in the node list
+  unordered_map<Node*, int> nodeIdx;
+  nodeIdx.reserve(nodes.size());
+
+  // save all the load nodes, because we need to create a relationship between the loads and the stores
+  unordered_map<int, int> loadNodes;
+
+  for (int i = 0; i < (int)nodes.size(); ++i)
   {
-    Node* node;
-    vector<Node*> outEdges;
-    vector<Node*> inEdges;
-  };
+    Node* node = nodes[i];
+    if (node->name == "Load")
+    {
+      loadNodes[node->params[0].value.iValue.value] = i;
+    }
+
+    nodeIdx[node] = i;
+  }
+
+  vector<pair<int, int>> edges;
+  for (int i = 0; i < (int)nodes.size(); ++i)
+  {
+    Node* node = nodes[i];
+    for (NodeConnector* con : node->output->cons)
+    {
+      auto it = con ? nodeIdx.find(con->parent) : nodeIdx.end();
+      if (it == nodeIdx.end())
+      {
+        *error = "node '" + node->name + "' is connected to an unknown node";
+        return false;
+      }
+      edges.push_back(make_pair(i, it->second));
+    }
 
-  vector<GraphNode> graph;
+    // if this is a store node, create dependencies on the load node
+    // NB: a store nothing loads is dead, and gets removed with the other dead nodes
+    if (node->name == "Store")
+    {
+      auto it = loadNodes.find(node->params[0].value.iValue.value);
+      if (it != loadNodes.end())
+        edges.push_back(make_pair(i, it->second));
+    }
+  }
 
-  auto& fnGraphFindNode = [&](Node* node) -> GraphNode* {
-    for (GraphNode& g : graph)
+  // NB: the sort picks the first ready node in list order, the same as the old quadratic sort did
+  vector<int> order;
+  if (!topologicalSort((int)nodes.size(), edges, &order))
+  {
+    *error = "graph has cycles";
+    return false;
+  }
+
+  for (int idx : order)
+    sortedNodes->push_back(nodes[idx]);
+
+  // check that each node has its inputs filled
+  for (Node* node : nodes)
+  {
+    for (NodeConnector* con : node->inputs)
     {
-      if (g.node == node)
-        return &g;
+      if (!con->parent)
+      {
+        *error = "node '" + node->name + "' has an unparented input";
+        return false;
+      }
     }
-    return nullptr;
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+void ofApp::rebuildTopoOrder()
+{
+  _topoOrder.clear();
+  _topoOrderValid = true;
+
+  for (Node* node : _nodes)
+    _topoOrder.addNode(node->id);
+
+  for (Node* node : _nodes)
+  {
+    for (NodeConnector* con : node->output->cons)
+      _topoOrderValid &= _topoOrder.addEdge(node->id, con->parent->id);
+
+    // stores go before all the loads of the same aux texture
+    if (node->name == "Store")
+    {
+      int aux = node->params[0].value.iValue.value;
+      for (Node* other : _nodes)
+      {
+        if (other->name == "Load" && other->params[0].value.iValue.value == aux)
+          _topoOrderValid &= _topoOrder.addEdge(node->id, other->id);
+      }
+    }
+  }
+}
+
+//--------------------------------------------------------------
+void ofApp::snapshotGraph(GraphSnapshot* snapshot)
+{
+  // Copy the nodes and connectors, and then point the connections at the copies
+  unordered_map<const NodeConnector*, NodeConnector*> conCopies;
+  unordered_map<int, Node*> nodesById;
+  auto fnCopyConnector = [&](NodeConnector* con, Node* parent) {
+    u32 handle = snapshot->connectorArena.alloc(*con);
+    NodeConnector* copy = snapshot->connectorArena.get(handle);
+    copy->handle = handle;
+    if (copy->parent)
+      copy->parent = parent;
+    conCopies[con] = copy;
+    return copy;
   };
 
-  // save all the load nodes, because we need to create a relationship between the loads and the stores
-  unordered_map<int, Node*> loadNodes;
+  for (Node* node : _nodes)
+  {
+    u32 handle = snapshot->nodeArena.alloc(*node);
+    Node* copy = snapshot->nodeArena.get(handle);
+    copy->handle = handle;
+    for (NodeConnector*& con : copy->inputs)
+      con = fnCopyConnector(con, copy);
+    copy->output = fnCopyConnector(copy->output, copy);
+
+    nodesById[copy->id] = copy;
+    snapshot->nodes.push_back(copy);
+  }
 
-  for (Node* node : nodes)
+  // NB: connections to connectors outside the graph become null, for createGraph to report
+  for (auto& kv : conCopies)
   {
+    for (NodeConnector*& other : kv.second->cons)
+    {
+      auto it = conCopies.find(other);
+      other = it == conCopies.end() ? nullptr : it->second;
+    }
+  }
+
+  snapshot->topoOrderValid = _topoOrderValid;
+  if (_topoOrderValid)
+  {
+    vector<int> ids;
+    _topoOrder.order(&ids);
+    for (int id : ids)
+      snapshot->topoOrder.push_back(nodesById[id]);
+  }
+
+  for (auto& kv : _nodeTemplates)
+    snapshot->templateIds[kv.first] = (u8)kv.second->id;
+  snapshot->scheduleMode = _scheduleMode;
+  snapshot->paramPrecision = _paramPrecision;
+}
+
+//--------------------------------------------------------------
+Node* CompileGraph::resolve(Node* node) const
+{
+  auto it = merged.find(node);
+  return it == merged.end() ? node : it->second;
+}
+
+//--------------------------------------------------------------
+void CompileGraph::inputs(const Node* node, vector<Node*>* res) const
+{
+  res->clear();
+
+  // loads read an aux texture, and folded nodes don't read anything anymore
+  if (node->name == "Load" || folded.count((Node*)node))
+    return;
+
+  for (const NodeConnector* con : node->inputs)
+    res->push_back(resolve(con->cons[0]->parent));
+}
+
+//--------------------------------------------------------------
+void ofApp::removeDeadNodes(CompileGraph* graph)
+{
+  // Everything the final texture depends on is live. A load depends on all the stores to its aux
+  // texture, so stores are only live if something live loads them
+  unordered_map<int, vector<Node*>> storesByAux;
+  vector<Node*> stack;
+  for (Node* node : graph->order)
+  {
+    if (node->name == "Store")
+      storesByAux[node->params[0].value.iValue.value].push_back(node);
+    else if (node->name == "Final")
+      stack.push_back(node);
+  }
+
+  unordered_set<Node*> live;
+  while (!stack.empty())
+  {
+    Node* node = stack.back();
+    stack.pop_back();
+
+    if (!live.insert(node).second)
+      continue;
+
     if (node->name == "Load")
     {
-      loadNodes[node->params[0].value.iValue.value] = node;
+      for (Node* store : storesByAux[node->params[0].value.iValue.value])
+        stack.push_back(store);
+    }
+    else if (!graph->folded.count(node))
+    {
+      // NB: missing inputs are reported by the caller, once it knows the node is live
+      for (NodeConnector* con : node->inputs)
+      {
+        if (!con->cons.empty())
+          stack.push_back(con->cons[0]->parent);
+      }
     }
+  }
 
-    graph.push_back(GraphNode{node});
+  auto isDead = [&](Node* node) { return !live.count(node); };
+  graph->order.erase(
+      remove_if(graph->order.begin(), graph->order.end(), isDead), graph->order.end());
+
+  for (auto it = graph->folded.begin(); it != graph->folded.end();)
+  {
+    if (isDead(it->first))
+      it = graph->folded.erase(it);
+    else
+      ++it;
   }
+}
 
-  for (GraphNode& g : graph)
+//--------------------------------------------------------------
+void ofApp::removeIncompleteNodes(CompileGraph* graph)
+{
+  // a node is incomplete if an input isn't connected, or comes from an incomplete node.
+  // NB: the order is sorted, so the inputs are always seen first
+  unordered_set<Node*> incomplete;
+  auto isIncomplete = [&](Node* node) {
+    for (NodeConnector* con : node->inputs)
+    {
+      if (con->cons.empty() || incomplete.count(con->cons[0]->parent))
+        return true;
+    }
+    return false;
+  };
+
+  for (Node* node : graph->order)
   {
-    Node* node = g.node;
-    for (NodeConnector* con : node->output->cons)
+    if (isIncomplete(node))
+      incomplete.insert(node);
+  }
+
+  graph->order.erase(remove_if(graph->order.begin(),
+                         graph->order.end(),
+                         [&](Node* node) { return incomplete.count(node) != 0; }),
+      graph->order.end());
+}
+
+//--------------------------------------------------------------
+void ofApp::foldConstants(const GraphSnapshot& snapshot, CompileGraph* graph)
+{
+  // the folded nodes are emitted as fills
+  if (!snapshot.templateIds.count("Fill"))
+    return;
+
+  // Nodes whose output is the same color everywhere. The order is topological, so the inputs
+  // are done first. NB: the fills themselves are constant, but aren't folded, so they can still
+  // be patched unless they were folded into something
+  unordered_map<Node*, VmColor> constant;
+  auto constantInput = [&](Node* node, int idx) -> const VmColor* {
+    auto it = constant.find(node->inputs[idx]->cons[0]->parent);
+    return it == constant.end() ? nullptr : &it->second;
+  };
+
+  auto toVmColor = [](const ofColor_<float>& c) { return VmColor{ c.r, c.g, c.b, c.a }; };
+
+  for (Node* node : graph->order)
+  {
+    VmColor res;
+    if (node->name == "Fill")
+    {
+      constant[node] = toVmColor(node->findParam("color")->value.cValue);
+      continue;
+    }
+    else if (node->name == "ColorGradient")
+    {
+      const VmColor* a = constantInput(node, 0);
+      if (!a)
+        continue;
+
+      VmColor colA = toVmColor(node->findParam("col_a")->value.cValue);
+      VmColor colB = toVmColor(node->findParam("col_b")->value.cValue);
+      float t = min(1.f, max(0.f, a->r));
+      res = VmColor{ colA.r + (colB.r - colA.r) * t,
+        colA.g + (colB.g - colA.g) * t,
+        colA.b + (colB.b - colA.b) * t,
+        colA.a + (colB.a - colA.a) * t };
+    }
+    else if (node->name == "Modulate")
+    {
+      float f = node->findParam("factor_a")->value.fValue.value
+                * node->findParam("factor_b")->value.fValue.value;
+      const VmColor* a = constantInput(node, 0);
+      const VmColor* b = constantInput(node, 1);
+      if (f == 0)
+        res = VmColor{ 0, 0, 0, 0 };
+      else if (a && b)
+        res = VmColor{ f * a->r * b->r, f * a->g * b->g, f * a->b * b->b, f * a->a * b->a };
+      else
+        continue;
+    }
+    else if (node->name == "RotateScale" || node->name == "Distort")
+    {
+      // resampling a constant texture gives the same constant, wherever it's sampled
+      const VmColor* a = constantInput(node, 0);
+      if (!a)
+        continue;
+      res = *a;
+    }
+    else
+    {
+      continue;
+    }
+
+    constant[node] = res;
+    graph->folded[node] = res;
+
+    for (NodeConnector* con : node->inputs)
+    {
+      if (constant.count(con->cons[0]->parent))
+        graph->foldSources.insert(con->cons[0]->parent);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+void ofApp::scheduleForMemory(const CompileGraph& graph, vector<Node*>* scheduled)
+{
+  const vector<Node*>& sorted = graph.order;
+  unordered_map<Node*, int> nodeIdx;
+  unordered_map<int, vector<int>> loadsByAux;
+  for (int i = 0; i < (int)sorted.size(); ++i)
+  {
+    nodeIdx[sorted[i]] = i;
+    if (sorted[i]->name == "Load")
+      loadsByAux[sorted[i]->params[0].value.iValue.value].push_back(i);
+  }
+
+  // NB: the edges come from the resolved inputs, as the connections still point at the merged
+  // and dead nodes
+  vector<pair<int, int>> edges;
+  vector<Node*> inputs;
+  for (int i = 0; i < (int)sorted.size(); ++i)
+  {
+    Node* node = sorted[i];
+    graph.inputs(node, &inputs);
+    for (Node* input : inputs)
+      edges.push_back(make_pair(nodeIdx[input], i));
+
+    // the stores still have to go before the loads of the same aux texture
+    if (node->name == "Store")
+    {
+      for (int load : loadsByAux[node->params[0].value.iValue.value])
+        edges.push_back(make_pair(i, load));
+    }
+  }
+
+  // NB: sorted is already a valid order, so this can't fail
+  vector<int> order;
+  memorySchedule((int)sorted.size(), edges, &order);
+  for (int idx : order)
+    scheduled->push_back(sorted[idx]);
+}
+
+//--------------------------------------------------------------
+struct BinaryWriter
+{
+  template <typename T>
+  void write(const T& v)
+  {
+    buf.insert(buf.end(), (const char*)&v, (const char*)&v + sizeof(T));
+  }
+
+  template <typename T>
+  void writeAt(const T& v, int pos)
+  {
+    assert(sizeof(T) + pos <= (int)buf.size());
+    memcpy(buf.data() + pos, (const void*)&v, sizeof(T));
+  }
+
+  int getPos() const { return (int)buf.size(); }
+
+  vector<char> buf;
+};
+
+
+//--------------------------------------------------------------
+static void writeCBuffer(BinaryWriter* w, const Node* node)
+{
+  // Write the parameters, as the kernels read them
+  // NB: every value is 32 bits, so nothing needs padding
+  for (const Node::Param& param : node->params)
+  {
+    if (param.type == ParamType::Int)
+    {
+      w->write(param.value.iValue.value);
+    }
+    else if (param.type == ParamType::Float)
+    {
+      w->write(param.value.fValue.value);
+    }
+    else if (param.type == ParamType::Vec2)
+    {
+      w->write(param.value.vValue.value.x);
+      w->write(param.value.vValue.value.y);
+    }
+    else if (param.type == ParamType::Color)
+    {
+      w->write(param.value.cValue.r);
+      w->write(param.value.cValue.g);
+      w->write(param.value.cValue.b);
+      w->write(param.value.cValue.a);
+    }
+    else
+    {
+      assert(false);
+      // error: unknown type
+    }
+  }
+}
+
+//--------------------------------------------------------------
+static int paramLayout(
+    const Node* node, ParamPrecision precision, VmParamLayout* layout, vector<int>* fieldOffsets)
+{
+  // Describes how each of the values writeCBuffer writes is stored in the program, and returns
+  // the encoded size. The field offsets are where each parameter starts in the encoded params.
+  // NB: this only depends on the template, so the ops of a node type share a layout
+  VmParamEncoding quantized = precision == ParamPrecision::Bits8 ? VM_PARAM_Q8 : VM_PARAM_Q16;
+  int size = 0;
+  auto add = [&](u8 encoding, float minValue, float maxValue) {
+    VmParamField field;
+    field.encoding = encoding;
+    field.minValue = minValue;
+    field.maxValue = maxValue;
+    layout->push_back(field);
+    size += vmParamSize(encoding);
+  };
+
+  for (const Node::Param& param : node->params)
+  {
+    if (fieldOffsets)
+      fieldOffsets->push_back(size);
+
+    const ParamValue& v = param.value;
+    bool bounded = precision != ParamPrecision::Full && (v.flags & PARAM_FLAG_HAS_MIN_MAX);
+    if (param.type == ParamType::Int)
+    {
+      // a small range fits in a byte without losing anything
+      const ParamInt& i = v.iValue;
+      bool small = bounded && i.maxValue >= i.minValue && i.maxValue - i.minValue <= 0xff;
+      add(small ? VM_PARAM_I8 : VM_PARAM_I32, (float)i.minValue, (float)i.maxValue);
+    }
+    else if (param.type == ParamType::Float)
+    {
+      const ParamFloat& f = v.fValue;
+      bool q = bounded && f.maxValue > f.minValue;
+      add(q ? quantized : VM_PARAM_F32, f.minValue, f.maxValue);
+    }
+    else if (param.type == ParamType::Vec2)
     {
-      g.outEdges.push_back(con->parent);
-      fnGraphFindNode(con->parent)->inEdges.push_back(node);
+      const ParamVec2& f = v.vValue;
+      bool q = bounded && f.maxValue > f.minValue;
+      add(q ? quantized : VM_PARAM_F32, f.minValue, f.maxValue);
+      add(q ? quantized : VM_PARAM_F32, f.minValue, f.maxValue);
     }
-
-    // if this is a store node, create dependencies on the load node
-    if (node->name == "Store")
+    else if (param.type == ParamType::Color)
     {
-      int textureId = node->params[0].value.iValue.value;
-      if (!loadNodes.count(textureId))
-        return false;
-      fnGraphFindNode(loadNodes[textureId])->inEdges.push_back(node);
+      // the color editor keeps the channels in [0, 1]
+      bool q = precision != ParamPrecision::Full;
+      for (int i = 0; i < 4; ++i)
+        add(q ? quantized : VM_PARAM_F32, 0, 1);
     }
   }
 
-  // do a topological sort, by iteratively grabbing the node with no inputs
-  while (!graph.empty())
+  return size;
+}
+
+//--------------------------------------------------------------
+void ofApp::mergeCommonNodes(const GraphSnapshot& snapshot, CompileGraph* graph)
+{
+  // Hash-cons the nodes: a node with the same template, parameters and inputs as an earlier one
+  // computes the same texture, so it can use that one's output instead. As the inputs are
+  // resolved to their merged nodes first, duplicated chains collapse one node at a time.
+  // NB: stores and finals write to fixed textures, so they're never merged
+  auto fill = snapshot.templateIds.find("Fill");
+  u8 fillId = fill == snapshot.templateIds.end() ? 0 : fill->second;
+  unordered_map<string, Node*> seen;
+  unordered_map<Node*, int> uniqueIdx;
+  vector<Node*> unique;
+  vector<Node*> inputs;
+  string key;
+  for (Node* node : graph->order)
   {
-    Node* node = nullptr;
-    for (auto it = graph.begin(); it != graph.end();)
+    if (node->name != "Store" && node->name != "Final")
     {
-      if (it->inEdges.empty())
+      // folded nodes are keyed as the fills they're emitted as
+      BinaryWriter w;
+      auto foldedIt = graph->folded.find(node);
+      if (foldedIt != graph->folded.end())
       {
-        node = it->node;
-        it = graph.erase(it);
-        break;
+        w.write(fillId);
+        w.write(foldedIt->second);
       }
       else
       {
-        ++it;
+        w.write(snapshot.templateIds.at(node->name));
+        writeCBuffer(&w, node);
       }
-    }
 
-    if (!node)
-    {
-      // graph has cycles!
-      return false;
-    }
+      graph->inputs(node, &inputs);
+      for (Node* input : inputs)
+        w.write(uniqueIdx[input]);
 
-    // remove occurences of node from the other node's in-edges
-    for (GraphNode& g : graph)
-    {
-      for (auto it = g.inEdges.begin(); it != g.inEdges.end();)
+      key.assign(w.buf.begin(), w.buf.end());
+      auto res = seen.insert(make_pair(key, node));
+      if (!res.second)
       {
-        if (*it == node)
-        {
-          it = g.inEdges.erase(it);
-        }
-        else
-        {
-          ++it;
-        }
+        graph->merged[node] = res.first->second;
+        continue;
       }
     }
 
-    sortedNodes->push_back(node);
-  }
-
-  // check that each node has its inputs filled
-  for (Node* node : _nodes)
-  {
-    for (NodeConnector* con : node->inputs)
-    {
-      if (!con->parent)
-      {
-        return false;
-      }
-    }
+    uniqueIdx[node] = (int)unique.size();
+    unique.push_back(node);
   }
 
-  return true;
+  graph->order.swap(unique);
 }
 
 //--------------------------------------------------------------
-struct BinaryWriter
+bool ofApp::generateGraph(CompiledProgram* prg)
 {
-  template <typename T>
-  void write(const T& v)
-  {
-    size_t oldPos = buf.size();
-    buf.resize(buf.size() + sizeof(T));
-    memcpy(buf.data() + oldPos, (const void*)&v, sizeof(T));
-  }
-
-  template <typename T>
-  void writeAt(const T& v, int pos)
-  {
-    assert(sizeof(T) + pos <= (int)buf.size());
-    memcpy(buf.data() + pos, (const void*)&v, sizeof(T));
-  }
-
-  int getPos() const { return (int)buf.size(); }
-
-  vector<char> buf;
-};
-
+  GraphSnapshot snapshot;
+  snapshotGraph(&snapshot);
+  return compileGraph(snapshot, prg, &_lastError);
+}
 
 //--------------------------------------------------------------
-bool ofApp::generateGraph(vector<char>* buf)
+bool ofApp::compileGraph(
+    const GraphSnapshot& snapshot, CompiledProgram* prg, string* error, bool allNodes)
 {
+  *prg = CompiledProgram();
+  error->clear();
+
+  // use the order maintained while editing if possible, to avoid sorting from scratch
   vector<Node*> sorted;
-  if (!createGraph(_nodes, &sorted))
+  if (snapshot.topoOrderValid)
+    sorted = snapshot.topoOrder;
+  else if (!createGraph(snapshot.nodes, &sorted, error))
     return false;
 
+  // drop everything that doesn't contribute to the final texture
+  CompileGraph graph;
+  graph.order.swap(sorted);
+  size_t numNodes = graph.order.size();
+  if (allNodes)
+    removeIncompleteNodes(&graph);
+  else
+    removeDeadNodes(&graph);
+
   // check that each node has its inputs filled
-  for (Node* node : _nodes)
+  for (Node* node : graph.order)
   {
     for (NodeConnector* con : node->inputs)
     {
       if (con->cons.empty())
       {
+        *error = "node '" + node->name + "' is missing input '" + con->name + "'";
         printf("Node: %s missing input\n", node->name.c_str());
         return false;
       }
     }
   }
 
-  struct VmPrg
-  {
-    u8 version = 1;
-    u8 texturesUsed = 0;
+  // folding can make the inputs of the folded nodes dead too
+  foldConstants(snapshot, &graph);
+  if (!allNodes && !graph.folded.empty())
+    removeDeadNodes(&graph);
+
+  prg->numDeadOps = (int)(numNodes - graph.order.size());
+  prg->numFoldedOps = (int)graph.folded.size();
+
+  const unordered_map<string, u8>& templateIds = snapshot.templateIds;
+  u8 finalId = templateIds.at("Final");
+  u8 loadId = templateIds.at("Load");
+  u8 storeId = templateIds.at("Store");
+  u8 fillId = graph.folded.empty() ? 0 : templateIds.at("Fill");
+
+  // Allocate the pool textures up front, from the live range of each node's output.
+  // NB: a reused texture is only safe because the program is executed in order. Anything that runs
+  // ops concurrently has to honor the write-after-read hazards this creates (see
+  // vmBuildDependencies)
+  vector<Node*> inputs;
+  auto allocate = [&](const CompileGraph& g,
+                      const vector<Node*>& order,
+                      vector<vector<int>>* opInputs,
+                      TextureAllocation* alloc) {
+    unordered_map<Node*, int> nodeOp;
+    vector<bool> writesPool(order.size());
+    vector<bool> fused(order.size());
+    vector<int> pass(order.size());
+    int curPass = 0;
+    opInputs->assign(order.size(), vector<int>());
+    for (int i = 0; i < (int)order.size(); ++i)
+    {
+      Node* node = order[i];
+      nodeOp[node] = i;
+
+      // final and store write to hard-coded textures
+      u8 id = templateIds.at(node->name);
+      writesPool[i] = id != finalId && id != storeId;
+
+      // the vm runs each run of pointwise ops as one pass, so an output that's only read inside
+      // its run is never written
+      const VmKernel* kernel = vmFindKernel(g.folded.count(node) ? fillId : id);
+      if (kernel && kernel->span)
+      {
+        pass[i] = curPass;
+        fused[i] = writesPool[i];
+      }
+      else
+      {
+        pass[i] = -1;
+        curPass++;
+      }
+
+      g.inputs(node, &inputs);
+      for (Node* input : inputs)
+      {
+        int inputOp = nodeOp[input];
+        (*opInputs)[i].push_back(inputOp);
+        if (pass[inputOp] != pass[i])
+          fused[inputOp] = false;
+      }
+    }
+
+    allocateFusedTextures(writesPool, fused, *opInputs, alloc);
   };
 
-  // For each OUT, we try to grab an existing texture - Create if needed
-  // Textures are references counted - Initialized to # inputs, and decremented when each block
-  // has been processed. When a ref hits zero, return the texture to the pool.
+  vector<vector<int>> opInputs;
+  TextureAllocation alloc;
 
-  stack<u8> texturePool;
-  u8 nextTextureId = NUM_AUX_TEXTURES;
+  // merge the duplicated subgraphs
+  CompileGraph unmerged = graph;
+  if (!allNodes)
+    mergeCommonNodes(snapshot, &graph);
+  if (!graph.merged.empty())
+  {
+    // what the unmerged program would need, to report the savings
+    allocate(unmerged, unmerged.order, &opInputs, &alloc);
+    prg->numMergedOps = (int)graph.merged.size();
+    prg->mergedPoolTextures = alloc.numTextures;
+  }
 
-  // Map to keep track of which texture id corresponds to each node's output
-  unordered_map<Node*, int> nodeOutTexture;
-  unordered_map<Node*, int> nodeOutRefCount;
+  allocate(graph, graph.order, &opInputs, &alloc);
+  prg->editOrderPoolTextures = alloc.numTextures;
+  if (!graph.merged.empty())
+    prg->mergedPoolTextures -= alloc.numTextures;
 
-  // Write the header
-  BinaryWriter w;
-  VmPrg prg;
-  w.write(prg);
+  if (snapshot.scheduleMode == ScheduleMode::MinMemory)
+  {
+    // NB: the schedule is a heuristic, and can lose to the editing order, so keep the best
+    vector<Node*> scheduled;
+    vector<vector<int>> scheduledInputs;
+    TextureAllocation scheduledAlloc;
+    scheduleForMemory(graph, &scheduled);
+    allocate(graph, scheduled, &scheduledInputs, &scheduledAlloc);
+    if (scheduledAlloc.numTextures < alloc.numTextures)
+    {
+      graph.order.swap(scheduled);
+      opInputs.swap(scheduledInputs);
+      alloc = scheduledAlloc;
+    }
+  }
 
-  u8 finalId = (u8)_nodeTemplates["Final"]->id;
-  u8 loadId = (u8)_nodeTemplates["Load"]->id;
-  u8 storeId = (u8)_nodeTemplates["Store"]->id;
+  int numTextures = alloc.numTextures + alloc.numFusedTextures;
+  if (NUM_AUX_TEXTURES + numTextures >= VM_FINAL_TEXTURE)
+  {
+    *error = "graph needs " + to_string(numTextures) + " live textures, which is too many";
+    return false;
+  }
+  prg->numPoolTextures = alloc.numTextures;
+  prg->numFusedTextures = alloc.numFusedTextures;
+  prg->numFusedOps = alloc.numFusedOps;
+
+  // NB: a merged op is shared by several nodes, and a fill that was folded into another node
+  // affects that node too, so editing those has to recompile
+  unordered_set<Node*> sharedOps = graph.foldSources;
+  for (auto& kv : graph.merged)
+    sharedOps.insert(kv.second);
+
+  // the layout of each op type, and of the folded fills, which have their own
+  // NB: the layouts only depend on the template, so they're built once per type
+  struct OpLayout
+  {
+    u32 id;
+    int size = 0;
+    vector<int> fieldOffsets;
+  };
+  unordered_map<int, OpLayout> opLayouts;
+  const int FOLDED_LAYOUT = -1;
 
   // create a command list for the texture
-  for (Node* node : sorted)
+  VmProgramWriter writer(VM_PRG_VERSION_2);
+  BinaryWriter cbuffer;
+  VmParamLayout layout;
+  vector<u8> inputs;
+  prg->paramPrecision = snapshot.paramPrecision;
+  for (int opIdx = 0; opIdx < (int)graph.order.size(); ++opIdx)
   {
-    u8 id = (u8)_nodeTemplates[node->name]->id;
+    Node* node = graph.order[opIdx];
+    u8 id = templateIds.at(node->name);
     u8 outputId = id;
+    auto foldedIt = graph.folded.find(node);
 
     // there are some special nodes:
     // final - input: normal, output: hard-coded
@@ -831,128 +1622,70 @@ bool ofApp::generateGraph(vector<char>* buf)
     }
     else
     {
-      // create an output texture if needed
-      if (texturePool.empty())
-        texturePool.push(nextTextureId++);
-
-      outputTexture = texturePool.top();
-      texturePool.pop();
-
-      // Inc the ref count on the output texture for each input node that uses it
-      nodeOutRefCount[node] = (int)node->output->cons.size();
-      nodeOutTexture[node] = outputTexture;
+      outputTexture = (u8)(NUM_AUX_TEXTURES + alloc.opTexture[opIdx]);
     }
 
-    // write the operation id and output texture
-    w.write(outputId);
-    w.write(outputTexture);
+    // NB: a folded op's parameters aren't the node's, so it can't be patched either
+    if (foldedIt != graph.folded.end())
+      outputId = fillId;
+    else if (!sharedOps.count(node))
+      prg->nodeOps[node->id] = (int)prg->opNodeIds.size();
+    prg->opNodeIds.push_back(node->id);
 
     // setup input textures
+    inputs.clear();
     if (id == loadId)
     {
       assert(node->params[0].name == "aux");
-      w.write((u8)1);
-      w.write((u8)node->params[0].value.iValue.value);
+      inputs.push_back((u8)node->params[0].value.iValue.value);
     }
     else
     {
-      w.write((u8)node->inputs.size());
-      for (const NodeConnector* con : node->inputs)
-      {
-        u8 inputTextureId = nodeOutTexture[con->cons[0]->parent];
-        w.write(inputTextureId);
-      }
+      for (int input : opInputs[opIdx])
+        inputs.push_back((u8)(NUM_AUX_TEXTURES + alloc.opTexture[input]));
     }
 
     // load/store shouldn't have proper c-buffers
-    if (outputId == loadId)
+    bool folded = foldedIt != graph.folded.end();
+    auto layoutIt = opLayouts.find(folded ? FOLDED_LAYOUT : outputId);
+    if (layoutIt == opLayouts.end())
     {
-      u16 cbufferSize = 0;
-      w.write(cbufferSize);
-    }
-    else
-    {
-      u16 cbufferSize = 0;
-      int cbufferSizePos = w.getPos();
-      w.write(cbufferSize);
-
-      static unordered_map<ParamType, int> paramSize = {
-        { ParamType::Int, sizeof(int) },
-        { ParamType::Float, sizeof(float) },
-        { ParamType::Vec2, 2 * sizeof(float) },
-        { ParamType::Color, 4 * sizeof(float) },
-      };
-
-      // Write the parameters
-      // NB: because these are written as-is to constant buffers, we need to take care with
-      // aligning parameters on 32 bit boundaries
-      int curOffset = 0;
-      for (const Node::Param& param : node->params)
+      OpLayout opLayout;
+      layout.clear();
+      if (folded)
       {
-        int s = paramSize[param.type];
-        if (s == 0)
-        {
-          assert(false);
-          // error: unknown type
-        }
-
-        if (curOffset + s > 4)
-        {
-          // Apply padding
-          for (int i = 0; i < (curOffset + s) % 4; ++i)
-            w.write(0.0f);
-          curOffset = 0;
-        }
-
-        if (param.type == ParamType::Int)
-        {
-          w.write(param.value.iValue.value);
-        }
-        else if (param.type == ParamType::Float)
-        {
-          w.write(param.value.fValue.value);
-        }
-        else if (param.type == ParamType::Vec2)
-        {
-          w.write(param.value.vValue.value.x);
-          w.write(param.value.vValue.value.y);
-        }
-        else if (param.type == ParamType::Color)
-        {
-          w.write(param.value.cValue.r);
-          w.write(param.value.cValue.g);
-          w.write(param.value.cValue.b);
-          w.write(param.value.cValue.a);
-        }
-        cbufferSize += s;
-        curOffset = (curOffset + s) % 4;
+        // NB: the folded color is kept at full precision
+        layout.resize(sizeof(VmColor) / sizeof(float));
+        opLayout.size = sizeof(VmColor);
+        opLayout.fieldOffsets.push_back(0);
       }
-
-      w.writeAt(cbufferSize, cbufferSizePos);
-    }
-
-    // dec the ref count on any used textures, and return any that have a zero count
-    if (id != finalId && id != storeId)
-    {
-      for (NodeConnector* con : node->inputs)
+      else if (outputId != loadId)
       {
-        for (NodeConnector* input : con->cons)
-        {
-          Node* node = input->parent;
-          if (--nodeOutRefCount[node] == 0)
-          {
-            texturePool.push(nodeOutTexture[node]);
-            nodeOutRefCount.erase(node);
-            nodeOutTexture.erase(node);
-          }
-        }
+        opLayout.size =
+            paramLayout(node, snapshot.paramPrecision, &layout, &opLayout.fieldOffsets);
       }
+      opLayout.id = writer.addLayout(layout);
+      layoutIt = opLayouts.insert(make_pair(folded ? FOLDED_LAYOUT : outputId, opLayout)).first;
     }
+
+    cbuffer.buf.clear();
+    if (folded)
+      cbuffer.write(foldedIt->second);
+    else if (outputId != loadId)
+      writeCBuffer(&cbuffer, node);
+
+    const OpLayout& opLayout = layoutIt->second;
+    writer.addOp(outputId,
+        outputTexture,
+        inputs.data(),
+        (int)inputs.size(),
+        opLayout.id,
+        cbuffer.buf.data());
+    prg->opCBufferSize.push_back(opLayout.size);
+    prg->opFieldOffsets.push_back(opLayout.fieldOffsets);
   }
 
-  // copy out the generated texture
-  ((VmPrg*)w.buf.data())->texturesUsed = nextTextureId;
-  *buf = w.buf;
+  writer.finish((u8)(NUM_AUX_TEXTURES + numTextures), &prg->buf, &prg->opCBufferPos);
   return true;
 }
 
@@ -960,6 +1693,19 @@ bool ofApp::generateGraph(vector<char>* buf)
 void ofApp::setup()
 {
   _imgui.setup();
+  _threadPool.reset(new ThreadPool());
+  _preview.reset(new ProgressivePreview(_threadPool.get(), PREVIEW_SIZE));
+  _transport.reset(createTransport(TRANSPORT_ADDRESS));
+  _compiler.reset(new CompileWorker(
+      [](const GraphSnapshot& snapshot, CompiledProgram* prg, string* error) {
+        return compileGraph(snapshot, prg, error);
+      },
+      [this](const char* data, size_t size) { sendMessage(data, size); }));
+  _thumbnailRenderer.reset(new ThumbnailRenderer(_threadPool.get(),
+      THUMBNAIL_SIZE,
+      [](const GraphSnapshot& snapshot, CompiledProgram* prg, string* error) {
+        return compileGraph(snapshot, prg, error, true);
+      }));
   ofSetVerticalSync(true);
   ofGetMainLoop()->setEscapeQuitsLoop(false);
 
@@ -973,15 +1719,80 @@ void ofApp::setup()
 //--------------------------------------------------------------
 void ofApp::exit()
 {
-  if (_pipeHandle != INVALID_HANDLE_VALUE)
-  {
-    CloseHandle(_pipeHandle);
-  }
+  // NB: a send blocked on a receiver that's stopped reading would keep the worker from exiting
+  if (_transport)
+    _transport->cancel();
+
+  _compiler.reset();
+  _transport.reset();
 }
 
 //--------------------------------------------------------------
 void ofApp::update()
 {
+  // only the result of the latest compile is used, as an edit since then needs another one
+  u32 generation;
+  CompiledProgram prg;
+  bool valid;
+  string error;
+  if (_compiler && _compiler->fetch(&generation, &prg, &valid, &error)
+      && generation == _compileGeneration)
+  {
+    swap(_program, prg);
+    _programValid = valid;
+    if (!valid)
+      _lastError = error;
+    _programPending = false;
+    if (_programValid)
+      updatePreview();
+
+    // The compile has the parameters from before the edits made while it was running, so they go
+    // out as patches on top of it. If it failed, the next compile picks them up.
+    // NB: a patch that can't be made compiles again, and the rest wait for that
+    unordered_set<int> edited;
+    edited.swap(_pendingParamNodes);
+    for (int id : edited)
+    {
+      Node* node = nodeById(id);
+      if (node && _programValid)
+        sendParameters(node);
+    }
+  }
+
+  if (_thumbnailsStale)
+  {
+    shared_ptr<GraphSnapshot> snapshot = make_shared<GraphSnapshot>();
+    snapshotGraph(snapshot.get());
+    renderThumbnails(snapshot);
+  }
+
+  // only the thumbnails that were rendered again come in, so they're uploaded as they are
+  if (_thumbnailRenderer && _thumbnailRenderer->fetch(&_thumbnailPixels))
+  {
+    for (auto& kv : _thumbnailPixels)
+    {
+      const VmTexture& t = kv.second;
+      if (t.pixels.empty() || !nodeById(kv.first))
+      {
+        _thumbnails.erase(kv.first);
+        continue;
+      }
+
+      ofTexture& texture = _thumbnails[kv.first];
+      if (texture.getWidth() != t.width || texture.getHeight() != t.height)
+        texture.allocate(t.width, t.height, GL_RGBA32F);
+      texture.loadData((const float*)t.pixels.data(), t.width, t.height, GL_RGBA);
+    }
+  }
+
+  // the preview levels come in at increasing resolutions, and are drawn scaled to the full size
+  if (_preview && _preview->fetch(&_previewPixels))
+  {
+    const VmTexture& t = _previewPixels;
+    if (_previewTexture.getWidth() != t.width || _previewTexture.getHeight() != t.height)
+      _previewTexture.allocate(t.width, t.height, GL_RGBA32F);
+    _previewTexture.loadData((const float*)t.pixels.data(), t.width, t.height, GL_RGBA);
+  }
 }
 
 //--------------------------------------------------------------
@@ -1019,13 +1830,13 @@ void ofApp::drawSidePanel()
       string filename;
       if (showFileDialog(false, FILE_DLG_GEN_FILTER, FILE_DLG_GEN_EXT, &filename))
       {
-        vector<char> buf;
-        generateGraph(&buf);
+        CompiledProgram prg;
+        generateGraph(&prg);
 
         FILE* f = fopen(filename.c_str(), "wb");
         if (f)
         {
-          fwrite(buf.data(), 1, buf.size(), f);
+          fwrite(prg.buf.data(), 1, prg.buf.size(), f);
           fclose(f);
         }
       }
@@ -1039,6 +1850,43 @@ void ofApp::drawSidePanel()
   //  ImGui::PopItemWidth();
   //}
 
+  if (ImGui::CollapsingHeader("Compiler", NULL, true, true))
+  {
+    bool minMemory = _scheduleMode == ScheduleMode::MinMemory;
+    if (ImGui::Checkbox("Minimize memory", &minMemory))
+    {
+      _scheduleMode = minMemory ? ScheduleMode::MinMemory : ScheduleMode::EditOrder;
+      _programValid = false;
+      sendTexture();
+    }
+
+    int precision = (int)_paramPrecision;
+    if (ImGui::Combo("Parameters", &precision, "Full precision\0" "16 bits\0" "8 bits\0"))
+    {
+      _paramPrecision = (ParamPrecision)precision;
+      _programValid = false;
+      sendTexture();
+    }
+
+    if (_programValid)
+    {
+      ImGui::Text("%d ops, %d pool textures (%d in editing order)",
+          (int)_program.opNodeIds.size(),
+          _program.numPoolTextures,
+          _program.editOrderPoolTextures);
+      ImGui::Text("%d duplicate ops merged, saving %d textures",
+          _program.numMergedOps,
+          _program.mergedPoolTextures);
+      ImGui::Text("%d ops fused, without a pool texture", _program.numFusedOps);
+      ImGui::Text("%d textures declared, for renderers that don't fuse",
+          _program.numPoolTextures + _program.numFusedTextures);
+      ImGui::Text("%d dead ops removed, %d folded to constants",
+          _program.numDeadOps,
+          _program.numFoldedOps);
+      ImGui::Text("%d bytes", (int)_program.buf.size());
+    }
+  }
+
   ImGui::End();
 
   ImGui::Begin("Commands", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
@@ -1070,29 +1918,206 @@ void ofApp::drawSidePanel()
 }
 
 //--------------------------------------------------------------
-void ofApp::sendTexture()
+void ofApp::invalidateNode(Node* node)
 {
-  vector<char> buf;
-  if (generateGraph(&buf))
+  // mark the node and everything downstream of it as dirty. Besides the connections, stores have
+  // implicit edges to the loads of the same aux texture
+  unordered_set<int> visited;
+  vector<Node*> stack = { node };
+  while (!stack.empty())
   {
-    // try to create the pipe if it doesn't exist yet
-    if (_pipeHandle == INVALID_HANDLE_VALUE)
-    {
-      const char* pipeName = "\\\\.\\pipe\\texturepipe";
-      _pipeHandle = CreateFileA(pipeName, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-    }
+    Node* cur = stack.back();
+    stack.pop_back();
+
+    if (!visited.insert(cur->id).second)
+      continue;
+
+    _dirtyNodes.insert(cur->id);
+    _dirtyThumbnails.insert(cur->id);
+
+    for (NodeConnector* con : cur->output->cons)
+      stack.push_back(con->parent);
 
-    if (_pipeHandle != INVALID_HANDLE_VALUE)
+    if (cur->name == "Store")
     {
-      DWORD bytesWritten = 0;
-      if (!WriteFile(_pipeHandle, buf.data(), buf.size(), &bytesWritten, NULL))
+      int aux = cur->params[0].value.iValue.value;
+      for (Node* other : _nodes)
       {
-        _pipeHandle = INVALID_HANDLE_VALUE;
+        if (other->name == "Load" && other->params[0].value.iValue.value == aux)
+          stack.push_back(other);
       }
     }
   }
 }
 
+//--------------------------------------------------------------
+void ofApp::invalidateConnector(NodeConnector* con)
+{
+  // invalidate the consuming side of the connector's connections
+  if (con->dir == NodeConnector::Dir::Input)
+  {
+    invalidateNode(con->parent);
+  }
+  else
+  {
+    for (NodeConnector* other : con->cons)
+      invalidateNode(other->parent);
+  }
+}
+
+//--------------------------------------------------------------
+void ofApp::updatePreview()
+{
+  if (!_preview)
+    return;
+
+  // NB: the preview tracks which nodes are still dirty at each level from here
+  _preview->render(_program.buf, _program.opNodeIds, _dirtyNodes);
+  _dirtyNodes.clear();
+}
+
+//--------------------------------------------------------------
+void ofApp::renderThumbnails(shared_ptr<const GraphSnapshot> snapshot)
+{
+  if (!_thumbnailRenderer)
+    return;
+
+  _thumbnailRenderer->render(move(snapshot), _dirtyThumbnails);
+  _dirtyThumbnails.clear();
+  _thumbnailsStale = false;
+}
+
+//--------------------------------------------------------------
+void ofApp::drawThumbnails(const ofRectangle& viewport)
+{
+  // NB: drawn under the node body, so they don't change the node layout or its hit testing
+  ofSetColor(255);
+  for (auto& kv : _thumbnails)
+  {
+    Node* node = nodeById(kv.first);
+    if (!node)
+      continue;
+
+    ofRectangle rect(node->bodyRect.x,
+        node->bodyRect.getBottom() + THUMBNAIL_PADDING,
+        THUMBNAIL_SIZE,
+        THUMBNAIL_SIZE);
+    if (viewport.intersects(rect))
+      kv.second.draw(rect);
+  }
+}
+
+//--------------------------------------------------------------
+void ofApp::sendMessage(const char* data, size_t size)
+{
+  // NB: a receiver that isn't listening yet just misses the message
+  if (_transport)
+    _transport->send(data, size);
+}
+
+//--------------------------------------------------------------
+void ofApp::sendTexture()
+{
+  // NB: the snapshot has every parameter as it is now
+  _pendingParamNodes.clear();
+  if (_compiler)
+  {
+    shared_ptr<GraphSnapshot> snapshot = make_shared<GraphSnapshot>();
+    snapshotGraph(snapshot.get());
+    _compileGeneration = _compiler->compile(snapshot);
+    _programPending = true;
+    renderThumbnails(snapshot);
+    return;
+  }
+
+  _programValid = generateGraph(&_program);
+  if (_programValid)
+  {
+    updatePreview();
+    sendMessage(_program.buf.data(), _program.buf.size());
+  }
+}
+
+//--------------------------------------------------------------
+void ofApp::sendParameters(Node* node)
+{
+  // Patch the node's cbuffer in the current program, and just send the bytes that changed.
+  // Anything that isn't a plain parameter change falls back to a full compile.
+  // NB: while a compile is pending, _program doesn't match what the receiver will have, so the
+  // patch waits for the compile. A drag then doesn't keep restarting it
+  bool plainParams = node->name != "Load" && node->name != "Store";
+  if (_programPending && plainParams)
+  {
+    _pendingParamNodes.insert(node->id);
+    return;
+  }
+
+  auto it = _program.nodeOps.find(node->id);
+  if (!_programValid || it == _program.nodeOps.end() || !plainParams)
+  {
+    sendTexture();
+    return;
+  }
+
+  int opIdx = it->second;
+  int cbufferPos = _program.opCBufferPos[opIdx];
+  int cbufferSize = _program.opCBufferSize[opIdx];
+  const vector<int>& fieldOffsets = _program.opFieldOffsets[opIdx];
+
+  // encode the params the same way the program has them
+  BinaryWriter cbuffer;
+  VmParamLayout layout;
+  vector<char> params;
+  writeCBuffer(&cbuffer, node);
+  paramLayout(node, _program.paramPrecision, &layout, nullptr);
+  if (cbuffer.buf.size() != layout.size() * sizeof(u32))
+  {
+    sendTexture();
+    return;
+  }
+
+  vmEncodeParams(layout, cbuffer.buf.data(), &params);
+  if ((int)params.size() != cbufferSize)
+  {
+    sendTexture();
+    return;
+  }
+
+  // find the range of fields that changed
+  const char* cur = _program.buf.data() + cbufferPos;
+  int first = -1, last = -1;
+  for (size_t i = 0; i < fieldOffsets.size(); ++i)
+  {
+    int start = fieldOffsets[i];
+    int end = i + 1 < fieldOffsets.size() ? fieldOffsets[i + 1] : cbufferSize;
+    if (memcmp(cur + start, params.data() + start, end - start) != 0)
+    {
+      first = first == -1 ? start : first;
+      last = end;
+    }
+  }
+
+  if (first == -1)
+    return;
+
+  memcpy(_program.buf.data() + cbufferPos + first, params.data() + first, last - first);
+
+  BinaryWriter patch;
+  VmPatch header;
+  header.opIndex = (u16)opIdx;
+  header.offset = (u16)first;
+  header.size = (u16)(last - first);
+  patch.write(header);
+  patch.buf.insert(patch.buf.end(), params.begin() + first, params.begin() + last);
+
+  updatePreview();
+  _thumbnailsStale = true;
+  if (_compiler)
+    _compiler->sendPatch(move(patch.buf));
+  else
+    sendMessage(patch.buf.data(), patch.buf.size());
+}
+
 //--------------------------------------------------------------
 bool ofApp::drawNodeParameters()
 {
@@ -1203,17 +2228,42 @@ void ofApp::draw()
   drawSidePanel();
   if (drawNodeParameters())
   {
-    sendTexture();
-  }
+    invalidateNode(_curEditingNode);
 
-  for (auto& node : _nodes)
-  {
-    node->draw();
+    // NB: editing a store changes its aux index, so the loads of the old index are affected too
+    if (_curEditingNode->name == "Store")
+    {
+      for (Node* node : _nodes)
+      {
+        if (node->name == "Load")
+          invalidateNode(node);
+      }
+    }
+
+    // aux changes move the implicit store -> load edges, and show up in the heading
+    if (_curEditingNode->name == "Store" || _curEditingNode->name == "Load")
+    {
+      rebuildTopoOrder();
+      _canvas.labelsChanged(_curEditingNode);
+    }
+
+    sendParameters(_curEditingNode);
   }
 
-  for (auto& node : _nodes)
+  ofRectangle viewport(0, 0, ofGetWidth(), ofGetHeight());
+  _canvas.update(viewport, _font);
+  _canvas.drawNodes();
+  _canvas.drawLabels(_font);
+  drawThumbnails(viewport);
+  _canvas.drawWires();
+
+  for (Node* node : _selectedNodes)
+    node->drawSelection();
+
+  if (_previewTexture.isAllocated())
   {
-    node->drawConnections();
+    ofSetColor(255);
+    _previewTexture.draw(ofGetWidth() - PREVIEW_SIZE - 10, 10, PREVIEW_SIZE, PREVIEW_SIZE);
   }
 
   if (_mode == Mode::Connecting)
@@ -1269,10 +2319,7 @@ void ofApp::keyReleased(int key)
     if (_mode == Mode::Dragging)
     {
       for (Node* node : _selectedNodes)
-      {
-        node->bodyRect.setPosition(node->dragStart);
-        node->headingRect.setPosition(node->dragStart);
-      }
+        node->translate(node->dragStart - node->bodyRect.getPosition());
     }
     clearSelection();
     _mode = Mode::Default;
@@ -1288,12 +2335,23 @@ void ofApp::keyReleased(int key)
       if (_curEditingNode == node)
         _curEditingNode = nullptr;
 
+      invalidateConnector(node->output);
+      if (node->name == "Store")
+        invalidateNode(node);
+      _programValid = false;
+
       for (NodeConnector* con : node->inputs)
         deleteConnector(con);
 
       deleteConnector(node->output);
-      delete node;
+      _topoOrder.removeNode(node->id);
+      destroyNode(node);
     }
+    _selectedNodes.clear();
+
+    // removing nodes might have broken a cycle
+    if (!_topoOrderValid)
+      rebuildTopoOrder();
 
     _mode = Mode::Default;
   }
@@ -1325,11 +2383,23 @@ void ofApp::dragEvent(ofDragInfo dragInfo)
 {
 }
 
+//--------------------------------------------------------------
+void ofApp::updateNodeGrid(Node* node)
+{
+  ofRectangle r = node->bounds();
+  SpatialGrid::Rect rect{ r.getMinX(), r.getMinY(), r.getMaxX(), r.getMaxY() };
+  _nodeGrid.set(node->id, rect);
+}
+
 //--------------------------------------------------------------
 Node* ofApp::nodeAtPoint(const ofPoint& pt)
 {
-  for (auto& node : _nodes)
+  // the grid returns the candidates in node order, so overlapping nodes resolve the same way as
+  // a scan over _nodes would
+  _nodeGrid.query(pt.x, pt.y, &_gridQuery);
+  for (int id : _gridQuery)
   {
+    Node* node = nodeById(id);
     if (node->bodyRect.inside(pt) || node->headingRect.inside(pt))
       return node;
   }
@@ -1389,8 +2459,11 @@ NodeConnector* ofApp::connectorAtPoint(const ofPoint& pt)
     return dist < CONNECTOR_RADIUS * CONNECTOR_RADIUS;
   };
 
-  for (auto& node : _nodes)
+  // NB: the connectors sit inside the node's body, so only the nodes under the point are checked
+  _nodeGrid.query(pt.x, pt.y, &_gridQuery);
+  for (int id : _gridQuery)
   {
+    Node* node = nodeById(id);
     for (NodeConnector* input : node->inputs)
     {
       if (insideConnector(input->pt))
@@ -1412,6 +2485,19 @@ NodeConnector* ofApp::connectorAtPoint(const ofPoint& pt)
 //--------------------------------------------------------------
 void ofApp::deleteConnector(NodeConnector* con)
 {
+  for (NodeConnector* other : con->cons)
+  {
+    if (con->dir == NodeConnector::Dir::Output)
+      _topoOrder.removeEdge(con->parent->id, other->parent->id);
+    else
+      _topoOrder.removeEdge(other->parent->id, con->parent->id);
+  }
+
+  // both ends lose the wire, and change their connector color
+  _canvas.nodeChanged(con->parent);
+  for (NodeConnector* other : con->cons)
+    _canvas.nodeChanged(other->parent);
+
   // remove the connection from each of its connections
   for (NodeConnector* other : con->cons)
   {
@@ -1437,9 +2523,17 @@ void ofApp::mousePressed(int x, int y, int button)
   {
     // Create a new node from the template, and try to send it
     const NodeTemplate* t = _nodeTemplates[_createType];
-    Node* node = new Node(t, pt, _nextNodeId++);
+    Node* node = createNode(t, pt, _nextNodeId++);
     _curEditingNode = node;
-    _nodes.push_back(node);
+    updateNodeGrid(node);
+    invalidateNode(node);
+
+    // new loads and stores can come with aux edges
+    if (node->name == "Load" || node->name == "Store")
+      rebuildTopoOrder();
+    else
+      _topoOrder.addNode(node->id);
+
     resetState();
     sendTexture();
     return;
@@ -1452,7 +2546,11 @@ void ofApp::mousePressed(int x, int y, int button)
     // ctrl-click to remove any connections
     if (ofKeyControl())
     {
+      invalidateConnector(con);
       deleteConnector(con);
+      _programValid = false;
+      if (!_topoOrderValid)
+        rebuildTopoOrder();
     }
     else
     {
@@ -1510,7 +2608,11 @@ void ofApp::mouseReleased(int x, int y, int button)
 
       output->cons.push_back(input);
       input->cons.push_back(output);
+      _topoOrder.addEdge(output->parent->id, input->parent->id);
+      _canvas.nodeChanged(output->parent);
+      _canvas.nodeChanged(input->parent);
 
+      invalidateNode(input->parent);
       sendTexture();
     }
   }
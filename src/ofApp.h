@@ -1,6 +1,18 @@
 #pragma once
 
-
+#include "arena.hpp"
+#include "canvas_renderer.hpp"
+#include "compile_worker.hpp"
+#include "graph_sort.hpp"
+#include "progressive_preview.hpp"
+#include "spatial_grid.hpp"
+#include "texture_vm.hpp"
+#include "thread_pool.hpp"
+#include "thumbnail_renderer.hpp"
+#include "transport.hpp"
+
+
+// NB: stored in binary graph files, so only append
 enum class ParamType
 {
   Void,
@@ -89,10 +101,83 @@ struct NodeConnector
   ofPoint pt;
   Node* parent;
   vector<NodeConnector*> cons;
+  // slot in ofApp::_connectorArena
+  u32 handle = 0;
 };
 
 class ofApp;
 
+// How the float and int parameters are stored in the program. The reduced ones need the bounds of
+// the template, so parameters without any stay at full precision
+enum class ParamPrecision
+{
+  Full,
+  Bits16,
+  Bits8,
+};
+
+// The output of generateGraph, along with where each op's parameters live in the buffer, so
+// parameter edits can be patched in place
+struct CompiledProgram
+{
+  vector<char> buf;
+
+  // per op, in program order
+  vector<int> opNodeIds;
+  // where the encoded params start, and their size. The field offsets are in encoded bytes too
+  vector<int> opCBufferPos;
+  vector<int> opCBufferSize;
+  vector<vector<int>> opFieldOffsets;
+  ParamPrecision paramPrecision = ParamPrecision::Full;
+
+  // node id -> op index
+  unordered_map<int, int> nodeOps;
+
+  // textures allocated after the aux ones, which is also the peak number live at once
+  int numPoolTextures = 0;
+  // the same, for the editing order, to show what the schedule saved
+  int editOrderPoolTextures = 0;
+
+  // the duplicated nodes that were merged, and the textures that saved
+  int numMergedOps = 0;
+  int mergedPoolTextures = 0;
+
+  // nodes that don't contribute to the final texture, and nodes replaced by a constant fill
+  int numDeadOps = 0;
+  int numFoldedOps = 0;
+
+  // ops whose output stays inside a fused vm pass, so they don't need a pool texture
+  int numFusedOps = 0;
+  // NB: the program declares this many textures on top of the pool ones, as a renderer that doesn't
+  // fuse still writes the fused outputs, and not all of them fit between the pool textures' uses
+  int numFusedTextures = 0;
+};
+
+// The compiler's view of the graph, as the optimization passes leave it
+struct CompileGraph
+{
+  Node* resolve(Node* node) const;
+  // the nodes whose outputs the node reads, after merging and folding
+  void inputs(const Node* node, vector<Node*>* res) const;
+
+  // the nodes to emit, in program order
+  vector<Node*> order;
+  // nodes replaced by an identical earlier node
+  unordered_map<Node*, Node*> merged;
+  // nodes with the same color everywhere, which are emitted as fills of that color
+  unordered_map<Node*, VmColor> folded;
+  // the fills whose color was folded into other nodes
+  unordered_set<Node*> foldSources;
+};
+
+enum class ScheduleMode
+{
+  // the topological order maintained while editing, which follows the creation order
+  EditOrder,
+  // reordered to keep as few textures alive as possible
+  MinMemory,
+};
+
 struct TextureSettings
 {
   int numAuxTextures = 8;
@@ -111,9 +196,14 @@ struct Node
   };
 
   Node(const NodeTemplate* t, const ofPoint& pt, int it);
-  void draw();
-  void drawConnections();
+  // NB: everything but the selection is drawn by CanvasRenderer
+  string headingText() const;
+  // Appends the glyphs of the heading and connector labels, at the node's current position
+  void layoutLabels(const ofTrueTypeFont& font, ofMesh* mesh) const;
+  void drawSelection();
   void translate(const ofPoint& delta);
+  // the heading and body together
+  ofRectangle bounds() const;
   Param* findParam(const string& str);
   NodeConnector* findConnector(const string& str);
 
@@ -127,6 +217,31 @@ struct Node
   // NB: a node with no output has a void type for its connector
   NodeConnector* output;
   int id;
+  // slot in ofApp::_nodeArena
+  u32 handle = 0;
+};
+
+// A copy of the graph, taken on the ui thread, so it can be compiled on a worker while the graph
+// is being edited. The copied connectors point at the copied nodes, and nothing in it refers back
+// to the app
+struct GraphSnapshot
+{
+  GraphSnapshot() = default;
+  GraphSnapshot(const GraphSnapshot&) = delete;
+  GraphSnapshot& operator=(const GraphSnapshot&) = delete;
+
+  Arena<Node> nodeArena;
+  Arena<NodeConnector> connectorArena;
+
+  // in creation order
+  vector<Node*> nodes;
+  // the order maintained while editing, if it was valid
+  vector<Node*> topoOrder;
+  bool topoOrderValid = false;
+
+  unordered_map<string, u8> templateIds;
+  ScheduleMode scheduleMode = ScheduleMode::EditOrder;
+  ParamPrecision paramPrecision = ParamPrecision::Full;
 };
 
 class ofApp : public ofBaseApp
@@ -155,26 +270,62 @@ public:
   void clearSelection();
 
   Node* nodeAtPoint(const ofPoint& pt);
+  void updateNodeGrid(Node* node);
   void resetState();
   void abortAction();
 
-  void saveToFile(const string& filename);
-  void loadFromFile(const string& filename);
-  void loadTemplates();
+  bool saveToFile(const string& filename);
+  bool loadFromFile(const string& filename);
+  bool saveToBinary(const string& filename);
+  bool loadFromBinary(const string& filename);
+  Node* addLoadedNode(const string& name, float x, float y, int id);
+  bool loadTemplates(const string& filename = "node_templates.xml");
 
   void resetTexture();
 
   NodeConnector* connectorAtPoint(const ofPoint& pt);
   Node* nodeById(int id);
 
-  bool createGraph(const vector<Node*> nodes, vector<Node*>* sortedNodes);
-  bool generateGraph(vector<char>* buf);
+  // Nodes and connectors live in arenas owned by the app. createNode also adds the node to
+  // _nodes, but destroyNode leaves that to the caller
+  NodeConnector* allocConnector(
+      const string& name, ParamType type, NodeConnector::Dir dir, const ofPoint& pt, Node* parent);
+  Node* createNode(const NodeTemplate* t, const ofPoint& pt, int id);
+  void destroyNode(Node* node);
+
+  // The compiler only works on a snapshot, so it can run off the ui thread
+  void snapshotGraph(GraphSnapshot* snapshot);
+  static bool createGraph(
+      const vector<Node*>& nodes, vector<Node*>* sortedNodes, string* error);
+  static void removeDeadNodes(CompileGraph* graph);
+  static void removeIncompleteNodes(CompileGraph* graph);
+  static void foldConstants(const GraphSnapshot& snapshot, CompileGraph* graph);
+  static void mergeCommonNodes(const GraphSnapshot& snapshot, CompileGraph* graph);
+  static void scheduleForMemory(const CompileGraph& graph, vector<Node*>* scheduled);
+  // With allNodes, every node that has all its inputs gets an op, whether the final texture needs
+  // it or not, and duplicates aren't merged, so each node has its own output (for thumbnails)
+  static bool compileGraph(const GraphSnapshot& snapshot,
+      CompiledProgram* prg,
+      string* error,
+      bool allNodes = false);
+  void rebuildTopoOrder();
+  // Compiles the current graph in place
+  bool generateGraph(CompiledProgram* prg);
 
   bool drawNodeParameters();
   void drawSidePanel();
 
   void deleteConnector(NodeConnector* con);
+  // NB: blocks until the receiver has read it, so only the compile worker calls this
+  void sendMessage(const char* data, size_t size);
   void sendTexture();
+  void sendParameters(Node* node);
+
+  void invalidateNode(Node* node);
+  void invalidateConnector(NodeConnector* con);
+  void updatePreview();
+  void renderThumbnails(shared_ptr<const GraphSnapshot> snapshot);
+  void drawThumbnails(const ofRectangle& viewport);
 
   enum class Mode
   {
@@ -203,16 +354,68 @@ public:
   unordered_map<string, NodeTemplate*> _nodeTemplates;
   unordered_map<string, vector<NodeTemplate*>> _templatesByCategory;
 
+  // NB: the arenas are declared before anything pointing into them
+  Arena<Node> _nodeArena;
+  Arena<NodeConnector> _connectorArena;
+
+  // the nodes in creation order, which is also the draw and save order
   vector<Node*> _nodes;
+  unordered_map<int, Node*> _nodesById;
+
+  // node bounds for hit-testing, kept up to date as nodes move
+  SpatialGrid _nodeGrid;
+  vector<int> _gridQuery;
   vector<Node*> _selectedNodes;
   Node* _curEditingNode = nullptr;
 
+  CanvasRenderer _canvas;
   ofTrueTypeFont _font;
 
   Mode _mode = Mode::Default;
 
   int _nextNodeId = 1;
 
+  // Topological order of the nodes, kept up to date as connections are made. If the graph can't
+  // be ordered (a cyclic file, or aux indices creating a cycle) it's marked as invalid, and
+  // compiles fall back to a full sort
+  OnlineTopoOrder _topoOrder;
+  bool _topoOrderValid = true;
+  ScheduleMode _scheduleMode = ScheduleMode::EditOrder;
+  ParamPrecision _paramPrecision = ParamPrecision::Full;
+
   ofxImGui _imgui;
-  HANDLE _pipeHandle = INVALID_HANDLE_VALUE;
+  // where programs and patches go. NB: declared before the compile worker, which sends on it
+  unique_ptr<Transport> _transport;
+
+  // the last program sent. Parameter edits are patched into it, until a structural edit
+  // invalidates it. While a compile is pending, it's out of date, so the nodes whose parameters
+  // are edited meanwhile are patched once the compile is in
+  CompiledProgram _program;
+  bool _programValid = false;
+  bool _programPending = false;
+  u32 _compileGeneration = 0;
+  unordered_set<int> _pendingParamNodes;
+
+  // why the last load or compile failed
+  string _lastError;
+
+  // The preview keeps the output of every node, and only recomputes the dirty ones. It renders in
+  // the background, and the finished levels are picked up in update.
+  // NB: the pool and preview are created in setup, so headless apps don't spin up threads. The
+  // preview is declared after the pool, so it's stopped first
+  unique_ptr<ThreadPool> _threadPool;
+  unique_ptr<ProgressivePreview> _preview;
+  unique_ptr<CompileWorker> _compiler;
+  unordered_set<int> _dirtyNodes;
+  VmTexture _previewPixels;
+  ofTexture _previewTexture;
+
+  // The thumbnails are rendered in the background too, with their own dirty nodes, as they're
+  // handed over at a different time than the preview's. Parameter edits just mark them as stale,
+  // so they're snapshot at most once per frame in update.
+  unique_ptr<ThumbnailRenderer> _thumbnailRenderer;
+  unordered_set<int> _dirtyThumbnails;
+  bool _thumbnailsStale = false;
+  unordered_map<int, VmTexture> _thumbnailPixels;
+  unordered_map<int, ofTexture> _thumbnails;
 };
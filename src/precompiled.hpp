@@ -11,7 +11,4 @@
 
 #include <unordered_set>
 
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
-typedef uint64_t u64;
+#include "types.hpp"
@@ -0,0 +1,158 @@
+#include "progressive_preview.hpp"
+#include "thread_pool.hpp"
+
+#include <stdio.h>
+
+using namespace std;
+
+// the levels, as fractions of the full size
+static const int LEVEL_DIVISORS[] = { 8, 4, 1 };
+
+//--------------------------------------------------------------
+ProgressivePreview::ProgressivePreview(ThreadPool* pool, int size)
+    : _levels(sizeof(LEVEL_DIVISORS) / sizeof(LEVEL_DIVISORS[0]))
+{
+  for (size_t i = 0; i < _levels.size(); ++i)
+  {
+    Level& level = _levels[i];
+    level.size = max(1, size / LEVEL_DIVISORS[i]);
+    level.vm.setThreadPool(pool);
+    level.vm.setCancelFlag(&_cancel);
+  }
+
+  _thread = thread([this] { workerLoop(); });
+}
+
+//--------------------------------------------------------------
+ProgressivePreview::~ProgressivePreview()
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    _quit = true;
+    _cancel = true;
+  }
+  _wakeup.notify_one();
+  _thread.join();
+}
+
+//--------------------------------------------------------------
+void ProgressivePreview::render(
+    const vector<char>& prg, const vector<int>& opNodeIds, const unordered_set<int>& dirtyNodes)
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    _prg = prg;
+    _opNodeIds = opNodeIds;
+    _pending = true;
+    _generation++;
+    for (Level& level : _levels)
+    {
+      for (int id : dirtyNodes)
+        level.dirtyNodes[id] = _generation;
+    }
+
+    _cancel = true;
+  }
+  _wakeup.notify_one();
+}
+
+//--------------------------------------------------------------
+void ProgressivePreview::clear()
+{
+  lock_guard<mutex> lock(_mutex);
+  for (Level& level : _levels)
+    level.dirtyNodes.clear();
+
+  // NB: the caches are cleared by the worker, once it's done with them
+  _clear = true;
+  _pending = false;
+  _hasResult = false;
+  _cancel = true;
+}
+
+//--------------------------------------------------------------
+bool ProgressivePreview::fetch(VmTexture* texture)
+{
+  lock_guard<mutex> lock(_mutex);
+  if (!_hasResult)
+    return false;
+
+  // the old texture is handed back, so the worker can reuse its memory
+  swap(*texture, _result);
+  _hasResult = false;
+  return true;
+}
+
+//--------------------------------------------------------------
+void ProgressivePreview::workerLoop()
+{
+  vector<char> prg;
+  VmPrgReader reader;
+  vector<int> opNodeIds;
+  unordered_set<int> dirtyNodes;
+
+  while (true)
+  {
+    u32 generation;
+    {
+      unique_lock<mutex> lock(_mutex);
+      _wakeup.wait(lock, [this] { return _quit || _pending || _clear; });
+      if (_quit)
+        return;
+
+      if (_clear)
+      {
+        for (Level& level : _levels)
+          level.vm.clearCache();
+        _clear = false;
+      }
+
+      if (!_pending)
+        continue;
+
+      // NB: the flag is reset while holding the lock, so a render that comes in from here on
+      // cancels this one
+      prg.swap(_prg);
+      opNodeIds.swap(_opNodeIds);
+      generation = _generation;
+      _pending = false;
+      _cancel = false;
+    }
+
+    // NB: the program is opened once, and every level runs from the reader
+    if (!reader.open(prg.data(), prg.size()))
+    {
+      printf("Invalid program: %s\n", reader.error());
+      continue;
+    }
+
+    for (Level& level : _levels)
+    {
+      {
+        lock_guard<mutex> lock(_mutex);
+        dirtyNodes.clear();
+        for (auto& kv : level.dirtyNodes)
+          dirtyNodes.insert(kv.first);
+      }
+
+      if (!level.vm.runCached(reader, opNodeIds, dirtyNodes, level.size, level.size))
+        break;
+
+      lock_guard<mutex> lock(_mutex);
+      if (_cancel)
+        break;
+
+      // the nodes dirtied by a later render stay dirty
+      for (auto it = level.dirtyNodes.begin(); it != level.dirtyNodes.end();)
+      {
+        if (it->second <= generation)
+          it = level.dirtyNodes.erase(it);
+        else
+          ++it;
+      }
+
+      _result = level.vm.finalTexture();
+      _hasResult = true;
+    }
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "texture_vm.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class ThreadPool;
+
+//--------------------------------------------------------------
+// Renders the preview on a worker thread, first at 1/8 and 1/4 of the full size, and then at the
+// full size, so dragging a slider gets quick feedback. A new render cancels the one in flight,
+// at whatever level it's at.
+// Each level has its own vm, so each keeps a node cache at its own resolution, and its own set of
+// dirty nodes. A node stays dirty for a level until a render of that level completes.
+class ProgressivePreview
+{
+public:
+  ProgressivePreview(ThreadPool* pool, int size);
+  ~ProgressivePreview();
+
+  // dirtyNodes are the nodes edited since the last call
+  void render(const std::vector<char>& prg,
+      const std::vector<int>& opNodeIds,
+      const std::unordered_set<int>& dirtyNodes);
+
+  // Drops the cached textures, for when node ids get reused
+  void clear();
+
+  // Returns true if a level was finished since the last call, and swaps it into texture
+  bool fetch(VmTexture* texture);
+
+private:
+  struct Level
+  {
+    int size = 0;
+    TextureVm vm;
+    // node id -> the render it was dirtied by
+    std::unordered_map<int, u32> dirtyNodes;
+  };
+
+  void workerLoop();
+
+  std::vector<Level> _levels;
+  std::thread _thread;
+  std::atomic<bool> _cancel{ false };
+
+  // everything below is protected by the mutex
+  std::mutex _mutex;
+  std::condition_variable _wakeup;
+  bool _quit = false;
+  bool _clear = false;
+
+  // the latest render
+  bool _pending = false;
+  u32 _generation = 0;
+  std::vector<char> _prg;
+  std::vector<int> _opNodeIds;
+
+  VmTexture _result;
+  bool _hasResult = false;
+};
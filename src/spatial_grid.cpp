@@ -0,0 +1,125 @@
+#include "spatial_grid.hpp"
+
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+//--------------------------------------------------------------
+void SpatialGrid::clear()
+{
+  _items.clear();
+  _cells.clear();
+  _nextOrder = 0;
+}
+
+//--------------------------------------------------------------
+int SpatialGrid::cellCoord(float v) const
+{
+  return (int)floorf(v / _cellSize);
+}
+
+//--------------------------------------------------------------
+SpatialGrid::CellRange SpatialGrid::cellRange(const Rect& rect) const
+{
+  return CellRange{
+    cellCoord(rect.x0), cellCoord(rect.y0), cellCoord(rect.x1), cellCoord(rect.y1) };
+}
+
+//--------------------------------------------------------------
+u64 SpatialGrid::cellKey(int x, int y)
+{
+  return ((u64)(u32)x << 32) | (u32)y;
+}
+
+//--------------------------------------------------------------
+void SpatialGrid::addToCells(int id, const CellRange& cells)
+{
+  for (int y = cells.y0; y <= cells.y1; ++y)
+  {
+    for (int x = cells.x0; x <= cells.x1; ++x)
+      _cells[cellKey(x, y)].push_back(id);
+  }
+}
+
+//--------------------------------------------------------------
+void SpatialGrid::removeFromCells(int id, const CellRange& cells)
+{
+  for (int y = cells.y0; y <= cells.y1; ++y)
+  {
+    for (int x = cells.x0; x <= cells.x1; ++x)
+    {
+      auto it = _cells.find(cellKey(x, y));
+      if (it == _cells.end())
+        continue;
+
+      // the order within a cell doesn't matter, so swap with the last one
+      vector<int>& ids = it->second;
+      auto idIt = find(ids.begin(), ids.end(), id);
+      if (idIt != ids.end())
+      {
+        *idIt = ids.back();
+        ids.pop_back();
+      }
+
+      if (ids.empty())
+        _cells.erase(it);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+void SpatialGrid::set(int id, const Rect& rect)
+{
+  CellRange cells = cellRange(rect);
+
+  auto it = _items.find(id);
+  if (it == _items.end())
+  {
+    _items[id] = Item{ rect, cells, _nextOrder++ };
+    addToCells(id, cells);
+    return;
+  }
+
+  // small moves usually stay within the same cells
+  Item& item = it->second;
+  item.rect = rect;
+  if (item.cells == cells)
+    return;
+
+  removeFromCells(id, item.cells);
+  addToCells(id, cells);
+  item.cells = cells;
+}
+
+//--------------------------------------------------------------
+void SpatialGrid::remove(int id)
+{
+  auto it = _items.find(id);
+  if (it == _items.end())
+    return;
+
+  removeFromCells(id, it->second.cells);
+  _items.erase(it);
+}
+
+//--------------------------------------------------------------
+void SpatialGrid::query(float x, float y, vector<int>* ids) const
+{
+  ids->clear();
+
+  auto cellIt = _cells.find(cellKey(cellCoord(x), cellCoord(y)));
+  if (cellIt == _cells.end())
+    return;
+
+  for (int id : cellIt->second)
+  {
+    const Rect& r = _items.at(id).rect;
+    if (x >= r.x0 && x <= r.x1 && y >= r.y0 && y <= r.y1)
+      ids->push_back(id);
+  }
+
+  sort(ids->begin(), ids->end(), [this](int a, int b) {
+    return _items.at(a).order < _items.at(b).order;
+  });
+}
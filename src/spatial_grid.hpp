@@ -0,0 +1,58 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+// Uniform grid over axis aligned rectangles, for hit-testing on the canvas. Each item is listed in
+// every cell its rectangle overlaps, so a point query only looks at the items in a single cell.
+// Items are ids chosen by the caller, and keep the order they were first added in, so overlapping
+// items are returned in a stable order.
+class SpatialGrid
+{
+public:
+  struct Rect
+  {
+    float x0, y0, x1, y1;
+  };
+
+  SpatialGrid(float cellSize = 256) : _cellSize(cellSize) {}
+
+  void clear();
+
+  // Adds the item, or moves it if it's already in the grid
+  void set(int id, const Rect& rect);
+  void remove(int id);
+
+  // Returns the items whose rectangle contains the point, in the order they were added
+  void query(float x, float y, std::vector<int>* ids) const;
+
+private:
+  struct CellRange
+  {
+    int x0, y0, x1, y1;
+    bool operator==(const CellRange& rhs) const
+    {
+      return x0 == rhs.x0 && y0 == rhs.y0 && x1 == rhs.x1 && y1 == rhs.y1;
+    }
+  };
+
+  struct Item
+  {
+    Rect rect;
+    CellRange cells;
+    u64 order;
+  };
+
+  int cellCoord(float v) const;
+  CellRange cellRange(const Rect& rect) const;
+  static u64 cellKey(int x, int y);
+  void addToCells(int id, const CellRange& cells);
+  void removeFromCells(int id, const CellRange& cells);
+
+  float _cellSize;
+  u64 _nextOrder = 0;
+  std::unordered_map<int, Item> _items;
+  std::unordered_map<u64, std::vector<int>> _cells;
+};
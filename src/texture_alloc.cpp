@@ -0,0 +1,141 @@
+#include "texture_alloc.hpp"
+
+#include <algorithm>
+#include <assert.h>
+#include <functional>
+#include <queue>
+
+using namespace std;
+
+//--------------------------------------------------------------
+void allocateTextures(
+    const vector<bool>& writesPool, const vector<vector<int>>& inputs, TextureAllocation* res)
+{
+  int numOps = (int)writesPool.size();
+  res->opTexture.assign(numOps, -1);
+  res->numTextures = 0;
+  res->numFusedTextures = 0;
+
+  // the last op reading each output. Outputs nobody reads die on the op that writes them
+  vector<int> lastUse(numOps);
+  for (int i = 0; i < numOps; ++i)
+  {
+    lastUse[i] = i;
+    for (int input : inputs[i])
+    {
+      assert(input < i);
+      lastUse[input] = i;
+    }
+  }
+
+  // the outputs to free after each op, bucketed by their last use
+  vector<int> freeStart(numOps + 1, 0);
+  for (int i = 0; i < numOps; ++i)
+  {
+    if (writesPool[i])
+      freeStart[lastUse[i] + 1]++;
+  }
+
+  for (int i = 0; i < numOps; ++i)
+    freeStart[i + 1] += freeStart[i];
+
+  vector<int> freeOps(freeStart[numOps]);
+  vector<int> fill(freeStart.begin(), freeStart.end() - 1);
+  for (int i = 0; i < numOps; ++i)
+  {
+    if (writesPool[i])
+      freeOps[fill[lastUse[i]]++] = i;
+  }
+
+  // NB: the lowest free texture is reused first, so the ids stay compact
+  priority_queue<int, vector<int>, greater<int>> freeTextures;
+  for (int i = 0; i < numOps; ++i)
+  {
+    if (writesPool[i])
+    {
+      if (freeTextures.empty())
+        freeTextures.push(res->numTextures++);
+
+      res->opTexture[i] = freeTextures.top();
+      freeTextures.pop();
+    }
+
+    // only now release the inputs, so they can't be reused for this op's output
+    for (int j = freeStart[i]; j < freeStart[i + 1]; ++j)
+      freeTextures.push(res->opTexture[freeOps[j]]);
+  }
+}
+
+//--------------------------------------------------------------
+void allocateFusedTextures(const vector<bool>& writesPool,
+    const vector<bool>& fused,
+    const vector<vector<int>>& inputs,
+    TextureAllocation* res)
+{
+  int numOps = (int)writesPool.size();
+  vector<bool> pooled(numOps);
+  for (int i = 0; i < numOps; ++i)
+    pooled[i] = writesPool[i] && !fused[i];
+
+  allocateTextures(pooled, inputs, res);
+  res->numFusedOps = 0;
+
+  vector<int> lastUse(numOps);
+  for (int i = 0; i < numOps; ++i)
+  {
+    lastUse[i] = i;
+    for (int input : inputs[i])
+      lastUse[input] = i;
+  }
+
+  // The ops each texture holds an output for, as [first, last] ranges sorted by op. Ranges that
+  // share an op overlap, as an op's output never shares a texture with its inputs
+  vector<vector<pair<int, int>>> busy(res->numTextures);
+  for (int i = 0; i < numOps; ++i)
+  {
+    if (pooled[i])
+      busy[res->opTexture[i]].push_back(make_pair(i, lastUse[i]));
+  }
+
+  // NB: the fused outputs are placed where no other output is live, so the program is still
+  // correct when it's run without fusion. Their ranges are short, so they mostly fit in the gaps
+  // of the pool textures, and only the ones that don't get textures numbered after them
+  for (int i = 0; i < numOps; ++i)
+  {
+    if (!fused[i])
+      continue;
+
+    pair<int, int> range(i, lastUse[i]);
+    size_t texture = 0;
+    vector<pair<int, int>>::iterator it;
+    for (; texture < busy.size(); ++texture)
+    {
+      // the first range that ends at or after this one starts
+      vector<pair<int, int>>& ranges = busy[texture];
+      it = lower_bound(ranges.begin(),
+          ranges.end(),
+          range,
+          [](const pair<int, int>& a, const pair<int, int>& b) { return a.second < b.first; });
+      if (it == ranges.end() || it->first > range.second)
+        break;
+    }
+
+    if (texture == busy.size())
+    {
+      busy.push_back(vector<pair<int, int>>());
+      it = busy.back().end();
+    }
+
+    busy[texture].insert(it, range);
+    res->opTexture[i] = (int)texture;
+    res->numFusedOps++;
+  }
+
+  res->numFusedTextures = (int)busy.size() - res->numTextures;
+}
+
+//--------------------------------------------------------------
+size_t textureMemory(int numTextures, int width, int height)
+{
+  return (size_t)numTextures * width * height * 4 * sizeof(float);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// Assigns pool textures to the outputs of a straight line program. Each output is live from the
+// op that writes it to the last op that reads it, and the ops are allocated in program order,
+// with each output taking the lowest free texture. For intervals that's optimal: the number of
+// textures is the peak number of outputs live at once, for the given order.
+// NB: an op's output never shares a texture with its inputs, even on their last use, as the vm
+// kernels don't work in place
+struct TextureAllocation
+{
+  // per op, the pool texture its output is written to, or -1 if it doesn't write to the pool
+  std::vector<int> opTexture;
+  // also the peak number of live textures
+  int numTextures = 0;
+  // textures only the fused outputs use, numbered after the others. Programs declare both kinds,
+  // for renderers that don't fuse
+  int numFusedTextures = 0;
+  int numFusedOps = 0;
+};
+
+// writesPool[i] is set if op i's output needs a pool texture, and inputs[i] are the ops whose
+// outputs op i reads. Inputs always come earlier in the program.
+void allocateTextures(const std::vector<bool>& writesPool,
+    const std::vector<std::vector<int>>& inputs,
+    TextureAllocation* res);
+
+// The same, but the outputs marked in fused are only read inside the vm pass that writes them, so
+// they never get memory. They still get a texture where no other output is live, so the program
+// is correct when it's run without fusion, reusing the gaps in the pool textures where they can.
+void allocateFusedTextures(const std::vector<bool>& writesPool,
+    const std::vector<bool>& fused,
+    const std::vector<std::vector<int>>& inputs,
+    TextureAllocation* res);
+
+// Memory used by the given number of RGBA32F textures
+size_t textureMemory(int numTextures, int width, int height);
@@ -0,0 +1,1160 @@
+#include "texture_vm.hpp"
+#include "thread_pool.hpp"
+#include "vm_bytecode.hpp"
+#include "vm_reader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+//--------------------------------------------------------------
+// NB: all the kernels work in uv-space, so the result doesn't depend on the chosen resolution
+// (apart from the sampling density, of course)
+static const float PI = 3.14159265358979f;
+
+// octaves above this frequency are skipped, to keep the lattice coordinates in int range
+static const float NOISE_MAX_FREQ = 65536;
+
+//--------------------------------------------------------------
+// cbuffer layouts. Params are written back to back as 32 bit values, in template order
+struct FillParams
+{
+  VmColor color;
+};
+
+struct RadialGradientParams
+{
+  float cx, cy;
+  float power;
+};
+
+struct LinearGradientParams
+{
+  float x0, y0;
+  float x1, y1;
+  float power;
+};
+
+struct SinusParams
+{
+  float freq;
+  float amp;
+  float power;
+};
+
+struct NoiseParams
+{
+  int numOctaves;
+  float scale;
+  float freqScale;
+  float intensityScale;
+};
+
+struct ModulateParams
+{
+  float factorA;
+  float factorB;
+};
+
+struct RotateScaleParams
+{
+  float angle;
+  float sx, sy;
+};
+
+struct DistortParams
+{
+  float scale;
+};
+
+struct ColorGradientParams
+{
+  VmColor colA;
+  VmColor colB;
+};
+
+//--------------------------------------------------------------
+template <typename T>
+static T readParams(const char* cbuffer)
+{
+  T res;
+  memcpy(&res, cbuffer, sizeof(T));
+  return res;
+}
+
+//--------------------------------------------------------------
+static inline float clamp01(float v)
+{
+  return v < 0 ? 0 : v > 1 ? 1 : v;
+}
+
+//--------------------------------------------------------------
+// Detail too fine for the texture would alias, and look different at every resolution. It's
+// faded out to its average value over the octave above the given frequency, so a texture rendered
+// at a lower resolution looks like a scaled down version of the full one
+static inline float aliasFade(float freq, float start)
+{
+  return clamp01(freq / start - 1);
+}
+
+//--------------------------------------------------------------
+static inline VmColor grey(float v)
+{
+  return VmColor{ v, v, v, 1 };
+}
+
+//--------------------------------------------------------------
+static inline float pixelU(const VmTexture& t, int x)
+{
+  return (x + 0.5f) / t.width;
+}
+
+//--------------------------------------------------------------
+static inline float pixelV(const VmTexture& t, int y)
+{
+  return (y + 0.5f) / t.height;
+}
+
+//--------------------------------------------------------------
+static inline int wrapCoord(int i, int n)
+{
+  i %= n;
+  return i < 0 ? i + n : i;
+}
+
+//--------------------------------------------------------------
+static VmColor sampleBilinear(const VmTexture& t, float u, float v)
+{
+  // wrap addressing
+  u -= floorf(u);
+  v -= floorf(v);
+
+  float x = u * t.width - 0.5f;
+  float y = v * t.height - 0.5f;
+  float fx = floorf(x);
+  float fy = floorf(y);
+  float tx = x - fx;
+  float ty = y - fy;
+
+  int x0 = wrapCoord((int)fx, t.width);
+  int y0 = wrapCoord((int)fy, t.height);
+  int x1 = wrapCoord(x0 + 1, t.width);
+  int y1 = wrapCoord(y0 + 1, t.height);
+
+  const VmColor& c00 = t.pixels[y0 * t.width + x0];
+  const VmColor& c10 = t.pixels[y0 * t.width + x1];
+  const VmColor& c01 = t.pixels[y1 * t.width + x0];
+  const VmColor& c11 = t.pixels[y1 * t.width + x1];
+
+  float w00 = (1 - tx) * (1 - ty);
+  float w10 = tx * (1 - ty);
+  float w01 = (1 - tx) * ty;
+  float w11 = tx * ty;
+
+  return VmColor{ c00.r * w00 + c10.r * w10 + c01.r * w01 + c11.r * w11,
+    c00.g * w00 + c10.g * w10 + c01.g * w01 + c11.g * w11,
+    c00.b * w00 + c10.b * w10 + c01.b * w01 + c11.b * w11,
+    c00.a * w00 + c10.a * w10 + c01.a * w01 + c11.a * w11 };
+}
+
+//--------------------------------------------------------------
+static inline float latticeValue(int x, int y)
+{
+  u32 h = (u32)x * 374761393u + (u32)y * 668265263u;
+  h = (h ^ (h >> 13)) * 1274126177u;
+  h ^= h >> 16;
+  return (h & 0xffffff) / (float)0xffffff;
+}
+
+//--------------------------------------------------------------
+static float valueNoise(float x, float y)
+{
+  float fx = floorf(x);
+  float fy = floorf(y);
+  int ix = (int)fx;
+  int iy = (int)fy;
+  float tx = x - fx;
+  float ty = y - fy;
+  tx = tx * tx * (3 - 2 * tx);
+  ty = ty * ty * (3 - 2 * ty);
+
+  float a = latticeValue(ix, iy);
+  float b = latticeValue(ix + 1, iy);
+  float c = latticeValue(ix, iy + 1);
+  float d = latticeValue(ix + 1, iy + 1);
+  return (a + (b - a) * tx) * (1 - ty) + (c + (d - c) * tx) * ty;
+}
+
+//--------------------------------------------------------------
+static inline float spanU(const VmSpanArgs& args, int i)
+{
+  return (args.x + i + 0.5f) / args.width;
+}
+
+//--------------------------------------------------------------
+static inline float spanV(const VmSpanArgs& args)
+{
+  return (args.y + 0.5f) / args.height;
+}
+
+//--------------------------------------------------------------
+// Runs a pointwise kernel over a tile, one row at a time
+template <VmSpanFn Fn, int NumInputs>
+static void kernelPointwise(const VmKernelArgs& args, const VmRect& rect)
+{
+  VmTexture& out = *args.output;
+  VmSpanArgs span;
+  span.cbuffer = args.cbuffer;
+  span.x = rect.x0;
+  span.count = rect.x1 - rect.x0;
+  span.width = out.width;
+  span.height = out.height;
+  for (int y = rect.y0; y < rect.y1; ++y)
+  {
+    int idx = y * out.width + rect.x0;
+    span.y = y;
+    span.output = &out.pixels[idx];
+    for (int i = 0; i < NumInputs; ++i)
+      span.inputs[i] = &args.inputs[i]->pixels[idx];
+    Fn(span);
+  }
+}
+
+//--------------------------------------------------------------
+static void spanCopy(const VmSpanArgs& args)
+{
+  memcpy(args.output, args.inputs[0], args.count * sizeof(VmColor));
+}
+
+//--------------------------------------------------------------
+static void spanFill(const VmSpanArgs& args)
+{
+  FillParams p = readParams<FillParams>(args.cbuffer);
+  for (int i = 0; i < args.count; ++i)
+    args.output[i] = p.color;
+}
+
+//--------------------------------------------------------------
+static void spanRadialGradient(const VmSpanArgs& args)
+{
+  RadialGradientParams p = readParams<RadialGradientParams>(args.cbuffer);
+  float dy = spanV(args) * 2 - 1 - p.cy;
+  for (int i = 0; i < args.count; ++i)
+  {
+    float dx = spanU(args, i) * 2 - 1 - p.cx;
+    float t = clamp01(1 - sqrtf(dx * dx + dy * dy));
+    args.output[i] = grey(powf(t, p.power));
+  }
+}
+
+//--------------------------------------------------------------
+static void spanLinearGradient(const VmSpanArgs& args)
+{
+  LinearGradientParams p = readParams<LinearGradientParams>(args.cbuffer);
+
+  float dirX = p.x1 - p.x0;
+  float dirY = p.y1 - p.y0;
+  float lenSq = dirX * dirX + dirY * dirY;
+  float invLenSq = lenSq > 0 ? 1 / lenSq : 0;
+
+  float py = spanV(args) * 2 - 1 - p.y0;
+  for (int i = 0; i < args.count; ++i)
+  {
+    float px = spanU(args, i) * 2 - 1 - p.x0;
+    float t = clamp01((px * dirX + py * dirY) * invLenSq);
+    args.output[i] = grey(powf(t, p.power));
+  }
+}
+
+//--------------------------------------------------------------
+static void spanSinus(const VmSpanArgs& args)
+{
+  SinusParams p = readParams<SinusParams>(args.cbuffer);
+
+  // above nyquist, it fades to the average of s^power over a period. NB: that diverges for very
+  // negative powers, which aren't faded
+  float fade = 0, mean = 0;
+  if (p.power > -0.5f)
+  {
+    fade = aliasFade(fabsf(p.freq), 0.5f * args.width);
+    mean = tgammaf(p.power + 0.5f) / (sqrtf(PI) * tgammaf(p.power + 1));
+  }
+
+  for (int i = 0; i < args.count; ++i)
+  {
+    float s = 0.5f + 0.5f * sinf(2 * PI * p.freq * spanU(args, i));
+    float v = fade < 1 ? powf(s, p.power) : mean;
+    args.output[i] = grey(p.amp * (v + (mean - v) * fade));
+  }
+}
+
+//--------------------------------------------------------------
+static void spanNoise(const VmSpanArgs& args)
+{
+  NoiseParams p = readParams<NoiseParams>(args.cbuffer);
+  // NB: a lattice has most of its energy well below its frequency, so the fade starts an octave
+  // above nyquist
+  float fadeStart = (float)min(args.width, args.height);
+  float v = spanV(args);
+  for (int i = 0; i < args.count; ++i)
+  {
+    float u = spanU(args, i);
+
+    // fbm: each octave divides the frequency by freq_scale, and scales the intensity
+    float sum = 0, total = 0;
+    float freq = p.scale;
+    float amp = 1;
+    for (int j = 0; j < p.numOctaves && freq < NOISE_MAX_FREQ; ++j)
+    {
+      // offset each octave, so the lattice points don't line up. The lattice values average 0.5
+      float fade = aliasFade(freq, fadeStart);
+      float n = fade < 1 ? valueNoise(u * freq + j * 17.13f, v * freq + j * 31.71f) : 0.5f;
+      sum += amp * (n + (0.5f - n) * fade);
+      total += amp;
+      freq /= p.freqScale;
+      amp *= p.intensityScale;
+    }
+
+    args.output[i] = grey(total > 0 ? sum / total : 0);
+  }
+}
+
+//--------------------------------------------------------------
+static void spanModulate(const VmSpanArgs& args)
+{
+  ModulateParams p = readParams<ModulateParams>(args.cbuffer);
+  const VmColor* a = args.inputs[0];
+  const VmColor* b = args.inputs[1];
+  float f = p.factorA * p.factorB;
+  for (int i = 0; i < args.count; ++i)
+  {
+    const VmColor& ca = a[i];
+    const VmColor& cb = b[i];
+    args.output[i] = VmColor{ f * ca.r * cb.r, f * ca.g * cb.g, f * ca.b * cb.b, f * ca.a * cb.a };
+  }
+}
+
+//--------------------------------------------------------------
+static void kernelRotateScale(const VmKernelArgs& args, const VmRect& rect)
+{
+  RotateScaleParams p = readParams<RotateScaleParams>(args.cbuffer);
+  VmTexture& out = *args.output;
+  const VmTexture& a = *args.inputs[0];
+
+  // rotate and scale around the texture center
+  float c = cosf(p.angle);
+  float s = sinf(p.angle);
+  for (int y = rect.y0; y < rect.y1; ++y)
+  {
+    float v = pixelV(out, y) - 0.5f;
+    for (int x = rect.x0; x < rect.x1; ++x)
+    {
+      float u = pixelU(out, x) - 0.5f;
+      float su = (c * u - s * v) * p.sx + 0.5f;
+      float sv = (s * u + c * v) * p.sy + 0.5f;
+      out.pixels[y * out.width + x] = sampleBilinear(a, su, sv);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+static void kernelDistort(const VmKernelArgs& args, const VmRect& rect)
+{
+  DistortParams p = readParams<DistortParams>(args.cbuffer);
+  VmTexture& out = *args.output;
+  const VmTexture& a = *args.inputs[0];
+  const VmTexture& b = *args.inputs[1];
+  const VmTexture& c = *args.inputs[2];
+
+  // b and c are the offsets in u and v, remapped to [-1, 1]. The scale is in uv units
+  for (int y = rect.y0; y < rect.y1; ++y)
+  {
+    for (int x = rect.x0; x < rect.x1; ++x)
+    {
+      int idx = y * out.width + x;
+      float du = (b.pixels[idx].r * 2 - 1) * p.scale;
+      float dv = (c.pixels[idx].r * 2 - 1) * p.scale;
+      out.pixels[idx] = sampleBilinear(a, pixelU(out, x) + du, pixelV(out, y) + dv);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+static void spanColorGradient(const VmSpanArgs& args)
+{
+  ColorGradientParams p = readParams<ColorGradientParams>(args.cbuffer);
+  const VmColor* a = args.inputs[0];
+  for (int i = 0; i < args.count; ++i)
+  {
+    float t = clamp01(a[i].r);
+    args.output[i] = VmColor{ p.colA.r + (p.colB.r - p.colA.r) * t,
+      p.colA.g + (p.colB.g - p.colA.g) * t,
+      p.colA.b + (p.colB.b - p.colA.b) * t,
+      p.colA.a + (p.colB.a - p.colA.a) * t };
+  }
+}
+
+//--------------------------------------------------------------
+// NB: store and final are emitted as loads with a hard-coded output, but are kept here so the
+// vm handles any of the template ids
+static const VmKernel g_kernels[] = {
+  // op, name, inputs, cbuffer size, flags, kernel, span
+  { VM_OP_LOAD, "Load", 1, 0, 0, kernelPointwise<spanCopy, 1>, spanCopy },
+  { VM_OP_STORE, "Store", 1, 0, 0, kernelPointwise<spanCopy, 1>, spanCopy },
+  { VM_OP_FINAL, "Final", 1, 0, 0, kernelPointwise<spanCopy, 1>, spanCopy },
+  { VM_OP_FILL, "Fill", 0, sizeof(FillParams), 0, kernelPointwise<spanFill, 0>, spanFill },
+  { VM_OP_RADIAL_GRADIENT,
+      "RadialGradient",
+      0,
+      sizeof(RadialGradientParams),
+      0,
+      kernelPointwise<spanRadialGradient, 0>,
+      spanRadialGradient },
+  { VM_OP_LINEAR_GRADIENT,
+      "LinearGradient",
+      0,
+      sizeof(LinearGradientParams),
+      0,
+      kernelPointwise<spanLinearGradient, 0>,
+      spanLinearGradient },
+  { VM_OP_SINUS, "Sinus", 0, sizeof(SinusParams), 0, kernelPointwise<spanSinus, 0>, spanSinus },
+  { VM_OP_NOISE, "Noise", 0, sizeof(NoiseParams), 0, kernelPointwise<spanNoise, 0>, spanNoise },
+  { VM_OP_MODULATE,
+      "Modulate",
+      2,
+      sizeof(ModulateParams),
+      0,
+      kernelPointwise<spanModulate, 2>,
+      spanModulate },
+  { VM_OP_ROTATE_SCALE,
+      "RotateScale",
+      1,
+      sizeof(RotateScaleParams),
+      VM_KERNEL_FLAG_SAMPLES_INPUTS,
+      kernelRotateScale,
+      nullptr },
+  { VM_OP_DISTORT,
+      "Distort",
+      3,
+      sizeof(DistortParams),
+      VM_KERNEL_FLAG_SAMPLES_INPUTS,
+      kernelDistort,
+      nullptr },
+  { VM_OP_COLOR_GRADIENT,
+      "ColorGradient",
+      1,
+      sizeof(ColorGradientParams),
+      0,
+      kernelPointwise<spanColorGradient, 1>,
+      spanColorGradient },
+};
+
+//--------------------------------------------------------------
+// NB: the reader looks up every op when it validates a program, so this is a table lookup
+const VmKernel* vmFindKernel(u8 op)
+{
+  static const VmKernel* const* table = [] {
+    static const VmKernel* t[256] = {};
+    for (const VmKernel& k : g_kernels)
+      t[k.op] = &k;
+    return t;
+  }();
+  return table[op];
+}
+
+//--------------------------------------------------------------
+void VmTexture::resize(int w, int h)
+{
+  width = w;
+  height = h;
+  pixels.resize(w * h);
+}
+
+//--------------------------------------------------------------
+bool vmApplyPatch(vector<char>* prg, VmPrgReader* reader, const char* patch, size_t size)
+{
+  VmPatch header;
+  if (size < sizeof(VmPatch))
+    return false;
+
+  memcpy(&header, patch, sizeof(VmPatch));
+  if (header.tag != VM_PATCH_TAG || size != sizeof(VmPatch) + header.size
+      || header.opIndex >= reader->numOps())
+  {
+    return false;
+  }
+
+  // the params of the op are patched where they're stored, whatever the version
+  const VmOpView& op = reader->op(header.opIndex);
+  if (header.offset + header.size > op.paramsSize)
+    return false;
+
+  size_t pos = op.params - prg->data();
+  memcpy(prg->data() + pos + header.offset, patch + sizeof(VmPatch), header.size);
+  reader->updateCBuffer(header.opIndex);
+  return true;
+}
+
+//--------------------------------------------------------------
+TextureVm::TextureVm()
+{
+  for (int& nodeId : _auxNodes)
+    nodeId = -1;
+}
+
+//--------------------------------------------------------------
+VmTexture* TextureVm::texture(u8 id)
+{
+  if (id == VM_FINAL_TEXTURE)
+    return &_final;
+
+  if (id >= _textures.size())
+    return nullptr;
+
+  return &_textures[id];
+}
+
+//--------------------------------------------------------------
+const VmTexture* TextureVm::auxTexture(int idx) const
+{
+  if (idx < 0 || idx >= VM_NUM_AUX_TEXTURES || idx >= (int)_textures.size())
+    return nullptr;
+
+  return &_textures[idx];
+}
+
+//--------------------------------------------------------------
+void TextureVm::bind(const VmOpView& op, VmBoundInstr* bound)
+{
+  // NB: the reader has checked the op against its kernel, and every texture id
+  VmKernelArgs& args = bound->args;
+  bound->kernel = vmFindKernel(op.op);
+  args.output = texture(op.output);
+  args.cbuffer = op.cbuffer;
+  for (int i = 0; i < op.numInputs; ++i)
+    args.inputs[i] = texture(op.inputs[i]);
+}
+
+//--------------------------------------------------------------
+// Runs the stages of a fused pass over a tile. Each stage does a row before the next one starts,
+// so the values passed between the stages stay in a few small row buffers, and only the stored
+// outputs are written to their textures.
+static void runFusedPass(const VmPass& pass, const VmRect& rect, int width, int height)
+{
+  int count = (int)pass.stages.size();
+
+  // NB: the buffers are per thread, so the tiles can run in parallel
+  static thread_local vector<VmColor> scratch;
+  static thread_local vector<VmColor*> rows;
+  scratch.resize(count * VM_TILE_SIZE);
+  rows.resize(count);
+
+  VmSpanArgs span;
+  span.x = rect.x0;
+  span.count = rect.x1 - rect.x0;
+  span.width = width;
+  span.height = height;
+  for (int y = rect.y0; y < rect.y1; ++y)
+  {
+    int idx = y * width + rect.x0;
+    span.y = y;
+    for (int s = 0; s < count; ++s)
+    {
+      const VmPassStage& stage = pass.stages[s];
+      const VmBoundInstr& instr = *stage.instr;
+      for (int i = 0; i < instr.kernel->numInputs; ++i)
+      {
+        int inputStage = stage.inputStages[i];
+        span.inputs[i] =
+            inputStage >= 0 ? rows[inputStage] : &instr.args.inputs[i]->pixels[idx];
+      }
+
+      rows[s] = stage.store ? &instr.args.output->pixels[idx] : &scratch[s * VM_TILE_SIZE];
+      span.output = rows[s];
+      span.cbuffer = instr.args.cbuffer;
+      instr.kernel->span(span);
+    }
+  }
+}
+
+//--------------------------------------------------------------
+void TextureVm::runSegment(const VmPass* passes, int count, vector<double>* opMs)
+{
+  int tilesX = (_width + VM_TILE_SIZE - 1) / VM_TILE_SIZE;
+  int tilesY = (_height + VM_TILE_SIZE - 1) / VM_TILE_SIZE;
+  int numTiles = tilesX * tilesY;
+
+  // time spent in each pass, summed over all the threads
+  vector<atomic<u64>> passNs(count);
+  for (atomic<u64>& ns : passNs)
+    ns = 0;
+
+  auto fnRunTile = [&](int idx) {
+    int x0 = (idx % tilesX) * VM_TILE_SIZE;
+    int y0 = (idx / tilesX) * VM_TILE_SIZE;
+    VmRect rect{ x0, y0, min(x0 + VM_TILE_SIZE, _width), min(y0 + VM_TILE_SIZE, _height) };
+    if (cancelled())
+      return;
+
+    for (int i = 0; i < count; ++i)
+    {
+      auto start = chrono::high_resolution_clock::now();
+      const VmPass& pass = passes[i];
+      if (pass.stages[0].instr->kernel->span)
+        runFusedPass(pass, rect, _width, _height);
+      else
+        pass.stages[0].instr->kernel->fn(pass.stages[0].instr->args, rect);
+      passNs[i] += chrono::duration_cast<chrono::nanoseconds>(
+          chrono::high_resolution_clock::now() - start).count();
+    }
+  };
+
+  auto start = chrono::high_resolution_clock::now();
+  if (_pool && numTiles > 1)
+  {
+    _pool->parallelFor(numTiles, fnRunTile);
+  }
+  else
+  {
+    for (int i = 0; i < numTiles; ++i)
+      fnRunTile(i);
+  }
+  chrono::duration<double, milli> ms = chrono::high_resolution_clock::now() - start;
+
+  // split the wall time between the passes, based on how much of the work each one did.
+  // NB: the ops of a fused pass can't be timed separately, so they get an equal share
+  u64 totalNs = 0;
+  for (atomic<u64>& ns : passNs)
+    totalNs += ns;
+
+  for (int i = 0; i < count; ++i)
+  {
+    double passMs = totalNs ? ms.count() * passNs[i] / totalNs : ms.count() / count;
+    for (size_t j = 0; j < passes[i].stages.size(); ++j)
+      opMs->push_back(passMs / passes[i].stages.size());
+  }
+}
+
+//--------------------------------------------------------------
+void TextureVm::buildPasses(const vector<VmBoundInstr>& bound,
+    size_t first,
+    size_t last,
+    bool storeAll,
+    vector<VmPass>* passes)
+{
+  // Every run of pointwise ops becomes a pass. An output is only stored if something after the
+  // pass reads it before it's overwritten, or it's an aux or the final texture, which outlive the
+  // program.
+  auto fnPersists = [&](const VmTexture* t) {
+    return t == &_final || (t >= _textures.data() && t < _textures.data() + VM_NUM_AUX_TEXTURES);
+  };
+
+  auto fnReadLater = [&](const VmTexture* t, size_t from) {
+    for (size_t i = from; i < bound.size(); ++i)
+    {
+      const VmKernelArgs& args = bound[i].args;
+      for (int j = 0; j < bound[i].kernel->numInputs; ++j)
+      {
+        if (args.inputs[j] == t)
+          return true;
+      }
+
+      if (args.output == t)
+        return false;
+    }
+    return false;
+  };
+
+  size_t i = first;
+  while (i < last)
+  {
+    size_t end = i + 1;
+    if (_fusion && bound[i].kernel->span)
+    {
+      while (end < last && bound[end].kernel->span)
+        ++end;
+    }
+
+    VmPass pass;
+    unordered_map<const VmTexture*, int> writers;
+    for (size_t j = i; j < end; ++j)
+    {
+      const VmBoundInstr& instr = bound[j];
+      VmPassStage stage;
+      stage.instr = &instr;
+      for (int k = 0; k < instr.kernel->numInputs; ++k)
+      {
+        auto it = writers.find(instr.args.inputs[k]);
+        stage.inputStages[k] = it == writers.end() ? -1 : it->second;
+      }
+
+      // if a later stage overwrites the output, it can only be read inside the pass
+      bool overwritten = false;
+      for (size_t k = j + 1; k < end && !overwritten; ++k)
+        overwritten = bound[k].args.output == instr.args.output;
+
+      stage.store = storeAll || !instr.kernel->span || fnPersists(instr.args.output)
+                    || (!overwritten && fnReadLater(instr.args.output, end));
+
+      writers[instr.args.output] = (int)pass.stages.size();
+      pass.stages.push_back(stage);
+    }
+
+    passes->push_back(pass);
+    i = end;
+  }
+}
+
+//--------------------------------------------------------------
+void TextureVm::runSequential(
+    const vector<VmBoundInstr>& bound, bool storeAll, vector<double>* opMs)
+{
+  // Split the program into segments that are run tile by tile, so a pointwise op reads the tile
+  // its inputs just wrote, while it's still in cache. A sampling op can read any tile of its
+  // inputs, so it has to start a new segment, and it also ends the segment if a later op wants to
+  // overwrite one of the textures it samples (the pool textures get reused).
+  vector<VmPass> passes;
+  vector<size_t> segments;
+  size_t segStart = 0;
+  unordered_set<const VmTexture*> sampled;
+  for (size_t i = 0; i <= bound.size(); ++i)
+  {
+    bool split = i == bound.size();
+    if (!split && i > segStart)
+    {
+      const VmBoundInstr& instr = bound[i];
+      split = (instr.kernel->flags & VM_KERNEL_FLAG_SAMPLES_INPUTS)
+              || sampled.count(instr.args.output);
+    }
+
+    if (split)
+    {
+      buildPasses(bound, segStart, i, storeAll, &passes);
+      segments.push_back(passes.size());
+      segStart = i;
+      sampled.clear();
+    }
+
+    if (i < bound.size() && (bound[i].kernel->flags & VM_KERNEL_FLAG_SAMPLES_INPUTS))
+    {
+      for (int j = 0; j < bound[i].kernel->numInputs; ++j)
+        sampled.insert(bound[i].args.inputs[j]);
+    }
+  }
+
+  vector<VmTexture*> outputs;
+  for (const VmPass& pass : passes)
+  {
+    for (const VmPassStage& stage : pass.stages)
+    {
+      if (stage.store)
+        outputs.push_back(stage.instr->args.output);
+      else
+        _stats.numFusedOps++;
+    }
+  }
+  allocateOutputs(outputs);
+
+  size_t passStart = 0;
+  for (size_t passEnd : segments)
+  {
+    runSegment(passes.data() + passStart, (int)(passEnd - passStart), opMs);
+    passStart = passEnd;
+  }
+}
+
+//--------------------------------------------------------------
+void vmBuildDependencies(const vector<VmBoundInstr>& bound, vector<vector<int>>* deps)
+{
+  // The program only refers to textures, so the edges are recovered from the hazards on those:
+  // - read after write: the op producing an input (this includes the store -> load edges, as they
+  //   go via the aux textures)
+  // - write after read/write: the pool textures are reused once their refcount hits zero, so an
+  //   op can't overwrite a texture before all the earlier readers and the writer are done with it
+  unordered_map<const VmTexture*, int> lastWriter;
+  unordered_map<const VmTexture*, vector<int>> readers;
+
+  deps->assign(bound.size(), vector<int>());
+
+  auto fnAddDep = [&](int op, int dep) {
+    vector<int>& d = (*deps)[op];
+    if (find(d.begin(), d.end(), dep) == d.end())
+      d.push_back(dep);
+  };
+
+  for (int i = 0; i < (int)bound.size(); ++i)
+  {
+    const VmKernelArgs& args = bound[i].args;
+    for (int j = 0; j < bound[i].kernel->numInputs; ++j)
+    {
+      auto it = lastWriter.find(args.inputs[j]);
+      if (it != lastWriter.end())
+        fnAddDep(i, it->second);
+      readers[args.inputs[j]].push_back(i);
+    }
+
+    auto it = lastWriter.find(args.output);
+    if (it != lastWriter.end())
+      fnAddDep(i, it->second);
+
+    for (int reader : readers[args.output])
+    {
+      if (reader != i)
+        fnAddDep(i, reader);
+    }
+
+    readers[args.output].clear();
+    lastWriter[args.output] = i;
+  }
+}
+
+//--------------------------------------------------------------
+void TextureVm::runDag(const vector<VmBoundInstr>& bound, vector<double>* opMs)
+{
+  int tilesX = (_width + VM_TILE_SIZE - 1) / VM_TILE_SIZE;
+  int tilesY = (_height + VM_TILE_SIZE - 1) / VM_TILE_SIZE;
+  int numTiles = tilesX * tilesY;
+  int numOps = (int)bound.size();
+
+  struct DagOp
+  {
+    vector<int> succs;
+    atomic<int> numDeps;
+    atomic<int> tilesLeft;
+    chrono::high_resolution_clock::time_point start;
+    double ms;
+  };
+
+  // NB: no fusion here, every op writes its output
+  vector<VmTexture*> outputs;
+  for (const VmBoundInstr& instr : bound)
+    outputs.push_back(instr.args.output);
+  allocateOutputs(outputs);
+
+  vector<vector<int>> deps;
+  vmBuildDependencies(bound, &deps);
+
+  vector<DagOp> ops(numOps);
+  for (int i = 0; i < numOps; ++i)
+  {
+    ops[i].numDeps = (int)deps[i].size();
+    ops[i].tilesLeft = numTiles;
+    for (int dep : deps[i])
+      ops[dep].succs.push_back(i);
+  }
+
+  // An op is submitted as soon as its last dependency finishes. The tile that finishes an op
+  // submits the successors before it's counted as done, so the group can't drain early.
+  TaskGroup group;
+  function<void(int)> fnSubmitOp = [&](int opIdx) {
+    ops[opIdx].start = chrono::high_resolution_clock::now();
+    for (int tile = 0; tile < numTiles; ++tile)
+    {
+      _pool->submit(&group, [&, opIdx, tile] {
+        int x0 = (tile % tilesX) * VM_TILE_SIZE;
+        int y0 = (tile / tilesX) * VM_TILE_SIZE;
+        VmRect rect{ x0, y0, min(x0 + VM_TILE_SIZE, _width), min(y0 + VM_TILE_SIZE, _height) };
+        // NB: a cancelled op still counts its tiles down, so the group drains
+        if (!cancelled())
+          bound[opIdx].kernel->fn(bound[opIdx].args, rect);
+
+        DagOp& op = ops[opIdx];
+        if (--op.tilesLeft == 0)
+        {
+          chrono::duration<double, milli> ms = chrono::high_resolution_clock::now() - op.start;
+          op.ms = ms.count();
+          for (int succ : op.succs)
+          {
+            if (--ops[succ].numDeps == 0)
+              fnSubmitOp(succ);
+          }
+        }
+      });
+    }
+  };
+
+  for (int i = 0; i < numOps; ++i)
+  {
+    if (deps[i].empty())
+      fnSubmitOp(i);
+  }
+
+  _pool->wait(&group);
+
+  for (int i = 0; i < numOps; ++i)
+    opMs->push_back(ops[i].ms);
+}
+
+//--------------------------------------------------------------
+void TextureVm::prepare(int width, int height, int texturesUsed)
+{
+  // aux textures that don't match the new resolution are dropped
+  if (width != _width || height != _height)
+  {
+    _textures.clear();
+    _nodeCache.clear();
+  }
+
+  _width = width;
+  _height = height;
+
+  _textures.resize(max(texturesUsed, VM_NUM_AUX_TEXTURES));
+  for (int i = 0; i < VM_NUM_AUX_TEXTURES; ++i)
+    _textures[i].resize(width, height);
+  _final.resize(width, height);
+}
+
+//--------------------------------------------------------------
+void TextureVm::allocateOutputs(const vector<VmTexture*>& outputs)
+{
+  // Pool textures only get memory if something writes to them, so the outputs that stay inside a
+  // fused pass don't cost anything. The ones this program doesn't write are freed
+  vector<bool> written(_textures.size());
+  for (VmTexture* t : outputs)
+  {
+    t->resize(_width, _height);
+    if (t >= _textures.data() && t < _textures.data() + _textures.size())
+      written[t - _textures.data()] = true;
+  }
+
+  for (size_t i = VM_NUM_AUX_TEXTURES; i < _textures.size(); ++i)
+  {
+    if (!written[i])
+      _textures[i] = VmTexture();
+  }
+}
+
+//--------------------------------------------------------------
+void TextureVm::execute(const vector<VmBoundInstr>& bound, bool storeAll)
+{
+  vector<double> opMs;
+  _stats = VmStats();
+  auto start = chrono::high_resolution_clock::now();
+
+  if (_execMode == VmExecMode::Dag && _pool)
+    runDag(bound, &opMs);
+  else
+    runSequential(bound, storeAll, &opMs);
+
+  chrono::duration<double, milli> ms = chrono::high_resolution_clock::now() - start;
+  double mpix = _width * _height / 1e6;
+
+  for (size_t i = 0; i < bound.size(); ++i)
+  {
+    _stats.ops.push_back(
+        VmStats::Op{ bound[i].kernel->op, opMs[i], mpix / max(opMs[i], 1e-6) * 1000 });
+  }
+  _stats.totalMs = ms.count();
+  _stats.mpixPerSec = mpix * bound.size() / max(_stats.totalMs, 1e-6) * 1000;
+}
+
+//--------------------------------------------------------------
+bool TextureVm::openProgram(const char* prg, size_t size)
+{
+  if (!_reader.open(prg, size))
+  {
+    printf("Invalid program: %s\n", _reader.error());
+    return false;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------
+bool TextureVm::run(const char* prg, size_t size, int width, int height)
+{
+  return openProgram(prg, size) && run(_reader, width, height);
+}
+
+//--------------------------------------------------------------
+bool TextureVm::run(const VmPrgReader& prg, int width, int height)
+{
+  prepare(width, height, prg.texturesUsed());
+  _finalNode = -1;
+  for (int& nodeId : _auxNodes)
+    nodeId = -1;
+
+  vector<VmBoundInstr> bound(prg.numOps());
+  for (u32 i = 0; i < prg.numOps(); ++i)
+    bind(prg.op(i), &bound[i]);
+
+  execute(bound, false);
+  return !cancelled();
+}
+
+//--------------------------------------------------------------
+bool TextureVm::runCached(const char* prg,
+    size_t size,
+    const vector<int>& opNodeIds,
+    const unordered_set<int>& dirtyNodes,
+    int width,
+    int height)
+{
+  return openProgram(prg, size) && runCached(_reader, opNodeIds, dirtyNodes, width, height);
+}
+
+//--------------------------------------------------------------
+bool TextureVm::runCached(const VmPrgReader& prg,
+    const vector<int>& opNodeIds,
+    const unordered_set<int>& dirtyNodes,
+    int width,
+    int height)
+{
+  if (opNodeIds.size() != prg.numOps())
+  {
+    printf("Node ids don't match the program\n");
+    return false;
+  }
+
+  prepare(width, height, prg.texturesUsed());
+
+  // drop the cached textures of nodes that aren't part of the program anymore
+  unordered_set<int> liveNodes(opNodeIds.begin(), opNodeIds.end());
+  vector<int> deadNodes;
+  for (auto& kv : _nodeCache)
+  {
+    if (!liveNodes.count(kv.first))
+      deadNodes.push_back(kv.first);
+  }
+  for (int nodeId : deadNodes)
+    uncache(nodeId);
+
+  // Every op writes to the texture of its own node instead of the shared pool textures, so an
+  // input is found by tracking which node last wrote each texture id. Aux textures that nothing
+  // in the program has written come from an earlier run.
+  unordered_map<int, int> textureOwner;
+  vector<VmBoundInstr> bound;
+  vector<int> boundNodes;
+  int finalNode = -1;
+
+  for (u32 i = 0; i < prg.numOps(); ++i)
+  {
+    const VmOpView& op = prg.op(i);
+    int nodeId = opNodeIds[i];
+
+    VmBoundInstr b;
+    bind(op, &b);
+
+    // NB: the reader has checked that pool textures are written before they're read
+    for (int j = 0; j < op.numInputs; ++j)
+    {
+      auto it = textureOwner.find(op.inputs[j]);
+      if (it != textureOwner.end())
+        b.args.inputs[j] = &_nodeCache[it->second];
+    }
+
+    textureOwner[op.output] = nodeId;
+    if (op.output == VM_FINAL_TEXTURE)
+      finalNode = nodeId;
+
+    auto it = _nodeCache.find(nodeId);
+    if (it != _nodeCache.end() && !dirtyNodes.count(nodeId))
+      continue;
+
+    VmTexture& t = _nodeCache[nodeId];
+    t.resize(width, height);
+    b.args.output = &t;
+    bound.push_back(b);
+    boundNodes.push_back(nodeId);
+  }
+
+  // the cached outputs have to be kept, so nothing is left inside the fused passes
+  execute(bound, true);
+
+  // the textures that were being written are only partly done, so they can't be reused
+  if (cancelled())
+  {
+    for (int nodeId : boundNodes)
+      uncache(nodeId);
+    return false;
+  }
+
+  // NB: the final texture isn't copied, but the aux textures are, as the next program loads them
+  // from the aux slots. That only costs a copy when the storing node was recomputed
+  unordered_set<int> recomputed(boundNodes.begin(), boundNodes.end());
+  for (auto& kv : textureOwner)
+  {
+    int id = kv.first;
+    int nodeId = kv.second;
+    if (id >= VM_NUM_AUX_TEXTURES || (_auxNodes[id] == nodeId && !recomputed.count(nodeId)))
+      continue;
+
+    _textures[id] = _nodeCache[nodeId];
+    _auxNodes[id] = nodeId;
+  }
+
+  if (finalNode != -1)
+    _finalNode = finalNode;
+
+  return true;
+}
+
+//--------------------------------------------------------------
+void TextureVm::uncache(int nodeId)
+{
+  _nodeCache.erase(nodeId);
+  if (_finalNode == nodeId)
+    _finalNode = -1;
+
+  // NB: the aux textures are copies, so they stay valid
+  for (int& auxNode : _auxNodes)
+  {
+    if (auxNode == nodeId)
+      auxNode = -1;
+  }
+}
+
+//--------------------------------------------------------------
+void TextureVm::clearCache()
+{
+  _nodeCache.clear();
+  _finalNode = -1;
+  for (int& nodeId : _auxNodes)
+    nodeId = -1;
+}
+
+//--------------------------------------------------------------
+const VmTexture& TextureVm::finalTexture() const
+{
+  // NB: the final node's texture is never erased without resetting _finalNode
+  return _finalNode == -1 ? _final : _nodeCache.find(_finalNode)->second;
+}
+
+//--------------------------------------------------------------
+const VmTexture* TextureVm::cachedTexture(int nodeId) const
+{
+  auto it = _nodeCache.find(nodeId);
+  return it == _nodeCache.end() ? nullptr : &it->second;
+}
+
+//--------------------------------------------------------------
+bool TextureVm::saveTexture(const VmTexture& texture, const string& filename)
+{
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (!f)
+    return false;
+
+  // negative scale means little-endian. Rows are stored bottom to top
+  fprintf(f, "PF\n%d %d\n-1.0\n", texture.width, texture.height);
+  vector<float> row(texture.width * 3);
+  for (int y = texture.height - 1; y >= 0; --y)
+  {
+    for (int x = 0; x < texture.width; ++x)
+    {
+      const VmColor& c = texture.pixels[y * texture.width + x];
+      row[x * 3 + 0] = c.r;
+      row[x * 3 + 1] = c.g;
+      row[x * 3 + 2] = c.b;
+    }
+    fwrite(row.data(), sizeof(float), row.size(), f);
+  }
+
+  fclose(f);
+  return true;
+}
@@ -0,0 +1,274 @@
+#pragma once
+
+#include "types.hpp"
+#include "vm_reader.hpp"
+
+#include <atomic>
+#include <stddef.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// NB: the texture vm is deliberately free of any openFrameworks/win32 dependencies, so it can be
+// built headless on machines without a gpu.
+
+// Op ids, these need to match the ids in node_templates.xml
+enum VmOpId
+{
+  VM_OP_LOAD = 1,
+  VM_OP_STORE = 2,
+  VM_OP_FINAL = 3,
+  VM_OP_FILL = 16,
+  VM_OP_RADIAL_GRADIENT = 17,
+  VM_OP_LINEAR_GRADIENT = 18,
+  VM_OP_SINUS = 19,
+  VM_OP_NOISE = 20,
+  VM_OP_MODULATE = 64,
+  VM_OP_ROTATE_SCALE = 65,
+  VM_OP_DISTORT = 66,
+  VM_OP_COLOR_GRADIENT = 67,
+};
+
+static const int VM_PRG_VERSION = 1;
+static const int VM_NUM_AUX_TEXTURES = 16;
+static const int VM_MAX_INPUTS = 3;
+static const u8 VM_FINAL_TEXTURE = 0xff;
+static const int VM_TILE_SIZE = 64;
+static const u8 VM_PATCH_TAG = 0x80;
+
+class ThreadPool;
+
+enum class VmExecMode
+{
+  // ops run one after the other, with the tiles of each op spread over the pool
+  Sequential,
+  // ops run as soon as the ops they depend on are done, so independent branches overlap
+  Dag,
+};
+
+struct VmColor
+{
+  float r, g, b, a;
+};
+
+struct VmTexture
+{
+  void resize(int w, int h);
+
+  int width = 0;
+  int height = 0;
+  std::vector<VmColor> pixels;
+};
+
+struct VmRect
+{
+  int x0, y0, x1, y1;
+};
+
+struct VmKernelArgs
+{
+  VmTexture* output;
+  const VmTexture* inputs[VM_MAX_INPUTS];
+  const char* cbuffer;
+};
+
+typedef void (*VmKernelFn)(const VmKernelArgs& args, const VmRect& rect);
+
+// A single row of pixels, for the pointwise kernels. The pointers are to the first pixel
+struct VmSpanArgs
+{
+  const char* cbuffer;
+  const VmColor* inputs[VM_MAX_INPUTS];
+  VmColor* output;
+  int x, y, count;
+  // the size of the whole texture, for the uv coordinates
+  int width, height;
+};
+
+typedef void (*VmSpanFn)(const VmSpanArgs& args);
+
+enum VmKernelFlag
+{
+  // the kernel reads input pixels other than the one it's writing, so a tile depends on every
+  // tile of its inputs, and not just the one at the same position
+  VM_KERNEL_FLAG_SAMPLES_INPUTS = 0x1,
+};
+
+struct VmKernel
+{
+  u8 op;
+  const char* name;
+  int numInputs;
+  int cbufferSize;
+  u32 flags;
+  VmKernelFn fn;
+  // the same kernel one row at a time, so chains of them can be fused. Only the pointwise
+  // kernels have one
+  VmSpanFn span;
+};
+
+// An instruction with its kernel and textures resolved
+struct VmBoundInstr
+{
+  const VmKernel* kernel;
+  VmKernelArgs args;
+};
+
+// An op of a pass. A pass is either a single op that's run with its tile kernel, or a chain of
+// pointwise ops that are run together, one row at a time
+struct VmPassStage
+{
+  const VmBoundInstr* instr;
+  // per input, the earlier stage of the pass that wrote it, or -1 to read the texture
+  int inputStages[VM_MAX_INPUTS];
+  // set if the output is needed after the pass. Otherwise it's only kept for the row
+  bool store;
+};
+
+struct VmPass
+{
+  std::vector<VmPassStage> stages;
+};
+
+struct VmStats
+{
+  struct Op
+  {
+    u8 op;
+    double ms;
+    double mpixPerSec;
+  };
+
+  std::vector<Op> ops;
+  // ops whose output never left the fused pass they were in
+  int numFusedOps = 0;
+  double totalMs = 0;
+  double mpixPerSec = 0;
+};
+
+// Sent instead of a full program when only parameters have changed. It's followed by `size` bytes
+// that replace the cbuffer of op `opIndex` of the last program, starting at `offset`.
+// NB: the tag is in the same place as the program version, so receivers can tell them apart
+#pragma pack(push, 1)
+struct VmPatch
+{
+  u8 tag = VM_PATCH_TAG;
+  u8 pad = 0;
+  u16 opIndex = 0;
+  u16 offset = 0;
+  u16 size = 0;
+};
+#pragma pack(pop)
+
+// Applies a patch message to a program, in place. The reader has to have the program open, and only
+// the patched op's cbuffer is decoded again, so the program isn't validated again
+bool vmApplyPatch(std::vector<char>* prg, VmPrgReader* reader, const char* patch, size_t size);
+
+// Returns the kernel for the given op id, or nullptr if the op is unknown
+const VmKernel* vmFindKernel(u8 op);
+
+// Returns, for each instruction, the earlier instructions it has to wait for
+void vmBuildDependencies(
+    const std::vector<VmBoundInstr>& bound, std::vector<std::vector<int>>* deps);
+
+//--------------------------------------------------------------
+// CPU reference interpreter for the texture programs. Each instruction writes a full float RGBA
+// texture at the chosen resolution.
+class TextureVm
+{
+public:
+  TextureVm();
+
+  // With a thread pool, each instruction is split into tiles that are spread over the pool
+  void setThreadPool(ThreadPool* pool) { _pool = pool; }
+
+  // NB: the dag mode needs a thread pool, otherwise the ops are run in sequence
+  void setExecMode(VmExecMode mode) { _execMode = mode; }
+
+  // Runs chains of pointwise ops as a single pass, so the intermediate textures are never written.
+  // NB: only in the sequential mode
+  void setFusion(bool enabled) { _fusion = enabled; }
+
+  // Runs check the flag between tiles, and stop once it's set. A cancelled run returns false, and
+  // the cache only keeps the textures that were complete
+  void setCancelFlag(const std::atomic<bool>* cancel) { _cancel = cancel; }
+
+  // The program is opened, which validates it, for every run. A program that's run more than once
+  // can be opened once instead, and run from its reader.
+  // NB: the reader has to have opened its program successfully
+  bool run(const char* prg, size_t size, int width, int height);
+  bool run(const VmPrgReader& prg, int width, int height);
+
+  // Runs the program, but keeps the output of each op in a cache keyed by the node that emitted
+  // it (opNodeIds comes from generateGraph). Only the ops of dirty nodes, and ops without a cached
+  // texture, are recomputed, so the caller has to include everything downstream of an edit.
+  // NB: the final texture is then the cached texture of the final node, and the aux textures are
+  // only copied when the node that stores them was recomputed
+  bool runCached(const char* prg,
+      size_t size,
+      const std::vector<int>& opNodeIds,
+      const std::unordered_set<int>& dirtyNodes,
+      int width,
+      int height);
+  bool runCached(const VmPrgReader& prg,
+      const std::vector<int>& opNodeIds,
+      const std::unordered_set<int>& dirtyNodes,
+      int width,
+      int height);
+  void clearCache();
+  const VmTexture* cachedTexture(int nodeId) const;
+
+  // Timings from the last run
+  const VmStats& stats() const { return _stats; }
+
+  const VmTexture& finalTexture() const;
+  const VmTexture* auxTexture(int idx) const;
+
+  // Writes the texture as a little-endian float pfm (rgb only)
+  static bool saveTexture(const VmTexture& texture, const std::string& filename);
+
+private:
+  bool cancelled() const { return _cancel && *_cancel; }
+  void uncache(int nodeId);
+  VmTexture* texture(u8 id);
+  void prepare(int width, int height, int texturesUsed);
+  bool openProgram(const char* prg, size_t size);
+  void bind(const VmOpView& op, VmBoundInstr* bound);
+  void allocateOutputs(const std::vector<VmTexture*>& outputs);
+  void execute(const std::vector<VmBoundInstr>& bound, bool storeAll);
+  void buildPasses(const std::vector<VmBoundInstr>& bound,
+      size_t first,
+      size_t last,
+      bool storeAll,
+      std::vector<VmPass>* passes);
+  void runSegment(const VmPass* passes, int count, std::vector<double>* opMs);
+  void runSequential(
+      const std::vector<VmBoundInstr>& bound, bool storeAll, std::vector<double>* opMs);
+  void runDag(const std::vector<VmBoundInstr>& bound, std::vector<double>* opMs);
+
+  ThreadPool* _pool = nullptr;
+  VmExecMode _execMode = VmExecMode::Sequential;
+  bool _fusion = true;
+  const std::atomic<bool>* _cancel = nullptr;
+  VmStats _stats;
+
+  int _width = 0;
+  int _height = 0;
+
+  // indexed by texture id. aux textures persist between runs, so the program can load what a
+  // previous program stored
+  std::vector<VmTexture> _textures;
+  VmTexture _final;
+
+  // NB: the cache is node based, so the textures stay put when the map rehashes
+  std::unordered_map<int, VmTexture> _nodeCache;
+  // the cached node that holds the final texture, and the one each aux texture was copied from,
+  // or -1
+  int _finalNode = -1;
+  int _auxNodes[VM_NUM_AUX_TEXTURES];
+
+  // for the runs that get the program as bytes. Reused from run to run, so opening a program only
+  // allocates when it's bigger than the last one
+  VmPrgReader _reader;
+};
@@ -0,0 +1,138 @@
+#include "thread_pool.hpp"
+
+using namespace std;
+
+// the pool and queue owned by the current thread, if it's a worker thread
+static thread_local ThreadPool* t_pool = nullptr;
+static thread_local int t_queueIdx = -1;
+
+//--------------------------------------------------------------
+ThreadPool::ThreadPool(int numThreads)
+{
+  if (numThreads <= 0)
+    numThreads = max(1, (int)thread::hardware_concurrency());
+
+  int numWorkers = numThreads - 1;
+  for (int i = 0; i < numWorkers + 1; ++i)
+    _queues.push_back(unique_ptr<Queue>(new Queue()));
+
+  for (int i = 0; i < numWorkers; ++i)
+    _threads.push_back(thread([=] { workerLoop(i); }));
+}
+
+//--------------------------------------------------------------
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<mutex> lock(_sleepMutex);
+    _done = true;
+  }
+  _wakeup.notify_all();
+
+  for (thread& t : _threads)
+    t.join();
+}
+
+//--------------------------------------------------------------
+void ThreadPool::submit(TaskGroup* group, function<void()> fn)
+{
+  group->pending++;
+
+  // workers push to their own queue, everyone else round-robins over all of them
+  int idx = t_pool == this ? t_queueIdx : (int)(_nextQueue++ % _queues.size());
+  {
+    Queue& q = *_queues[idx];
+    lock_guard<mutex> lock(q.mutex);
+    q.tasks.push_back(Task{ move(fn), group });
+  }
+
+  {
+    lock_guard<mutex> lock(_sleepMutex);
+    _numQueued++;
+  }
+  _wakeup.notify_one();
+}
+
+//--------------------------------------------------------------
+bool ThreadPool::popTask(Task* task)
+{
+  int numQueues = (int)_queues.size();
+  int ownIdx = t_pool == this ? t_queueIdx : numQueues - 1;
+
+  // first try our own queue, newest first
+  {
+    Queue& q = *_queues[ownIdx];
+    lock_guard<mutex> lock(q.mutex);
+    if (!q.tasks.empty())
+    {
+      *task = move(q.tasks.back());
+      q.tasks.pop_back();
+      return true;
+    }
+  }
+
+  // then try stealing the oldest work from the others
+  for (int i = 1; i < numQueues; ++i)
+  {
+    Queue& q = *_queues[(ownIdx + i) % numQueues];
+    lock_guard<mutex> lock(q.mutex);
+    if (!q.tasks.empty())
+    {
+      *task = move(q.tasks.front());
+      q.tasks.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+//--------------------------------------------------------------
+bool ThreadPool::runOne()
+{
+  Task task;
+  if (!popTask(&task))
+    return false;
+
+  _numQueued--;
+  task.fn();
+  task.group->pending--;
+  return true;
+}
+
+//--------------------------------------------------------------
+void ThreadPool::workerLoop(int idx)
+{
+  t_pool = this;
+  t_queueIdx = idx;
+
+  while (true)
+  {
+    if (runOne())
+      continue;
+
+    unique_lock<mutex> lock(_sleepMutex);
+    _wakeup.wait(lock, [this] { return _numQueued > 0 || _done; });
+    if (_done)
+      break;
+  }
+}
+
+//--------------------------------------------------------------
+void ThreadPool::wait(TaskGroup* group)
+{
+  while (group->pending > 0)
+  {
+    if (!runOne())
+      this_thread::yield();
+  }
+}
+
+//--------------------------------------------------------------
+void ThreadPool::parallelFor(int count, const function<void(int)>& fn)
+{
+  TaskGroup group;
+  for (int i = 0; i < count; ++i)
+    submit(&group, [&fn, i] { fn(i); });
+  wait(&group);
+}
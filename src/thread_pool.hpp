@@ -0,0 +1,66 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Tasks are submitted as part of a group, and a group can be waited on
+struct TaskGroup
+{
+  std::atomic<int> pending{ 0 };
+};
+
+//--------------------------------------------------------------
+// Work stealing thread pool. Each worker owns a queue, and pops its own work from the back
+// (newest first, to stay cache-warm), while idle workers steal from the front of the other queues.
+// Threads waiting on a group help out with the work instead of blocking.
+class ThreadPool
+{
+public:
+  // 0 threads means one per hardware thread (the thread calling wait() counts as one)
+  ThreadPool(int numThreads = 0);
+  ~ThreadPool();
+
+  void submit(TaskGroup* group, std::function<void()> fn);
+  void wait(TaskGroup* group);
+
+  // Runs fn(i) for i in [0, count), and returns when all are done
+  void parallelFor(int count, const std::function<void(int)>& fn);
+
+  int numThreads() const { return (int)_threads.size() + 1; }
+
+private:
+  struct Task
+  {
+    std::function<void()> fn;
+    TaskGroup* group;
+  };
+
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  bool runOne();
+  bool popTask(Task* task);
+  void workerLoop(int idx);
+
+  // NB: there is one more queue than worker threads. The last one is popped by threads that aren't
+  // part of the pool, and submissions from those threads are spread over all the queues
+  std::vector<std::unique_ptr<Queue>> _queues;
+  std::vector<std::thread> _threads;
+
+  std::mutex _sleepMutex;
+  std::condition_variable _wakeup;
+  std::atomic<int> _numQueued{ 0 };
+  std::atomic<u32> _nextQueue{ 0 };
+  bool _done = false;
+};
@@ -0,0 +1,151 @@
+#include "thumbnail_renderer.hpp"
+#include "ofApp.h"
+
+using namespace std;
+
+//--------------------------------------------------------------
+ThumbnailRenderer::ThumbnailRenderer(ThreadPool* pool, int size, const CompileFn& compile)
+    : _size(size), _compile(compile)
+{
+  _vm.setThreadPool(pool);
+  _vm.setCancelFlag(&_cancel);
+  _thread = thread([this] { workerLoop(); });
+}
+
+//--------------------------------------------------------------
+ThumbnailRenderer::~ThumbnailRenderer()
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    _quit = true;
+    _cancel = true;
+  }
+  _wakeup.notify_one();
+  _thread.join();
+}
+
+//--------------------------------------------------------------
+void ThumbnailRenderer::render(
+    shared_ptr<const GraphSnapshot> snapshot, const unordered_set<int>& dirtyNodes)
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    _snapshot = move(snapshot);
+    _generation++;
+    for (int id : dirtyNodes)
+      _dirtyNodes[id] = _generation;
+  }
+  _wakeup.notify_one();
+}
+
+//--------------------------------------------------------------
+void ThumbnailRenderer::clear()
+{
+  lock_guard<mutex> lock(_mutex);
+  _dirtyNodes.clear();
+  _results.clear();
+
+  // NB: the cache is cleared by the worker, once it's done with it
+  _clear = true;
+  _snapshot.reset();
+  _cancel = true;
+}
+
+//--------------------------------------------------------------
+bool ThumbnailRenderer::fetch(unordered_map<int, VmTexture>* thumbnails)
+{
+  lock_guard<mutex> lock(_mutex);
+  if (_results.empty())
+    return false;
+
+  thumbnails->clear();
+  swap(*thumbnails, _results);
+  return true;
+}
+
+//--------------------------------------------------------------
+void ThumbnailRenderer::workerLoop()
+{
+  CompiledProgram prg;
+  string error;
+  unordered_set<int> dirtyNodes;
+  vector<int> rendered;
+  // the nodes the ui has a thumbnail for
+  unordered_set<int> published;
+
+  while (true)
+  {
+    shared_ptr<const GraphSnapshot> snapshot;
+    u32 generation;
+    {
+      unique_lock<mutex> lock(_mutex);
+      _wakeup.wait(lock, [this] { return _quit || _snapshot || _clear; });
+      if (_quit)
+        return;
+
+      if (_clear)
+      {
+        _vm.clearCache();
+        published.clear();
+        _clear = false;
+      }
+
+      if (!_snapshot)
+        continue;
+
+      // NB: the flag is reset while holding the lock, so a clear from here on cancels this render
+      snapshot = move(_snapshot);
+      generation = _generation;
+      _cancel = false;
+
+      dirtyNodes.clear();
+      for (auto& kv : _dirtyNodes)
+        dirtyNodes.insert(kv.first);
+    }
+
+    // a graph that doesn't compile keeps the old thumbnails, and its nodes stay dirty
+    bool compiled = _compile(*snapshot, &prg, &error);
+    snapshot.reset();
+    if (!compiled)
+      continue;
+
+    // everything the vm is about to render
+    rendered.clear();
+    for (int id : prg.opNodeIds)
+    {
+      if (dirtyNodes.count(id) || !_vm.cachedTexture(id))
+        rendered.push_back(id);
+    }
+
+    if (!_vm.runCached(
+            prg.buf.data(), prg.buf.size(), prg.opNodeIds, dirtyNodes, _size, _size))
+    {
+      continue;
+    }
+
+    lock_guard<mutex> lock(_mutex);
+    if (_cancel)
+      continue;
+
+    // the nodes dirtied by a later render stay dirty
+    for (auto it = _dirtyNodes.begin(); it != _dirtyNodes.end();)
+    {
+      if (it->second <= generation)
+        it = _dirtyNodes.erase(it);
+      else
+        ++it;
+    }
+
+    for (int id : rendered)
+      _results[id] = *_vm.cachedTexture(id);
+
+    // nodes that dropped out of the program, because they lost an input, lose their thumbnail
+    unordered_set<int> live(prg.opNodeIds.begin(), prg.opNodeIds.end());
+    for (int id : published)
+    {
+      if (!live.count(id))
+        _results[id] = VmTexture();
+    }
+    published.swap(live);
+  }
+}
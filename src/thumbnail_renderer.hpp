@@ -0,0 +1,69 @@
+#pragma once
+
+#include "texture_vm.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+class ThreadPool;
+struct CompiledProgram;
+struct GraphSnapshot;
+
+//--------------------------------------------------------------
+// Renders a small thumbnail of every node's output on a worker thread. The graph is compiled
+// with every node that has its inputs connected, not just the ones the final texture needs, so
+// nodes that aren't wired up yet get one too.
+// The vm keeps the output of each node, so nodes that share ancestors share the work, and only the
+// dirty nodes are rendered again. A node stays dirty until a render that included it completes.
+// NB: unlike the preview, a new render doesn't cancel the one in flight, so thumbnails keep coming
+// in while a slider is being dragged
+class ThumbnailRenderer
+{
+public:
+  typedef std::function<bool(const GraphSnapshot&, CompiledProgram*, std::string*)> CompileFn;
+
+  // compile is called on the worker thread
+  ThumbnailRenderer(ThreadPool* pool, int size, const CompileFn& compile);
+  ~ThumbnailRenderer();
+
+  // dirtyNodes are the nodes edited since the last call
+  void render(std::shared_ptr<const GraphSnapshot> snapshot,
+      const std::unordered_set<int>& dirtyNodes);
+
+  // Drops the cached textures and the thumbnails not yet fetched, for when node ids get reused
+  void clear();
+
+  // Returns true if thumbnails were rendered since the last call, and swaps them into thumbnails,
+  // by node id. An empty texture means the node doesn't have a thumbnail anymore
+  bool fetch(std::unordered_map<int, VmTexture>* thumbnails);
+
+private:
+  void workerLoop();
+
+  int _size;
+  CompileFn _compile;
+  TextureVm _vm;
+  std::thread _thread;
+  std::atomic<bool> _cancel{ false };
+
+  // everything below is protected by the mutex
+  std::mutex _mutex;
+  std::condition_variable _wakeup;
+  bool _quit = false;
+  bool _clear = false;
+
+  // the latest render
+  std::shared_ptr<const GraphSnapshot> _snapshot;
+  u32 _generation = 0;
+  // node id -> the render it was dirtied by
+  std::unordered_map<int, u32> _dirtyNodes;
+
+  std::unordered_map<int, VmTexture> _results;
+};
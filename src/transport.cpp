@@ -0,0 +1,611 @@
+#include "transport.hpp"
+
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// how long a writer waits on a full ring before it assumes the receiver is gone
+static const int SHM_RING_STALL_MS = 1000;
+
+//--------------------------------------------------------------
+static bool splitAddress(const string& address, string* scheme, string* name)
+{
+  size_t colon = address.find(':');
+  if (colon == string::npos || colon + 1 == address.size())
+    return false;
+
+  *scheme = address.substr(0, colon);
+  *name = address.substr(colon + 1);
+  return true;
+}
+
+//--------------------------------------------------------------
+static u64 frameSize(size_t size)
+{
+  return (sizeof(u32) + size + 7) & ~7ull;
+}
+
+//--------------------------------------------------------------
+// Spins for a bit when waiting on the other side of the ring, and then backs off to sleeping, so
+// back to back messages don't pay for a sleep, and an idle receiver doesn't burn a core
+static void backoff(int* spins)
+{
+  if (++*spins < 256)
+    this_thread::yield();
+  else
+    this_thread::sleep_for(chrono::microseconds(100));
+}
+
+#ifdef _WIN32
+
+//--------------------------------------------------------------
+class PipeTransport : public Transport
+{
+public:
+  PipeTransport(const string& name) : _name("\\\\.\\pipe\\" + name) {}
+
+  ~PipeTransport()
+  {
+    if (_handle != INVALID_HANDLE_VALUE)
+      CloseHandle(_handle);
+  }
+
+  bool send(const char* data, size_t size) override
+  {
+    _sendThreadId = GetCurrentThreadId();
+    if (_cancelled)
+      return false;
+
+    // try to open the pipe if it isn't yet
+    if (_handle == INVALID_HANDLE_VALUE)
+      _handle = CreateFileA(_name.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+
+    if (_handle == INVALID_HANDLE_VALUE)
+      return false;
+
+    u32 header = (u32)size;
+    if (!writeAll((const char*)&header, sizeof(header)) || !writeAll(data, size))
+    {
+      CloseHandle(_handle);
+      _handle = INVALID_HANDLE_VALUE;
+      return false;
+    }
+
+    return true;
+  }
+
+  // NB: a blocked WriteFile is only unblocked by CancelSynchronousIo on the sending thread
+  void cancel() override
+  {
+    _cancelled = true;
+    DWORD threadId = _sendThreadId;
+    if (threadId == 0)
+      return;
+
+    HANDLE thread = OpenThread(THREAD_TERMINATE, FALSE, threadId);
+    if (thread)
+    {
+      CancelSynchronousIo(thread);
+      CloseHandle(thread);
+    }
+  }
+
+private:
+  bool writeAll(const char* data, size_t size)
+  {
+    while (size > 0)
+    {
+      DWORD bytesWritten = 0;
+      if (_cancelled || !WriteFile(_handle, data, (DWORD)size, &bytesWritten, NULL))
+        return false;
+
+      data += bytesWritten;
+      size -= bytesWritten;
+    }
+    return true;
+  }
+
+  string _name;
+  HANDLE _handle = INVALID_HANDLE_VALUE;
+  atomic<bool> _cancelled{ false };
+  // the thread that sends, so cancel can unblock it
+  atomic<DWORD> _sendThreadId{ 0 };
+};
+
+#else
+
+//--------------------------------------------------------------
+static bool readAll(int fd, char* data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t res = read(fd, data, size);
+    if (res < 0 && errno == EINTR)
+      continue;
+
+    if (res <= 0)
+      return false;
+
+    data += res;
+    size -= res;
+  }
+  return true;
+}
+
+//--------------------------------------------------------------
+static bool fillSocketAddress(const string& path, sockaddr_un* addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path))
+    return false;
+
+  memcpy(addr->sun_path, path.c_str(), path.size());
+  return true;
+}
+
+//--------------------------------------------------------------
+class UnixSocketTransport : public Transport
+{
+public:
+  UnixSocketTransport(const string& path) : _path(path) {}
+  ~UnixSocketTransport() { disconnect(); }
+
+  bool send(const char* data, size_t size) override
+  {
+    int fd = connect();
+    if (fd == -1)
+      return false;
+
+    // the header and the message go out in one call, so small messages are a single packet
+    u32 header = (u32)size;
+    iovec iov[2] = { { &header, sizeof(header) }, { (void*)data, size } };
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (msg.msg_iovlen > 0)
+    {
+      ssize_t res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+      if (res < 0 && errno == EINTR)
+        continue;
+
+      if (res < 0)
+      {
+        disconnect();
+        return false;
+      }
+
+      // skip past what was sent
+      while (msg.msg_iovlen > 0 && (size_t)res >= msg.msg_iov->iov_len)
+      {
+        res -= msg.msg_iov->iov_len;
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+
+      if (msg.msg_iovlen > 0)
+      {
+        msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + res;
+        msg.msg_iov->iov_len -= res;
+      }
+    }
+
+    return true;
+  }
+
+  void cancel() override
+  {
+    lock_guard<mutex> lock(_mutex);
+    _cancelled = true;
+    if (_fd != -1)
+      shutdown(_fd, SHUT_RDWR);
+  }
+
+private:
+  int connect()
+  {
+    // NB: the fd is only closed while holding the lock, so cancel can't shut down a reused fd
+    lock_guard<mutex> lock(_mutex);
+    if (_cancelled || _fd != -1)
+      return _cancelled ? -1 : _fd;
+
+    sockaddr_un addr;
+    if (!fillSocketAddress(_path, &addr))
+      return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+
+    if (::connect(fd, (const sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+      close(fd);
+      return -1;
+    }
+
+    _fd = fd;
+    return fd;
+  }
+
+  void disconnect()
+  {
+    lock_guard<mutex> lock(_mutex);
+    if (_fd != -1)
+      close(_fd);
+    _fd = -1;
+  }
+
+  string _path;
+  mutex _mutex;
+  int _fd = -1;
+  bool _cancelled = false;
+};
+
+//--------------------------------------------------------------
+class UnixSocketListener : public TransportListener
+{
+public:
+  UnixSocketListener(const string& path) : _path(path) {}
+
+  ~UnixSocketListener()
+  {
+    if (_client != -1)
+      close(_client);
+
+    if (_listen != -1)
+    {
+      close(_listen);
+      unlink(_path.c_str());
+    }
+  }
+
+  bool open()
+  {
+    sockaddr_un addr;
+    if (!fillSocketAddress(_path, &addr))
+      return false;
+
+    // remove the socket left behind by an earlier receiver
+    unlink(_path.c_str());
+    _listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    return _listen != -1 && bind(_listen, (const sockaddr*)&addr, sizeof(addr)) == 0
+           && listen(_listen, 1) == 0;
+  }
+
+  bool receive(const char** data, size_t* size) override
+  {
+    while (!_cancelled)
+    {
+      if (_client == -1)
+      {
+        _client = accept(_listen, nullptr, nullptr);
+        if (_client == -1)
+        {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+      }
+
+      // a sender that goes away just means waiting for the next one
+      u32 header;
+      if (!readAll(_client, (char*)&header, sizeof(header)))
+      {
+        close(_client);
+        _client = -1;
+        continue;
+      }
+
+      _buf.resize(header);
+      if (!readAll(_client, _buf.data(), header))
+      {
+        close(_client);
+        _client = -1;
+        continue;
+      }
+
+      *data = _buf.data();
+      *size = _buf.size();
+      return true;
+    }
+
+    return false;
+  }
+
+  void cancel() override
+  {
+    _cancelled = true;
+    shutdown(_listen, SHUT_RDWR);
+    int client = _client;
+    if (client != -1)
+      shutdown(client, SHUT_RDWR);
+  }
+
+private:
+  string _path;
+  int _listen = -1;
+  atomic<int> _client{ -1 };
+  atomic<bool> _cancelled{ false };
+  vector<char> _buf;
+};
+
+//--------------------------------------------------------------
+static ShmRingHeader* mapRing(int fd, size_t size)
+{
+  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return ptr == MAP_FAILED ? nullptr : (ShmRingHeader*)ptr;
+}
+
+//--------------------------------------------------------------
+static char* ringData(ShmRingHeader* ring)
+{
+  return (char*)ring + sizeof(ShmRingHeader);
+}
+
+//--------------------------------------------------------------
+class ShmRingTransport : public Transport
+{
+public:
+  ShmRingTransport(const string& name) : _name(name) {}
+  ~ShmRingTransport() { unmap(); }
+
+  bool send(const char* data, size_t size) override
+  {
+    if (_cancelled)
+      return false;
+
+    // a receiver that restarted has unlinked the ring this one mapped, and made a new one
+    struct stat st;
+    if (_ring && (fstat(_fd, &st) != 0 || st.st_nlink == 0))
+      unmap();
+
+    if (!_ring && !map())
+      return false;
+
+    u64 capacity = _ring->capacity;
+    u64 needed = frameSize(size);
+    if (needed > capacity)
+      return false;
+
+    // frames don't wrap, so skip the rest of the ring if this one doesn't fit
+    u64 head = _ring->head.load(memory_order_relaxed);
+    u64 pos = head % capacity;
+    u64 skip = capacity - pos < needed ? capacity - pos : 0;
+
+    int spins = 0;
+    auto start = chrono::steady_clock::now();
+    while (capacity - (head - _ring->tail.load(memory_order_acquire)) < skip + needed)
+    {
+      if (_cancelled)
+        return false;
+
+      if (chrono::steady_clock::now() - start > chrono::milliseconds(SHM_RING_STALL_MS))
+      {
+        unmap();
+        return false;
+      }
+      backoff(&spins);
+    }
+
+    char* base = ringData(_ring);
+    if (skip)
+    {
+      memcpy(base + pos, &SHM_RING_WRAP, sizeof(u32));
+      pos = 0;
+    }
+
+    u32 header = (u32)size;
+    memcpy(base + pos, &header, sizeof(header));
+    memcpy(base + pos + sizeof(header), data, size);
+    _ring->head.store(head + skip + needed, memory_order_release);
+    return true;
+  }
+
+  void cancel() override { _cancelled = true; }
+
+private:
+  bool map()
+  {
+    _fd = shm_open(_name.c_str(), O_RDWR, 0);
+    if (_fd == -1)
+      return false;
+
+    struct stat st;
+    if (fstat(_fd, &st) == 0 && (size_t)st.st_size > sizeof(ShmRingHeader))
+    {
+      _size = st.st_size;
+      _ring = mapRing(_fd, _size);
+    }
+
+    // the receiver sets the magic last, once the ring is ready
+    if (!_ring || _ring->magic != SHM_RING_MAGIC
+        || sizeof(ShmRingHeader) + _ring->capacity > _size)
+    {
+      unmap();
+      return false;
+    }
+
+    return true;
+  }
+
+  void unmap()
+  {
+    if (_ring)
+      munmap(_ring, _size);
+    _ring = nullptr;
+
+    // NB: the fd is kept open while mapped, to find out when the ring gets unlinked
+    if (_fd != -1)
+      close(_fd);
+    _fd = -1;
+  }
+
+  string _name;
+  int _fd = -1;
+  ShmRingHeader* _ring = nullptr;
+  size_t _size = 0;
+  atomic<bool> _cancelled{ false };
+};
+
+//--------------------------------------------------------------
+class ShmRingListener : public TransportListener
+{
+public:
+  ShmRingListener(const string& name) : _name(name) {}
+
+  ~ShmRingListener()
+  {
+    if (_ring)
+    {
+      munmap(_ring, _size);
+      shm_unlink(_name.c_str());
+    }
+  }
+
+  bool open(u32 capacity)
+  {
+    // NB: a ring left behind by an earlier receiver is replaced, so a sender still mapping it
+    // stalls, and then maps the new one
+    shm_unlink(_name.c_str());
+    int fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd == -1)
+      return false;
+
+    _size = sizeof(ShmRingHeader) + capacity;
+    if (ftruncate(fd, _size) == 0)
+      _ring = mapRing(fd, _size);
+    close(fd);
+
+    if (!_ring)
+    {
+      shm_unlink(_name.c_str());
+      return false;
+    }
+
+    _ring->capacity = capacity;
+    new (&_ring->head) atomic<u64>(0);
+    new (&_ring->tail) atomic<u64>(0);
+    atomic_thread_fence(memory_order_release);
+    _ring->magic = SHM_RING_MAGIC;
+    return true;
+  }
+
+  bool receive(const char** data, size_t* size) override
+  {
+    // the previous message is only released now, as the caller was still reading it
+    u64 tail = _ring->tail.load(memory_order_relaxed) + _consumed;
+    _ring->tail.store(tail, memory_order_release);
+    _consumed = 0;
+
+    u64 capacity = _ring->capacity;
+    char* base = ringData(_ring);
+    int spins = 0;
+    while (!_cancelled)
+    {
+      if (_ring->head.load(memory_order_acquire) == tail)
+      {
+        backoff(&spins);
+        continue;
+      }
+
+      u64 pos = tail % capacity;
+      u32 header;
+      memcpy(&header, base + pos, sizeof(header));
+      if (header == SHM_RING_WRAP)
+      {
+        tail += capacity - pos;
+        _ring->tail.store(tail, memory_order_release);
+        continue;
+      }
+
+      *data = base + pos + sizeof(header);
+      *size = header;
+      _consumed = frameSize(header);
+      return true;
+    }
+
+    return false;
+  }
+
+  void cancel() override { _cancelled = true; }
+
+private:
+  string _name;
+  ShmRingHeader* _ring = nullptr;
+  size_t _size = 0;
+  u64 _consumed = 0;
+  atomic<bool> _cancelled{ false };
+};
+
+#endif
+
+//--------------------------------------------------------------
+Transport* createTransport(const string& address)
+{
+  string scheme, name;
+  if (!splitAddress(address, &scheme, &name))
+    return nullptr;
+
+#ifdef _WIN32
+  if (scheme == "pipe")
+    return new PipeTransport(name);
+#else
+  if (scheme == "unix")
+    return new UnixSocketTransport(name);
+
+  if (scheme == "shm")
+    return new ShmRingTransport(name);
+#endif
+
+  return nullptr;
+}
+
+//--------------------------------------------------------------
+TransportListener* createListener(const string& address)
+{
+  string scheme, name;
+  if (!splitAddress(address, &scheme, &name))
+    return nullptr;
+
+#ifndef _WIN32
+  if (scheme == "unix")
+  {
+    UnixSocketListener* listener = new UnixSocketListener(name);
+    if (listener->open())
+      return listener;
+    delete listener;
+  }
+
+  if (scheme == "shm")
+  {
+    ShmRingListener* listener = new ShmRingListener(name);
+    if (listener->open(SHM_RING_DEFAULT_CAPACITY))
+      return listener;
+    delete listener;
+  }
+#endif
+
+  return nullptr;
+}
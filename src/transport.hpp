@@ -0,0 +1,62 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <atomic>
+#include <string>
+
+// Sends programs and patches to the renderer. Every message goes out as a frame: its size as a
+// u32, followed by the message itself, so receivers don't have to rely on the transport keeping
+// message boundaries.
+//
+// Addresses:
+//   pipe:<name>    Win32 named pipe \\.\pipe\<name> (windows only)
+//   unix:<path>    unix domain socket
+//   shm:<name>     shared memory ring buffer, as created by the receiver with shm_open
+//
+// All of them connect lazily, as the receiver can come and go; a failed send drops the connection
+// and the next send tries to connect again.
+class Transport
+{
+public:
+  virtual ~Transport() {}
+
+  // Blocks until the whole frame is sent, or returns false if it can't be
+  virtual bool send(const char* data, size_t size) = 0;
+
+  // Unblocks a send in progress on another thread, and fails all the later ones
+  virtual void cancel() {}
+};
+
+// The receiving end. Only the unix and shm transports have one.
+class TransportListener
+{
+public:
+  virtual ~TransportListener() {}
+
+  // Blocks until a message arrives, or returns false on error or cancel. The message stays
+  // valid until the next call; for shm it points straight into the ring, so nothing is copied.
+  virtual bool receive(const char** data, size_t* size) = 0;
+
+  virtual void cancel() {}
+};
+
+// Returns nullptr if the address isn't valid, or isn't supported on this platform
+Transport* createTransport(const std::string& address);
+TransportListener* createListener(const std::string& address);
+
+// The shared memory ring: the header, followed by `capacity` bytes of frames, which has to be a
+// multiple of 8. Frames are padded to 8 bytes, and never wrap: when one doesn't fit before the
+// end, the writer puts down a SHM_RING_WRAP marker and starts again at the front.
+// head and tail are the total bytes written and consumed, so head - tail is the used size.
+static const u32 SHM_RING_MAGIC = 0x676e6972;
+static const u32 SHM_RING_WRAP = 0xffffffff;
+static const u32 SHM_RING_DEFAULT_CAPACITY = 16 * 1024 * 1024;
+
+struct ShmRingHeader
+{
+  u32 magic;
+  u32 capacity;
+  alignas(64) std::atomic<u64> head;
+  alignas(64) std::atomic<u64> tail;
+};
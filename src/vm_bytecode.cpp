@@ -0,0 +1,226 @@
+#include "vm_bytecode.hpp"
+
+#include <string.h>
+
+using namespace std;
+
+//--------------------------------------------------------------
+static void writeVarint(vector<char>* buf, u32 v)
+{
+  while (v >= 0x80)
+  {
+    buf->push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  buf->push_back((char)v);
+}
+
+//--------------------------------------------------------------
+template <typename T>
+static void append(vector<char>* buf, const T& v)
+{
+  size_t pos = buf->size();
+  buf->resize(pos + sizeof(T));
+  memcpy(buf->data() + pos, &v, sizeof(T));
+}
+
+//--------------------------------------------------------------
+bool vmParamQuantized(u8 encoding)
+{
+  return encoding == VM_PARAM_Q16 || encoding == VM_PARAM_Q8 || encoding == VM_PARAM_I8;
+}
+
+//--------------------------------------------------------------
+int vmParamSize(u8 encoding)
+{
+  switch (encoding)
+  {
+  case VM_PARAM_F32:
+  case VM_PARAM_I32:
+    return 4;
+  case VM_PARAM_Q16:
+    return 2;
+  case VM_PARAM_Q8:
+  case VM_PARAM_I8:
+    return 1;
+  }
+  return 0;
+}
+
+//--------------------------------------------------------------
+void vmEncodeParams(const VmParamLayout& layout, const char* cbuffer, vector<char>* out)
+{
+  size_t size = 0;
+  for (const VmParamField& field : layout)
+    size += vmParamSize(field.encoding);
+
+  size_t pos = out->size();
+  out->resize(pos + size);
+  char* dst = out->data() + pos;
+  for (const VmParamField& field : layout)
+  {
+    const char* src = cbuffer;
+    cbuffer += sizeof(u32);
+    float range = field.maxValue - field.minValue;
+
+    switch (field.encoding)
+    {
+    case VM_PARAM_F32:
+    case VM_PARAM_I32:
+      memcpy(dst, src, sizeof(u32));
+      dst += sizeof(u32);
+      break;
+
+    case VM_PARAM_Q16:
+    case VM_PARAM_Q8:
+    {
+      float v;
+      memcpy(&v, src, sizeof(float));
+      float t = range > 0 ? (v - field.minValue) / range : 0;
+      t = t < 0 ? 0 : t > 1 ? 1 : t;
+      if (field.encoding == VM_PARAM_Q16)
+      {
+        u16 q = (u16)(t * 0xffff + 0.5f);
+        memcpy(dst, &q, sizeof(u16));
+        dst += sizeof(u16);
+      }
+      else
+      {
+        *dst++ = (char)(u8)(t * 0xff + 0.5f);
+      }
+      break;
+    }
+
+    case VM_PARAM_I8:
+    {
+      int v;
+      memcpy(&v, src, sizeof(int));
+      v -= (int)field.minValue;
+      *dst++ = (char)(u8)(v < 0 ? 0 : v > 0xff ? 0xff : v);
+      break;
+    }
+    }
+  }
+}
+
+//--------------------------------------------------------------
+static bool sameLayout(const VmParamLayout& a, const VmParamLayout& b)
+{
+  if (a.size() != b.size())
+    return false;
+
+  for (size_t i = 0; i < a.size(); ++i)
+  {
+    if (a[i].encoding != b[i].encoding)
+      return false;
+
+    // NB: the bounds of the unquantized encodings aren't stored, so they don't matter
+    if (vmParamQuantized(a[i].encoding)
+        && (a[i].minValue != b[i].minValue || a[i].maxValue != b[i].maxValue))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//--------------------------------------------------------------
+VmProgramWriter::VmProgramWriter(int version) : _version(version) {}
+
+//--------------------------------------------------------------
+u32 VmProgramWriter::addLayout(const VmParamLayout& layout)
+{
+  for (u32 i = 0; i < _layoutList.size(); ++i)
+  {
+    if (sameLayout(_layoutList[i], layout))
+      return i;
+  }
+
+  _layoutList.push_back(layout);
+  writeVarint(&_layouts, (u32)layout.size());
+  for (const VmParamField& field : layout)
+  {
+    _layouts.push_back((char)field.encoding);
+    if (vmParamQuantized(field.encoding))
+    {
+      append(&_layouts, field.minValue);
+      append(&_layouts, field.maxValue);
+    }
+  }
+  return (u32)_layoutList.size() - 1;
+}
+
+//--------------------------------------------------------------
+void VmProgramWriter::addOp(
+    u8 op, u8 output, const u8* inputs, int numInputs, u32 layout, const char* cbuffer)
+{
+  _numOps++;
+  const VmParamLayout& fields = _layoutList[layout];
+
+  if (_version == VM_PRG_VERSION)
+  {
+    size_t cbufferSize = fields.size() * sizeof(u32);
+    _ops.push_back((char)op);
+    _ops.push_back((char)output);
+    _ops.push_back((char)numInputs);
+    _ops.insert(_ops.end(), (const char*)inputs, (const char*)inputs + numInputs);
+    append(&_ops, (u16)cbufferSize);
+    _paramPos.push_back((int)_ops.size());
+    _ops.insert(_ops.end(), cbuffer, cbuffer + cbufferSize);
+    return;
+  }
+
+  _ops.push_back((char)op);
+  _ops.push_back((char)output);
+  writeVarint(&_ops, numInputs);
+  _ops.insert(_ops.end(), (const char*)inputs, (const char*)inputs + numInputs);
+  writeVarint(&_ops, layout);
+
+  _paramPos.push_back((int)_params.size());
+  vmEncodeParams(fields, cbuffer, &_params);
+}
+
+//--------------------------------------------------------------
+void VmProgramWriter::finish(u8 texturesUsed, vector<char>* prg, vector<int>* opParamPos)
+{
+  prg->clear();
+  prg->push_back((char)_version);
+  prg->push_back((char)texturesUsed);
+
+  int paramsStart;
+  if (_version == VM_PRG_VERSION)
+  {
+    paramsStart = (int)prg->size();
+    prg->insert(prg->end(), _ops.begin(), _ops.end());
+  }
+  else
+  {
+    vector<char> layoutCount, opCount;
+    writeVarint(&layoutCount, (u32)_layoutList.size());
+    writeVarint(&opCount, _numOps);
+
+    writeVarint(prg, 3);
+    prg->push_back(VM_SECTION_LAYOUTS);
+    writeVarint(prg, (u32)(layoutCount.size() + _layouts.size()));
+    prg->push_back(VM_SECTION_OPS);
+    writeVarint(prg, (u32)(opCount.size() + _ops.size()));
+    prg->push_back(VM_SECTION_PARAMS);
+    writeVarint(prg, (u32)_params.size());
+
+    prg->reserve(prg->size() + layoutCount.size() + _layouts.size() + opCount.size()
+                 + _ops.size() + _params.size());
+    prg->insert(prg->end(), layoutCount.begin(), layoutCount.end());
+    prg->insert(prg->end(), _layouts.begin(), _layouts.end());
+    prg->insert(prg->end(), opCount.begin(), opCount.end());
+    prg->insert(prg->end(), _ops.begin(), _ops.end());
+    paramsStart = (int)prg->size();
+    prg->insert(prg->end(), _params.begin(), _params.end());
+  }
+
+  if (opParamPos)
+  {
+    opParamPos->clear();
+    for (int pos : _paramPos)
+      opParamPos->push_back(paramsStart + pos);
+  }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "texture_vm.hpp"
+
+#include <vector>
+
+// Version 2 of the program encoding. Version 1 is the header, followed by the ops with fixed size
+// fields and their cbuffers as the kernels read them. Version 2 is:
+//   u8 version, u8 textures used
+//   varint section count, and per section: u8 id, varint size
+//   the sections, in the order of the table. Unknown sections are skipped
+//
+// Sections:
+//   layouts: varint count, and per layout: varint field count, and per field: u8 encoding, and
+//            f32 min and max for the quantized encodings
+//   ops:     varint count, and per op: u8 op, u8 output, varint input count, u8 inputs,
+//            varint layout
+//   params:  the encoded params of each op, back to back, in op order
+//
+// A layout says how each 32 bit value of a cbuffer is stored, so the ops of the same node type
+// share one. The params are fixed size for a given layout, so they can still be patched in place.
+// The texture ids stay bytes, so the inputs, and the cbuffers of the layouts that aren't
+// quantized, are read in place (see vm_reader.hpp).
+// NB: like everything the vm reads, the encoding is little-endian
+static const int VM_PRG_VERSION_2 = 2;
+
+enum VmSectionId
+{
+  VM_SECTION_LAYOUTS = 1,
+  VM_SECTION_OPS = 2,
+  VM_SECTION_PARAMS = 3,
+};
+
+// How a single 32 bit cbuffer value is stored. The quantized ones are clamped to [min, max]
+enum VmParamEncoding
+{
+  VM_PARAM_F32,
+  VM_PARAM_I32,
+  // float, quantized to 16 or 8 bits between min and max
+  VM_PARAM_Q16,
+  VM_PARAM_Q8,
+  // int, as an offset from min
+  VM_PARAM_I8,
+};
+
+struct VmParamField
+{
+  u8 encoding = VM_PARAM_F32;
+  float minValue = 0;
+  float maxValue = 0;
+};
+
+typedef std::vector<VmParamField> VmParamLayout;
+
+// Returns the encoded size of a value
+int vmParamSize(u8 encoding);
+
+// Quantized values are stored with their min and max in the layout
+bool vmParamQuantized(u8 encoding);
+
+// Appends the encoded cbuffer, which has one 32 bit value per field of the layout
+void vmEncodeParams(const VmParamLayout& layout, const char* cbuffer, std::vector<char>* out);
+
+//--------------------------------------------------------------
+// Writes programs in either version. Version 1 only uses the size of the layouts, and writes the
+// cbuffers as is
+class VmProgramWriter
+{
+public:
+  explicit VmProgramWriter(int version);
+
+  // Returns the id of the layout, for addOp. Adding the same one again returns the same id
+  u32 addLayout(const VmParamLayout& layout);
+
+  // cbuffer has one 32 bit value per field of the layout
+  void addOp(u8 op, u8 output, const u8* inputs, int numInputs, u32 layout, const char* cbuffer);
+
+  // opParamPos gets where each op's params start in the program
+  void finish(u8 texturesUsed, std::vector<char>* prg, std::vector<int>* opParamPos);
+
+private:
+  int _version;
+  u32 _numOps = 0;
+  std::vector<char> _ops;
+  std::vector<char> _params;
+  // relative to the start of _ops for version 1, and to _params for version 2
+  std::vector<int> _paramPos;
+
+  std::vector<VmParamLayout> _layoutList;
+  std::vector<char> _layouts;
+};
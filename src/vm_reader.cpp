@@ -0,0 +1,461 @@
+#include "vm_reader.hpp"
+#include "texture_vm.hpp"
+#include "vm_bytecode.hpp"
+
+#include <string.h>
+
+using namespace std;
+
+//--------------------------------------------------------------
+static bool readVarint(const u8** ptr, const u8* end, u32* v)
+{
+  u32 res = 0;
+  for (int shift = 0; shift < 35 && *ptr < end; shift += 7)
+  {
+    u8 b = *(*ptr)++;
+    res |= (u32)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+    {
+      *v = res;
+      return true;
+    }
+  }
+  return false;
+}
+
+//--------------------------------------------------------------
+// NB: the counts and indices in the ops are almost always a single byte
+static inline bool readSmallVarint(const u8** ptr, const u8* end, u32* v)
+{
+  if (*ptr < end && **ptr < 0x80)
+  {
+    *v = *(*ptr)++;
+    return true;
+  }
+  return readVarint(ptr, end, v);
+}
+
+//--------------------------------------------------------------
+// NB: only for validated programs
+static inline u32 readVarintUnchecked(const u8** ptr)
+{
+  u8 b = *(*ptr)++;
+  if (b < 0x80)
+    return b;
+
+  u32 res = b & 0x7f;
+  for (int shift = 7;; shift += 7)
+  {
+    b = *(*ptr)++;
+    res |= (u32)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return res;
+  }
+}
+
+//--------------------------------------------------------------
+bool VmPrgReader::fail(const char* error)
+{
+  _error = error;
+  return false;
+}
+
+//--------------------------------------------------------------
+bool VmPrgReader::open(const char* prg, size_t size)
+{
+  _begin = (const u8*)prg;
+  _end = _begin + size;
+  _error = nullptr;
+  _ops.clear();
+  _curOp = 0;
+  _layouts.clear();
+  _fields.clear();
+  _runs.clear();
+  _decoded.clear();
+
+  if (size < 2)
+    return fail("program too small");
+
+  bool valid;
+  if (version() == VM_PRG_VERSION)
+    valid = validateV1();
+  else if (version() == VM_PRG_VERSION_2)
+    valid = validateV2();
+  else
+    return fail("unsupported program version");
+
+  // NB: an invalid program reads as empty
+  if (!valid)
+    _ops.clear();
+
+  return valid;
+}
+
+//--------------------------------------------------------------
+// What an op can do with each texture id
+static const u8 TEXTURE_READ = 1;
+static const u8 TEXTURE_WRITE = 2;
+
+//--------------------------------------------------------------
+const VmKernel* VmPrgReader::findKernel(const VmOpView& op)
+{
+  // the kernels read exactly the inputs and cbuffer the template has
+  const VmKernel* kernel = vmFindKernel(op.op);
+  if (!kernel)
+  {
+    fail("unknown op");
+    return nullptr;
+  }
+
+  if (op.cbufferSize != kernel->cbufferSize)
+  {
+    fail("cbuffer size doesn't match the op");
+    return nullptr;
+  }
+  return kernel;
+}
+
+//--------------------------------------------------------------
+void VmPrgReader::initTextureAccess(u8* access)
+{
+  // Texture ids are the aux textures, then the pool up to the texture count. Only the final
+  // texture is outside of that, and it's write only.
+  // NB: aux textures can come from an earlier program, but pool textures can't, so they're only
+  // readable once they're written
+  memset(access, 0, 256);
+  for (int i = 0; i < 256; ++i)
+  {
+    if (i < VM_NUM_AUX_TEXTURES)
+      access[i] = TEXTURE_READ | TEXTURE_WRITE;
+    else if (i < texturesUsed())
+      access[i] = TEXTURE_WRITE;
+  }
+  access[VM_FINAL_TEXTURE] = TEXTURE_WRITE;
+}
+
+//--------------------------------------------------------------
+inline bool VmPrgReader::validateOp(const VmOpView& op, const VmKernel* kernel, u8* access)
+{
+  if (op.numInputs != kernel->numInputs)
+    return fail("wrong number of inputs for the op");
+
+  if (!(access[op.output] & TEXTURE_WRITE))
+    return fail("invalid output texture");
+
+  for (int i = 0; i < op.numInputs; ++i)
+  {
+    u8 input = op.inputs[i];
+    if (!(access[input] & TEXTURE_READ))
+    {
+      return fail(access[input] & TEXTURE_WRITE ? "texture read before it's written"
+                                                : "invalid input texture");
+    }
+
+    if (input == op.output)
+      return fail("op reads its own output");
+  }
+
+  if (op.output != VM_FINAL_TEXTURE)
+    access[op.output] |= TEXTURE_READ;
+  return true;
+}
+
+//--------------------------------------------------------------
+bool VmPrgReader::validateV1()
+{
+  u8 access[256];
+  initTextureAccess(access);
+  const u8* ptr = _begin + 2;
+  VmOpView op;
+  op.quantized = false;
+  op.layout = 0;
+  while (ptr < _end)
+  {
+    // op, output, num inputs
+    if (_end - ptr < 3)
+      return fail("truncated instruction");
+
+    op.op = ptr[0];
+    op.output = ptr[1];
+    op.numInputs = ptr[2];
+    ptr += 3;
+
+    if (op.numInputs > VM_MAX_INPUTS || _end - ptr < op.numInputs + 2)
+      return fail("truncated instruction");
+
+    op.inputs = ptr;
+    ptr += op.numInputs;
+
+    memcpy(&op.paramsSize, ptr, sizeof(u16));
+    ptr += sizeof(u16);
+    if (_end - ptr < op.paramsSize)
+      return fail("truncated cbuffer");
+
+    op.params = (const char*)ptr;
+    op.cbuffer = op.params;
+    op.cbufferSize = op.paramsSize;
+    ptr += op.paramsSize;
+
+    const VmKernel* kernel = findKernel(op);
+    if (!kernel || !validateOp(op, kernel, access))
+      return false;
+    _ops.push_back(op);
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+bool VmPrgReader::validateLayouts(const u8* ptr, const u8* end)
+{
+  u32 numLayouts;
+  if (!readVarint(&ptr, end, &numLayouts))
+    return fail("truncated layouts");
+
+  // NB: every layout takes at least a byte, which bounds what a bad count can allocate
+  if (numLayouts > VM_MAX_LAYOUTS || numLayouts > (u32)(end - ptr))
+    return fail("too many layouts");
+
+  _layouts.resize(numLayouts);
+  for (Layout& layout : _layouts)
+  {
+    u32 numFields;
+    // NB: the cbuffer size is a u16
+    if (!readVarint(&ptr, end, &numFields) || numFields > 0xffff / sizeof(u32))
+      return fail("invalid layout");
+
+    if (numFields > VM_MAX_LAYOUT_FIELDS - _fields.size() || numFields > (u32)(end - ptr))
+      return fail("too many layout fields");
+
+    layout.firstRun = (u32)_runs.size();
+    layout.numRuns = 0;
+    layout.numFields = (u16)numFields;
+    layout.encodedSize = 0;
+    layout.quantized = false;
+    layout.kernel = nullptr;
+    for (u32 j = 0; j < numFields; ++j)
+    {
+      if (ptr == end)
+        return fail("truncated layouts");
+
+      u8 encoding = *ptr++;
+      int size = vmParamSize(encoding);
+      if (size == 0)
+        return fail("unknown param encoding");
+
+      if (layout.numRuns == 0 || _runs.back().encoding != encoding)
+      {
+        _runs.push_back(Run{ encoding, 0, (u32)_fields.size() });
+        layout.numRuns++;
+      }
+      _runs.back().numFields++;
+
+      // the scale and offset are worked out here, so decoding is a multiply-add per value
+      Field field = { 0, 0 };
+      if (vmParamQuantized(encoding))
+      {
+        float minMax[2];
+        if (end - ptr < (ptrdiff_t)sizeof(minMax))
+          return fail("truncated layouts");
+
+        memcpy(minMax, ptr, sizeof(minMax));
+        ptr += sizeof(minMax);
+        float range = minMax[1] - minMax[0];
+        field.offset = minMax[0];
+        field.scale = encoding == VM_PARAM_Q16 ? range / 0xffff : range / 0xff;
+        layout.quantized = true;
+      }
+      _fields.push_back(field);
+      layout.encodedSize += (u16)size;
+    }
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+bool VmPrgReader::validateV2()
+{
+  // the section table comes first, and the bodies follow in the same order
+  const u8* ptr = _begin + 2;
+  u32 numSections;
+  if (!readVarint(&ptr, _end, &numSections))
+    return fail("truncated section table");
+
+  const u8* table = ptr;
+  for (u32 i = 0; i < numSections; ++i)
+  {
+    u32 size;
+    if (ptr == _end || (ptr++, !readVarint(&ptr, _end, &size)))
+      return fail("truncated section table");
+  }
+
+  const u8* sections[VM_SECTION_PARAMS + 1][2] = {};
+  const u8* body = ptr;
+  ptr = table;
+  for (u32 i = 0; i < numSections; ++i)
+  {
+    u8 id = *ptr++;
+    u32 size = readVarintUnchecked(&ptr);
+    if ((size_t)(_end - body) < size)
+      return fail("truncated section");
+
+    // NB: unknown sections are skipped
+    if (id <= VM_SECTION_PARAMS)
+    {
+      sections[id][0] = body;
+      sections[id][1] = body + size;
+    }
+    body += size;
+  }
+
+  const u8** layouts = sections[VM_SECTION_LAYOUTS];
+  const u8** ops = sections[VM_SECTION_OPS];
+  const u8** params = sections[VM_SECTION_PARAMS];
+  if (!layouts[0] || !ops[0] || !params[0])
+    return fail("missing section");
+
+  if (!validateLayouts(layouts[0], layouts[1]))
+    return false;
+
+  ptr = ops[0];
+  const u8* end = ops[1];
+  u32 numOps;
+  if (!readVarint(&ptr, end, &numOps))
+    return fail("truncated ops");
+
+  // NB: an op takes at least 4 bytes, which bounds what a bad count can allocate
+  if (numOps > (u32)(end - ptr) / 4)
+    return fail("truncated ops");
+
+  u8 access[256];
+  initTextureAccess(access);
+  _ops.resize(numOps);
+  const char* opParams = (const char*)params[0];
+  const char* paramsEnd = (const char*)params[1];
+  size_t decodedSize = 0;
+  for (VmOpView& op : _ops)
+  {
+    u32 numInputs, layoutIdx;
+    if (end - ptr < 2)
+      return fail("truncated instruction");
+
+    op.op = ptr[0];
+    op.output = ptr[1];
+    ptr += 2;
+    if (!readSmallVarint(&ptr, end, &numInputs) || numInputs > VM_MAX_INPUTS
+        || (u32)(end - ptr) < numInputs)
+    {
+      return fail("truncated instruction");
+    }
+
+    op.numInputs = (u8)numInputs;
+    op.inputs = ptr;
+    ptr += numInputs;
+    if (!readSmallVarint(&ptr, end, &layoutIdx) || layoutIdx >= _layouts.size())
+      return fail("invalid layout index");
+
+    Layout& layout = _layouts[layoutIdx];
+    if (paramsEnd - opParams < layout.encodedSize)
+      return fail("truncated params");
+
+    op.params = opParams;
+    op.paramsSize = layout.encodedSize;
+    op.quantized = layout.quantized;
+    op.layout = (u16)layoutIdx;
+    op.cbuffer = op.params;
+    op.cbufferSize = (u16)(layout.numFields * sizeof(u32));
+    opParams += layout.encodedSize;
+    if (layout.quantized)
+      decodedSize += op.cbufferSize;
+
+    // the compiler writes a layout per op type, so the kernel is mostly only checked once
+    const VmKernel* kernel = layout.kernel;
+    if (!kernel || kernel->op != op.op)
+    {
+      kernel = findKernel(op);
+      if (!kernel)
+        return false;
+      layout.kernel = kernel;
+    }
+
+    if (!validateOp(op, kernel, access))
+      return false;
+  }
+
+  if (opParams != paramsEnd)
+    return fail("params don't match the ops");
+
+  // NB: the decoded cbuffers are only placed once they're all sized, as the storage can move
+  _decoded.resize(decodedSize);
+  char* dst = _decoded.data();
+  for (VmOpView& op : _ops)
+  {
+    if (op.quantized)
+    {
+      decodeCBuffer(op, dst);
+      op.cbuffer = dst;
+      dst += op.cbufferSize;
+    }
+  }
+
+  return true;
+}
+
+//--------------------------------------------------------------
+void VmPrgReader::updateCBuffer(u32 idx)
+{
+  // NB: a quantized op's cbuffer is in the reader's own storage
+  const VmOpView& op = _ops[idx];
+  if (op.quantized)
+    decodeCBuffer(op, _decoded.data() + (op.cbuffer - _decoded.data()));
+}
+
+//--------------------------------------------------------------
+void VmPrgReader::decodeCBuffer(const VmOpView& op, char* dst) const
+{
+  const Layout& layout = _layouts[op.layout];
+  const Run* run = _runs.data() + layout.firstRun;
+  const Run* end = run + layout.numRuns;
+  const u8* src = (const u8*)op.params;
+  for (; run != end; ++run)
+  {
+    const Field* field = _fields.data() + run->firstField;
+    int n = run->numFields;
+    switch (run->encoding)
+    {
+    case VM_PARAM_F32:
+    case VM_PARAM_I32:
+      memcpy(dst, src, n * sizeof(u32));
+      src += n * sizeof(u32);
+      dst += n * sizeof(u32);
+      break;
+
+    case VM_PARAM_Q16:
+      for (int i = 0; i < n; ++i, src += sizeof(u16), dst += sizeof(float))
+      {
+        u16 q;
+        memcpy(&q, src, sizeof(u16));
+        float v = field[i].offset + q * field[i].scale;
+        memcpy(dst, &v, sizeof(float));
+      }
+      break;
+
+    case VM_PARAM_Q8:
+      for (int i = 0; i < n; ++i, src++, dst += sizeof(float))
+      {
+        float v = field[i].offset + *src * field[i].scale;
+        memcpy(dst, &v, sizeof(float));
+      }
+      break;
+
+    case VM_PARAM_I8:
+      for (int i = 0; i < n; ++i, src++, dst += sizeof(int))
+      {
+        int v = (int)field[i].offset + *src;
+        memcpy(dst, &v, sizeof(int));
+      }
+      break;
+    }
+  }
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <stddef.h>
+#include <vector>
+
+// Reads programs as written by ofApp::generateGraph, in either version, in place. The program is
+// validated once when it's opened: the version, the structure, every op against its kernel, and
+// every texture id. The ops are put in a table, and the quantized cbuffers are decoded, at the
+// same time, so running a program again only reads the table, and a patch only touches its op.
+// The tables are sized from the program, and a reader that's reused for the next program keeps
+// them, so it only allocates when a program is bigger than the ones before.
+// NB: like the texture vm, this is free of openFrameworks
+
+// Version 2 programs with more layouts, or more layout fields in total, than this are rejected.
+// The compiler writes one layout per op type
+static const int VM_MAX_LAYOUTS = 256;
+static const int VM_MAX_LAYOUT_FIELDS = 1024;
+
+struct VmKernel;
+
+// An op, pointing into the program
+struct VmOpView
+{
+  u8 op;
+  u8 output;
+  u8 numInputs;
+  const u8* inputs;
+
+  // the params as they're stored. Unless they're quantized, they're the cbuffer the kernel reads
+  const char* params;
+  u16 paramsSize;
+  bool quantized;
+  u16 layout;
+
+  // what the kernel reads: the params, or the reader's decoded copy of them
+  const char* cbuffer;
+  u16 cbufferSize;
+};
+
+//--------------------------------------------------------------
+class VmPrgReader
+{
+public:
+  // Validates the whole program, and returns false if anything is off, see error()
+  // NB: the memory has to outlive the reader, or the next open
+  bool open(const char* prg, size_t size);
+  const char* error() const { return _error; }
+
+  int version() const { return _begin[0]; }
+  int texturesUsed() const { return _begin[1]; }
+  u32 numOps() const { return (u32)_ops.size(); }
+  const VmOpView& op(u32 idx) const { return _ops[idx]; }
+
+  // Reads the ops in order. next returns false after the last one
+  void rewind() { _curOp = 0; }
+  bool next(VmOpView* op)
+  {
+    if (_curOp == _ops.size())
+      return false;
+
+    *op = _ops[_curOp++];
+    return true;
+  }
+
+  // Decodes the cbuffer of the op again, after its params were changed in place
+  void updateCBuffer(u32 idx);
+
+private:
+  // What turns a field's stored value back into the 32 bit one
+  struct Field
+  {
+    float offset;
+    float scale;
+  };
+
+  // Consecutive fields with the same encoding, so decoding only switches once for them
+  struct Run
+  {
+    u8 encoding;
+    u16 numFields;
+    u32 firstField;
+  };
+
+  struct Layout
+  {
+    u32 firstRun;
+    u16 numRuns;
+    u16 numFields;
+    u16 encodedSize;
+    bool quantized;
+    // the last kernel the layout was checked against
+    const VmKernel* kernel;
+  };
+
+  bool fail(const char* error);
+  bool validateV1();
+  bool validateV2();
+  bool validateLayouts(const u8* ptr, const u8* end);
+  const VmKernel* findKernel(const VmOpView& op);
+  void initTextureAccess(u8* access);
+  bool validateOp(const VmOpView& op, const VmKernel* kernel, u8* access);
+  void decodeCBuffer(const VmOpView& op, char* dst) const;
+
+  const u8* _begin = nullptr;
+  const u8* _end = nullptr;
+  const char* _error = nullptr;
+
+  std::vector<VmOpView> _ops;
+  u32 _curOp = 0;
+
+  // version 2
+  std::vector<Layout> _layouts;
+  std::vector<Field> _fields;
+  std::vector<Run> _runs;
+  // the quantized cbuffers, decoded, in op order
+  std::vector<char> _decoded;
+};
@@ -0,0 +1,397 @@
+#include "xml_stream.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+//--------------------------------------------------------------
+string xmlFloatToString(float v)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%g", v);
+  if (strtof(buf, nullptr) != v)
+    snprintf(buf, sizeof(buf), "%.9g", v);
+  return buf;
+}
+
+//--------------------------------------------------------------
+static bool isNameChar(char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'
+         || c == '-' || c == '.' || c == ':';
+}
+
+//--------------------------------------------------------------
+static void decodeEntities(const char* start, const char* end, string* res)
+{
+  res->clear();
+  for (const char* p = start; p < end; ++p)
+  {
+    if (*p != '&')
+    {
+      res->push_back(*p);
+      continue;
+    }
+
+    static const struct
+    {
+      const char* entity;
+      char c;
+    } entities[] = {
+      { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' }, { "&apos;", '\'' },
+    };
+
+    bool found = false;
+    for (const auto& e : entities)
+    {
+      size_t len = strlen(e.entity);
+      if ((size_t)(end - p) >= len && memcmp(p, e.entity, len) == 0)
+      {
+        res->push_back(e.c);
+        p += len - 1;
+        found = true;
+        break;
+      }
+    }
+
+    // numeric references, ascii only
+    if (!found && end - p > 3 && p[1] == '#')
+    {
+      const char* semi = (const char*)memchr(p, ';', end - p);
+      if (semi)
+      {
+        bool hex = p[2] == 'x';
+        long v = strtol(p + (hex ? 3 : 2), nullptr, hex ? 16 : 10);
+        res->push_back((char)v);
+        p = semi;
+        found = true;
+      }
+    }
+
+    if (!found)
+      res->push_back('&');
+  }
+}
+
+//--------------------------------------------------------------
+bool XmlReader::open(const string& filename)
+{
+  FILE* f = fopen(filename.c_str(), "rb");
+  if (!f)
+    return false;
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  vector<char> buf(size);
+  bool ok = size == 0 || fread(buf.data(), 1, size, f) == (size_t)size;
+  fclose(f);
+
+  if (ok)
+    openMemory(buf.data(), buf.size());
+  return ok;
+}
+
+//--------------------------------------------------------------
+void XmlReader::openMemory(const char* data, size_t size)
+{
+  // NB: zero terminated, so the scanning doesn't need bounds checks everywhere
+  _buf.assign(data, data + size);
+  _buf.push_back(0);
+  _pos = 0;
+  _line = 1;
+  _pendingEnd = false;
+  _stack.clear();
+  _numAttributes = 0;
+  _error.clear();
+}
+
+//--------------------------------------------------------------
+XmlEvent XmlReader::fail(const char* msg)
+{
+  _error = msg;
+  return XmlEvent::Error;
+}
+
+//--------------------------------------------------------------
+void XmlReader::skipSpace()
+{
+  while (_buf[_pos] == ' ' || _buf[_pos] == '\t' || _buf[_pos] == '\r' || _buf[_pos] == '\n')
+  {
+    if (_buf[_pos] == '\n')
+      _line++;
+    _pos++;
+  }
+}
+
+//--------------------------------------------------------------
+bool XmlReader::skipPast(const char* str)
+{
+  const char* start = _buf.data() + _pos;
+  const char* found = strstr(start, str);
+  if (!found)
+    return false;
+
+  for (const char* p = start; p < found; ++p)
+    _line += *p == '\n';
+
+  _pos = found - _buf.data() + strlen(str);
+  return true;
+}
+
+//--------------------------------------------------------------
+bool XmlReader::parseName(string* name)
+{
+  size_t start = _pos;
+  while (isNameChar(_buf[_pos]))
+    _pos++;
+
+  name->assign(_buf.data() + start, _pos - start);
+  return _pos > start;
+}
+
+//--------------------------------------------------------------
+bool XmlReader::parseAttributes()
+{
+  _numAttributes = 0;
+  while (true)
+  {
+    skipSpace();
+    char c = _buf[_pos];
+    if (c == '>' || c == '/' || c == 0)
+      return true;
+
+    if (_numAttributes == _attributes.size())
+      _attributes.emplace_back();
+    pair<string, string>& attr = _attributes[_numAttributes++];
+
+    if (!parseName(&attr.first))
+      return false;
+
+    skipSpace();
+    if (_buf[_pos++] != '=')
+      return false;
+    skipSpace();
+
+    char quote = _buf[_pos++];
+    if (quote != '"' && quote != '\'')
+      return false;
+
+    const char* start = _buf.data() + _pos;
+    const char* end = strchr(start, quote);
+    if (!end)
+      return false;
+
+    for (const char* p = start; p < end; ++p)
+      _line += *p == '\n';
+
+    decodeEntities(start, end, &attr.second);
+    _pos = end - _buf.data() + 1;
+  }
+}
+
+//--------------------------------------------------------------
+XmlEvent XmlReader::next()
+{
+  // the end of a self-closing element
+  if (_pendingEnd)
+  {
+    _pendingEnd = false;
+    _numAttributes = 0;
+    return XmlEvent::EndElement;
+  }
+
+  while (true)
+  {
+    // skip any text content
+    const char* start = _buf.data() + _pos;
+    const char* tag = strchr(start, '<');
+    if (!tag)
+    {
+      _pos = _buf.size() - 1;
+      return _stack.empty() ? XmlEvent::EndOfFile : fail("unexpected end of file");
+    }
+
+    for (const char* p = start; p < tag; ++p)
+      _line += *p == '\n';
+    _pos = tag - _buf.data() + 1;
+
+    char c = _buf[_pos];
+    if (c == '?')
+    {
+      if (!skipPast("?>"))
+        return fail("unterminated declaration");
+      continue;
+    }
+
+    if (c == '!')
+    {
+      bool comment = strncmp(_buf.data() + _pos, "!--", 3) == 0;
+      if (!skipPast(comment ? "-->" : ">"))
+        return fail("unterminated comment");
+      continue;
+    }
+
+    if (c == '/')
+    {
+      _pos++;
+      if (!parseName(&_name))
+        return fail("malformed end tag");
+
+      skipSpace();
+      if (_buf[_pos++] != '>')
+        return fail("malformed end tag");
+
+      if (_stack.empty() || _stack.back() != _name)
+        return fail("mismatched end tag");
+
+      _stack.pop_back();
+      _numAttributes = 0;
+      return XmlEvent::EndElement;
+    }
+
+    if (!parseName(&_name))
+      return fail("malformed start tag");
+
+    if (!parseAttributes())
+      return fail("malformed attribute");
+
+    if (_buf[_pos] == '/')
+    {
+      _pos++;
+      _pendingEnd = true;
+    }
+    else
+    {
+      _stack.push_back(_name);
+    }
+
+    if (_buf[_pos++] != '>')
+      return fail("malformed start tag");
+
+    return XmlEvent::StartElement;
+  }
+}
+
+//--------------------------------------------------------------
+const string* XmlReader::attribute(const char* name) const
+{
+  for (size_t i = 0; i < _numAttributes; ++i)
+  {
+    if (_attributes[i].first == name)
+      return &_attributes[i].second;
+  }
+  return nullptr;
+}
+
+//--------------------------------------------------------------
+XmlWriter::~XmlWriter()
+{
+  close();
+}
+
+//--------------------------------------------------------------
+bool XmlWriter::open(const string& filename)
+{
+  close();
+  _file = fopen(filename.c_str(), "wb");
+  return _file != nullptr;
+}
+
+//--------------------------------------------------------------
+bool XmlWriter::close()
+{
+  if (!_file)
+    return false;
+
+  while (!_stack.empty())
+    endElement();
+
+  bool ok = !ferror(_file);
+  ok &= fclose(_file) == 0;
+  _file = nullptr;
+  return ok;
+}
+
+//--------------------------------------------------------------
+void XmlWriter::indent()
+{
+  for (size_t i = 0; i < _stack.size(); ++i)
+    fputs("    ", _file);
+}
+
+//--------------------------------------------------------------
+void XmlWriter::closeStartTag()
+{
+  if (_startTagOpen)
+  {
+    fputs(">\n", _file);
+    _startTagOpen = false;
+  }
+}
+
+//--------------------------------------------------------------
+void XmlWriter::writeEscaped(const string& str)
+{
+  for (char c : str)
+  {
+    switch (c)
+    {
+      case '&': fputs("&amp;", _file); break;
+      case '<': fputs("&lt;", _file); break;
+      case '>': fputs("&gt;", _file); break;
+      case '"': fputs("&quot;", _file); break;
+      default: fputc(c, _file); break;
+    }
+  }
+}
+
+//--------------------------------------------------------------
+void XmlWriter::beginElement(const char* name)
+{
+  closeStartTag();
+  indent();
+  fprintf(_file, "<%s", name);
+  _stack.push_back(name);
+  _startTagOpen = true;
+}
+
+//--------------------------------------------------------------
+void XmlWriter::attribute(const char* name, const string& value)
+{
+  fprintf(_file, " %s=\"", name);
+  writeEscaped(value);
+  fputc('"', _file);
+}
+
+//--------------------------------------------------------------
+void XmlWriter::attribute(const char* name, int value)
+{
+  fprintf(_file, " %s=\"%d\"", name, value);
+}
+
+//--------------------------------------------------------------
+void XmlWriter::attribute(const char* name, float value)
+{
+  fprintf(_file, " %s=\"%s\"", name, xmlFloatToString(value).c_str());
+}
+
+//--------------------------------------------------------------
+void XmlWriter::endElement()
+{
+  const char* name = _stack.back();
+  _stack.pop_back();
+
+  if (_startTagOpen)
+  {
+    fputs(" />\n", _file);
+    _startTagOpen = false;
+  }
+  else
+  {
+    indent();
+    fprintf(_file, "</%s>\n", name);
+  }
+}
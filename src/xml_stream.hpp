@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Streaming xml reader and writer, for files too large to build a DOM for. Only what the graph
+// files need is supported: elements, attributes and the standard entities. Text content,
+// comments, the declaration and doctype are skipped.
+// NB: free of openFrameworks, like the texture vm
+
+// Formats a float with the shortest of 6 or 9 significant digits that reads back as the same
+// value, so saving is lossless without making every value unreadable
+std::string xmlFloatToString(float v);
+
+enum class XmlEvent
+{
+  StartElement,
+  EndElement,
+  EndOfFile,
+  Error,
+};
+
+//--------------------------------------------------------------
+// Pull parser: each call to next() returns the next start or end tag. Self-closing elements
+// return a start followed by an end. The file is read in one go, and tokenized in a single pass.
+class XmlReader
+{
+public:
+  bool open(const std::string& filename);
+  // NB: the memory is copied
+  void openMemory(const char* data, size_t size);
+
+  XmlEvent next();
+
+  // the current element
+  const std::string& name() const { return _name; }
+
+  // Returns the decoded attribute value, or nullptr if the current element doesn't have it
+  const std::string* attribute(const char* name) const;
+
+  int line() const { return _line; }
+  const std::string& error() const { return _error; }
+
+private:
+  XmlEvent fail(const char* msg);
+  bool skipPast(const char* str);
+  bool parseName(std::string* name);
+  bool parseAttributes();
+  void skipSpace();
+
+  std::vector<char> _buf;
+  size_t _pos = 0;
+  int _line = 1;
+  bool _pendingEnd = false;
+  std::vector<std::string> _stack;
+
+  std::string _name;
+  // NB: reused between elements, so parsing doesn't allocate once the strings have grown
+  std::vector<std::pair<std::string, std::string>> _attributes;
+  size_t _numAttributes = 0;
+
+  std::string _error;
+};
+
+//--------------------------------------------------------------
+// Writes elements straight to the file, in the same layout as TinyXML (4 space indents, empty
+// elements self-closed), so the output matches what ofxXmlSettings saves
+class XmlWriter
+{
+public:
+  ~XmlWriter();
+
+  bool open(const std::string& filename);
+  // Returns false if anything failed to write
+  bool close();
+
+  void beginElement(const char* name);
+  // attributes have to be added before any child elements
+  void attribute(const char* name, const std::string& value);
+  void attribute(const char* name, int value);
+  void attribute(const char* name, float value);
+  void endElement();
+
+private:
+  void closeStartTag();
+  void indent();
+  void writeEscaped(const std::string& str);
+
+  FILE* _file = nullptr;
+  std::vector<const char*> _stack;
+  // the start tag is left open until we know if the element has children
+  bool _startTagOpen = false;
+};